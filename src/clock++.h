@@ -0,0 +1,248 @@
+/*
+ clock++.h -- low-overhead clock sources for instrumentation
+ Copyright (C) 2012 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HAVE_CLOCKPP_H
+#define HAVE_CLOCKPP_H
+
+#include <sys/time.h>
+#include <time.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "time++.h"
+
+/*!
+ @brief Clock sources for timestamps in PerfLog, Io and the like
+
+ Clock::REALTIME and Clock::MONOTONIC are clock_gettime(), Clock::TSC reads
+ the time stamp counter of the CPU, which costs a few ns instead of a
+ (v)syscall. The TSC is only used if the CPU reports an invariant TSC (constant
+ rate in all power states), it is calibrated against CLOCK_MONOTONIC on first
+ use (which takes ~10 ms) and then again at most every second, from within
+ the first now() call after that second. If the measured rate drifts by
+ more than 500 ppm or the counter goes backwards (e.g. unsynchronised
+ sockets), the TSC is abandoned and Clock::TSC falls back to CLOCK_MONOTONIC
+ for good. Timestamps from Clock::TSC are therefore always comparable with
+ CLOCK_MONOTONIC ones.
+
+ Clock::TSC never goes backwards. When a recalibration finds it ahead of
+ CLOCK_MONOTONIC, it runs up to SLEW_PPM slower until it is back in line,
+ rather than stepping back. After falling back, CLOCK_MONOTONIC readings are
+ clamped to the last TSC time until they pass it.
+
+ All of this is header-only, the calibration is shared process-wide.
+ */
+class Clock {
+public:
+	typedef enum {
+		REALTIME=0,												//!< Wall-clock time (like gettimeofday())
+		MONOTONIC,												//!< CLOCK_MONOTONIC
+		TSC																//!< Calibrated TSC, CLOCK_MONOTONIC if unusable
+	} source_t;
+
+	static int64_t nsec(const source_t src) { //!< Current time of src in ns
+		if (src == TSC)
+			return tsc_nsec();
+		struct timespec ts;
+		clock_gettime(src == REALTIME ? CLOCK_REALTIME : CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+	}
+	static struct timeval timeval(const source_t src) { //!< Current time of src as struct timeval
+		const int64_t ns = nsec(src);
+		struct timeval tv;
+		tv.tv_sec = ns / NSEC_PER_SEC;
+		tv.tv_usec = (ns % NSEC_PER_SEC) / 1000;
+		return tv;
+	}
+	static MonoTime now() { return MonoTime(tsc_nsec()); } //!< Fastest available monotonic time
+
+	static bool tsc_usable() { return __atomic_load_n(&tsc().usable, __ATOMIC_RELAXED); } //!< Is Clock::TSC really using the TSC?
+	static double tsc_ghz() { return tsc_usable() ? 4294967296.0 / tsc().rate : 0; } //!< Calibrated TSC frequency
+
+private:
+	static const int64_t RECAL_NS = 1000000000; //!< Recalibrate after this long (must stay < 4 s to avoid overflow)
+	static const int64_t CAL_NS = 10000000;	//!< Duration of the initial calibration
+	static const int64_t SLEW_PPM = 1000;	//!< Maximum rate correction to remove an offset from CLOCK_MONOTONIC
+
+	/*!
+	 @brief TSC calibration, ns = ns0 + ((tsc - tsc0) * mult) >> 32
+
+	 Protected by a sequence counter: the (single) writer makes seq odd while
+	 updating, readers retry if seq was odd or changed.
+	 */
+	struct tscstate {
+		unsigned int seq;
+		int lock;													//!< Held by the thread recalibrating
+		bool usable;
+		uint64_t tsc0;
+		int64_t ns0;											//!< Also the lower bound for CLOCK_MONOTONIC after falling back
+		uint64_t mult;										//!< ns per tick << 32, including slew
+		uint64_t rate;										//!< Measured ns per tick << 32
+		uint64_t maxdelta;								//!< Recalibrate when tsc - tsc0 exceeds this
+		uint64_t tscref;									//!< Long baseline to measure the rate against
+		int64_t nsref;
+	};
+
+	static int64_t mono_nsec() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	static uint64_t rdtsc() { return __builtin_ia32_rdtsc(); }
+	static bool tsc_invariant() {
+		unsigned int a, b, c, d;
+		if (!__get_cpuid(0x80000000, &a, &b, &c, &d) || a < 0x80000007)
+			return false;
+		__get_cpuid(0x80000007, &a, &b, &c, &d);
+		return d & (1 << 8);
+	}
+#else
+	static uint64_t rdtsc() { return 0; }
+	static bool tsc_invariant() { return false; }
+#endif
+
+	//! Read TSC and CLOCK_MONOTONIC at (nearly) the same moment
+	static void sample(uint64_t &tsc, int64_t &ns) {
+		uint64_t best = ~(uint64_t) 0;
+		tsc = 0;
+		ns = 0;
+		for (int i=0; i<5; i++) {
+			const uint64_t t1 = rdtsc();
+			const int64_t n = mono_nsec();
+			const uint64_t t2 = rdtsc();
+			if (t2 - t1 < best) {
+				best = t2 - t1;
+				tsc = t1 + (t2 - t1) / 2;
+				ns = n;
+			}
+		}
+	}
+
+	static tscstate calibrate() {
+		tscstate s;
+		s.seq = 0;
+		s.lock = 0;
+		s.usable = false;
+		s.mult = 0;
+		sample(s.tsc0, s.ns0);
+		if (!tsc_invariant())
+			return s;
+
+		struct timespec wait = {0, CAL_NS};
+		nanosleep(&wait, NULL);
+		uint64_t tsc1;
+		int64_t ns1;
+		sample(tsc1, ns1);
+
+		// Accept 100 MHz to 20 GHz
+		const uint64_t ticks = tsc1 - s.tsc0;
+		const int64_t ns = ns1 - s.ns0;
+		if (tsc1 <= s.tsc0 || ns <= 0 || ticks < (uint64_t) ns / 10 || ticks > (uint64_t) ns * 20)
+			return s;
+
+		s.mult = s.rate = ((uint64_t) ns << 32) / ticks;
+		s.maxdelta = ((uint64_t) RECAL_NS << 32) / s.mult;
+		s.tscref = s.tsc0;
+		s.nsref = s.ns0;
+		s.tsc0 = tsc1;
+		s.ns0 = ns1;
+		s.usable = true;
+		return s;
+	}
+
+	static tscstate &tsc() {
+		static tscstate state = calibrate();
+		return state;
+	}
+
+	static int64_t tsc_nsec() {
+		tscstate &s = tsc();
+		unsigned int seq;
+		uint64_t tsc0, mult, maxdelta, ticks;
+		int64_t ns0;
+		do {
+			seq = __atomic_load_n(&s.seq, __ATOMIC_ACQUIRE);
+			if (!__atomic_load_n(&s.usable, __ATOMIC_ACQUIRE)) {
+				const int64_t ns = mono_nsec(), floor = __atomic_load_n(&s.ns0, __ATOMIC_RELAXED);
+				return ns > floor ? ns : floor;
+			}
+			tsc0 = __atomic_load_n(&s.tsc0, __ATOMIC_RELAXED);
+			ns0 = __atomic_load_n(&s.ns0, __ATOMIC_RELAXED);
+			mult = __atomic_load_n(&s.mult, __ATOMIC_RELAXED);
+			maxdelta = __atomic_load_n(&s.maxdelta, __ATOMIC_RELAXED);
+			// Inside the loop: a recalibration that starts after this check samples later
+			ticks = rdtsc();
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while ((seq & 1) || seq != __atomic_load_n(&s.seq, __ATOMIC_RELAXED));
+
+		const uint64_t delta = ticks - tsc0;
+		if (delta > maxdelta)
+			return recalibrate(s, ns0 + (int64_t) ((long double) delta * mult / 4294967296.0L));
+		return ns0 + (int64_t) ((delta * mult) >> 32);
+	}
+
+	//! Re-measure the TSC rate over the whole baseline, returns the current time (at least ext)
+	static int64_t recalibrate(tscstate &s, const int64_t ext) {
+		// Someone else is busy, CLOCK_MONOTONIC is correct as well unless we are ahead of it
+		if (__atomic_exchange_n(&s.lock, 1, __ATOMIC_ACQUIRE)) {
+			const int64_t ns = mono_nsec();
+			return ext > ns ? ext : ns;
+		}
+
+		// Readers retry while seq is odd, so none extrapolates the old 
+		// calibration beyond the sample taken here
+		__atomic_store_n(&s.seq, s.seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		uint64_t tsc;
+		int64_t ns;
+		sample(tsc, ns);
+
+		// Where the old calibration thinks we are, and the rate over the baseline
+		const int64_t cur = tsc > s.tsc0 ? s.ns0 + (int64_t) ((long double) (tsc - s.tsc0) * s.mult / 4294967296.0L) : s.ns0;
+		const long double rate = (long double) (ns - s.nsref) * 4294967296.0L / (long double) (tsc - s.tscref);
+		const bool ok = tsc > s.tsc0 && (rate - s.rate) < s.rate * 500e-6L && (s.rate - rate) < s.rate * 500e-6L;
+
+		// Never step back in time w.r.t. what readers may already have seen. 
+		// If that is ahead of CLOCK_MONOTONIC, run slower until the next 
+		// recalibration to make up for (part of) the difference.
+		const int64_t now = cur > ns ? cur : ns;
+		const int64_t slew = now - ns < RECAL_NS / 1000000 * SLEW_PPM ? now - ns : RECAL_NS / 1000000 * SLEW_PPM;
+
+		s.ns0 = now;
+		if (ok) {
+			s.tsc0 = tsc;
+			s.rate = (uint64_t) rate;
+			s.mult = (uint64_t) (rate * (RECAL_NS - slew) / RECAL_NS);
+			s.maxdelta = ((uint64_t) RECAL_NS << 32) / s.mult;
+		} else {
+			__atomic_store_n(&s.usable, false, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&s.seq, s.seq + 1, __ATOMIC_RELEASE);
+
+		__atomic_store_n(&s.lock, 0, __ATOMIC_RELEASE);
+		return now;
+	}
+};
+
+#endif // HAVE_CLOCKPP_H
@@ -17,15 +17,173 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/poll.h>
+
 #include <fstream>
 #include <string>
+#include <vector>
 
 #include "config.h"
 
 using namespace std;
 
-void config::parse() {
+config::config(const config &other): current(new snapshot), watchfd(-1), inotifyfd(-1), watching(false), filename(other.filename), prefix(other.prefix), autosave(other.autosave) {
+	publish(other.getall(), true);
+	slot_changed = other.slot_changed;
+}
+
+config &config::operator =(const config &other) {
+	if(this == &other)
+		return *this;
+	
+	bool rewatch = watching;
+	unwatch();
+	filename = other.filename;
+	prefix = other.prefix;
+	autosave = other.autosave;
+	publish(other.getall(), true);
+	slot_changed = other.slot_changed;
+	if(rewatch)
+		watch();
+	
+	return *this;
+}
+
+config::~config() {
+	if(autosave)
+		write();
+	unwatch();
+	
+	for(section_t::iterator i = cells.begin(); i != cells.end(); ++i) {
+		delete i->second->value;
+		delete i->second;
+	}
+	delete get();
+}
+
+void config::entry::assign(const string &value) {
+	str = value;
+	i = strtoimax(str.c_str(), NULL, 0);
+	u = strtoumax(str.c_str(), NULL, 0);
+	d = strtod(str.c_str(), NULL);
+	b = (str == "yes" || str == "true");
+}
+
+void config::snapshot::index() {
+	for(section_t::const_iterator it = variables.begin(); it != variables.end(); ++it) {
+		const string &name = it->first;
+		for(size_t dot = name.find('.'); dot != string::npos; dot = name.find('.', dot + 1))
+			sections[name.substr(0, dot)][name.substr(dot + 1)] = it->second;
+	}
+}
+
+const config::cell *config::findcell(const string &var) const {
+	const snapshot *s = get();
+	
+	if(prefix.empty()) {
+		section_t::const_iterator it = s->variables.find(var);
+		return (it == s->variables.end()) ? NULL : it->second;
+	}
+	
+	tr1::unordered_map<string, section_t>::const_iterator sec = s->sections.find(prefix);
+	if(sec == s->sections.end())
+		return NULL;
+	section_t::const_iterator it = sec->second.find(var);
+	return (it == sec->second.end()) ? NULL : it->second;
+}
+
+config::handle config::gethandle(const string &var) const {
+	pthread::rcu::reader r(&readers);
+	const cell *c = findcell(var);
+	if(!c || !c->get())
+		throw exception("Variable " + pvar(var) + " is required");
+	return handle(this, c);
+}
+
+void config::store(const string &name, const string &value) {
+	map<string, string> vars;
+	vars[name] = value;
+	publish(vars, false);
+}
+
+void config::publish(const map<string, string> &vars, bool replace) {
+	vector<string> changed;
+	
+	{
+		pthread::mutexholder h(&writemutex);
+		const snapshot *old = get();
+		vector<const entry *> replaced;
+		bool renamed = false;						// Were names added or removed
+		
+		// Values are replaced in place, cells live as long as we do, so handles
+		// keep working
+		for(map<string, string>::const_iterator i = vars.begin(); i != vars.end(); ++i) {
+			cell *&c = cells[i->first];
+			if(!c)
+				c = new cell;
+			
+			const entry *prev = c->value;
+			if(prev && prev->str == i->second)
+				continue;
+			
+			entry *e = new entry;
+			e->assign(i->second);
+			__atomic_store_n(&c->value, (const entry *) e, __ATOMIC_RELEASE);
+			if(prev)
+				replaced.push_back(prev);
+			else
+				renamed = true;
+			changed.push_back(i->first);
+		}
+		
+		if(replace) {
+			for(section_t::const_iterator i = old->variables.begin(); i != old->variables.end(); ++i) {
+				if(vars.find(i->first) != vars.end())
+					continue;
+				replaced.push_back(i->second->value);
+				__atomic_store_n(&i->second->value, (const entry *) NULL, __ATOMIC_RELEASE);
+				renamed = true;
+				changed.push_back(i->first);
+			}
+		}
+		
+		if(changed.empty())
+			return;
+		
+		// Only a new set of names needs a new snapshot
+		const snapshot *prevsnap = NULL;
+		if(renamed) {
+			snapshot *s = new snapshot;
+			for(section_t::const_iterator i = cells.begin(); i != cells.end(); ++i)
+				if(i->second->value)
+					s->variables.insert(*i);
+			s->index();
+			prevsnap = __atomic_exchange_n(&current, (const snapshot *) s, __ATOMIC_SEQ_CST);
+		}
+		
+		// Free what was replaced once no reader can be using it anymore
+		readers.synchronize();
+		delete prevsnap;
+		for(size_t i = 0; i < replaced.size(); i++)
+			delete replaced[i];
+	}
+	
+	if(!slot_changed.empty())
+		for(size_t i = 0; i < changed.size(); i++)
+			slot_changed(changed[i]);
+}
+
+bool config::readfile(map<string, string> &vars) const {
 	ifstream file(filename.c_str());
+	if(!file)
+		return false;
+	
 	string line, variable, value;
 	size_t b, e;
 
@@ -35,52 +193,158 @@ void config::parse() {
 			continue;
 		if(line[b] == '#')
 			continue;
-		e = line.find_first_of(" \t", b);
+		e = line.find_first_of(" \t=", b);
 		if(e == string::npos)
 			e = line.size();
-		variable = line.substr(b, e);
+		variable = line.substr(b, e - b);
 		b = line.find_first_not_of(" =\t", e);
 		if(b == string::npos)
 			continue;
 		e = line.find_last_not_of(" \t");
-		if(e == string::npos)
-			e = line.size();
-		value = line.substr(b, e);
-		variables[variable] = value;
-	}	
+		value = line.substr(b, e - b + 1);
+		vars[variable] = value;
+	}
+	
+	return true;
+}
+
+void config::parse() {
+	map<string, string> vars;
+	readfile(vars);
+	publish(vars, false);
+}
+
+bool config::reload() {
+	map<string, string> vars;
+	if(!readfile(vars))
+		return false;
+	publish(vars, true);
+	return true;
+}
+
+bool config::watch() {
+	if(watching)
+		return true;
+	
+	// Watch the directory, editors often replace the file instead of writing it
+	string dir = Path(filename).dirname().str();
+	if(dir.empty())
+		dir = ".";
+	
+	inotifyfd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if(inotifyfd < 0)
+		return false;
+	
+	watchfd = eventfd(0, EFD_CLOEXEC);
+	if(watchfd < 0 || inotify_add_watch(inotifyfd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		if(watchfd >= 0)
+			close(watchfd);
+		close(inotifyfd);
+		watchfd = inotifyfd = -1;
+		return false;
+	}
+	
+	watching = true;
+	watchthr.create(sigc::mem_fun(*this, &config::watcher));
+	return true;
+}
+
+void config::unwatch() {
+	if(!watching)
+		return;
+	
+	__atomic_store_n(&watching, false, __ATOMIC_RELEASE);
+	
+	// The watcher must have stopped before its descriptors are closed. If it 
+	// cannot be woken up (which should not happen), cancel it in poll().
+	uint64_t one = 1;
+	ssize_t n;
+	while((n = ::write(watchfd, &one, sizeof one)) < 0 && errno == EINTR)
+		continue;
+	if(n != sizeof one)
+		watchthr.cancel();
+	watchthr.join();
+	close(watchfd);
+	close(inotifyfd);
+	watchfd = inotifyfd = -1;
+}
+
+void config::watcher() {
+	string base = Path(filename).basename().str();
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	
+	while(__atomic_load_n(&watching, __ATOMIC_ACQUIRE)) {
+		struct pollfd pfd[2] = {{inotifyfd, POLLIN}, {watchfd, POLLIN}};
+		if(poll(pfd, 2, -1) < 0) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		if(pfd[1].revents)
+			break;
+		
+		bool modified = false;
+		ssize_t len;
+		while((len = read(inotifyfd, buf, sizeof buf)) > 0) {
+			for(char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+				struct inotify_event *ev = (struct inotify_event *) p;
+				if(ev->len && base == ev->name)
+					modified = true;
+			}
+		}
+		
+		if(modified)
+			reload();
+	}
 }
 
 void config::write() {
 	ofstream file(filename.c_str());
-
-	for(map<string, string>::const_iterator i = variables.begin(); i != variables.end(); ++i)
+	
+	// Sort the output so files stay diffable
+	map<string, string> all = getall();
+	for(map<string, string>::const_iterator i = all.begin(); i != all.end(); ++i)
 		file << i->first << " = " << i->second << "\n";
 }
 
+map<string, string> config::getall() const {
+	pthread::rcu::reader r(&readers);
+	const snapshot *s = get();
+	map<string, string> all;
+	for(section_t::const_iterator i = s->variables.begin(); i != s->variables.end(); ++i) {
+		const entry *e = i->second->get();
+		if(e)
+			all[i->first] = e->str;
+	}
+	return all;
+}
+
 void config::update(config *cfg) {
-	map<string, string> other_vars = cfg->getall();
 	string pref = cfg->prefix;
+	map<string, string> other_vars = cfg->getall();
+	map<string, string> vars;
 	
 	// Loop over other variables (with prefix), update here
 	for(map<string, string>::const_iterator i = other_vars.begin(); i != other_vars.end(); ++i)
 		if (i->first.compare(0, pref.length(), pref) == 0)
-			variables[i->first] = i->second;
+			vars[i->first] = i->second;
 	
+	publish(vars, false);
 }
 
-int config::getchoice(const string &var, const map<string, int> &choices) {
-	require(var);
-	map<string, int>::const_iterator i = choices.find(variables[pvar(var)]);
+int config::getchoice(const string &var, const map<string, int> &choices) const {
+	map<string, int>::const_iterator i = choices.find(getstring(var));
 	if(i == choices.end())
 		throw exception("Unknown choice for variable " + pvar(var));
 	return i->second;
 }
 
-int config::getchoice(const string &var, const map<string, int> &choices, int def) {
-	if(variables[pvar(var)].empty())
+int config::getchoice(const string &var, const map<string, int> &choices, int def) const {
+	const string str = getstring(var, "");
+	if(str.empty())
 		return def;
 
-	map<string, int>::const_iterator i = choices.find(variables[var]);
+	map<string, int>::const_iterator i = choices.find(str);
 	if(i == choices.end())
 		throw exception("Unknown choice for variable " + pvar(var));
 	return i->second;
@@ -89,7 +353,7 @@ int config::getchoice(const string &var, const map<string, int> &choices, int de
 void config::setchoice(const string &var, const map<string, int> &choices, int value) {
 	for(map<string, int>::const_iterator i = choices.begin(); i != choices.end(); ++i) {
 		if(i->second == value) {
-			variables[pvar(var)] = i->first;
+			store(pvar(var), i->first);
 			return;
 		}
 	}
@@ -37,29 +37,137 @@
 #include <stdexcept>
 #include <string>
 #include <map>
+#include <tr1/unordered_map>
 
+#include <sigc++/slot.h>
+
+#include "pthread++.h"
 #include "path++.h"
 #include "format.h"
 
+/*! @brief Configuration variables, read from and written to a file
+ 
+ Every name has a cell that holds its current, immutable value. set() 
+ replaces the value in place, only adding or removing names replaces the 
+ snapshot that maps names to cells. All get*() calls and handles read 
+ without locking, also while another thread calls set() or the file is 
+ reloaded. Writers (set(), parse(), reload(), update()) are serialised 
+ internally, and free replaced values once no reader can use them anymore 
+ (see pthread::rcu).
+ 
+ Call watch() to reload the file whenever it changes on disk. After each 
+ change, slot_changed is called for each variable that was added, changed 
+ or removed.
+ */
 class config {
-	std::map<std::string, std::string> variables;
-	std::string pvar(const std::string &var) {
+public:
+	/*! @brief One configuration value, parsed once when it is stored */
+	struct entry {
+		std::string str;
+		int64_t i;
+		uint64_t u;
+		double d;
+		bool b;
+		entry(): i(0), u(0), d(0), b(false) {}
+		void assign(const std::string &value);
+	};
+
+	class exception: public std::runtime_error {
+		public:
+		exception(const std::string reason): runtime_error(reason) {}
+	};
+
+private:
+	/*! @brief Value of one name, kept as long as the config exists */
+	struct cell {
+		const entry *value;								//!< Current value (NULL if absent), replaced (never modified) by writers
+		cell(): value(NULL) {}
+		const entry *get() const { return __atomic_load_n(&value, __ATOMIC_ACQUIRE); }
+	};
+
+public:
+	/*! @brief Pre-resolved reference to one variable
+	 
+	 Get a handle once with gethandle() and read it in the hot path without 
+	 any name lookups or parsing. Handles always read the current value, 
+	 also after set() or a reload. If the variable was removed by a reload, 
+	 valid() returns false and the getters return 0 or "".
+	 */
+	class handle {
+		const config *cfg;
+		const cell *c;
+		template<typename T> T get(T entry::*field) const { pthread::rcu::reader r(&cfg->readers); const entry *e = c->get(); return e ? e->*field : T(); }
+		public:
+		handle(const config *cfg, const cell *c): cfg(cfg), c(c) {}
+		bool valid() const { return c->get(); }
+		bool getbool() const { return get(&entry::b); }
+		int getint() const { return (int) get(&entry::i); }
+		double getdouble() const { return get(&entry::d); }
+		uint16_t getuint16() const { return (uint16_t) get(&entry::u); }
+		int16_t getint16() const { return (int16_t) get(&entry::i); }
+		uint32_t getuint32() const { return (uint32_t) get(&entry::u); }
+		int32_t getint32() const { return (int32_t) get(&entry::i); }
+		uint64_t getuint64() const { return get(&entry::u); }
+		int64_t getint64() const { return get(&entry::i); }
+		std::string getstring() const { return get(&entry::str); }
+	};
+
+private:
+	typedef std::tr1::unordered_map<std::string, cell *> section_t;
+
+	/*! @brief Names of the present variables, replaced as a whole when one is added or removed */
+	struct snapshot {
+		section_t variables;							//!< All variables by full name
+		std::tr1::unordered_map<std::string, section_t> sections; //!< For every prefix "a" or "a.b" of a name "a.b.c", the remainder of the name
+		void index();											//!< Rebuild sections from variables
+	};
+	
+	const snapshot *current;						//!< Published snapshot, only accessed atomically
+	section_t cells;										//!< Cell of every name ever stored, also of removed ones (writers only)
+	pthread::rcu readers;								//!< Read sections of getters and handles
+	pthread::mutex writemutex;					//!< Serialises writers
+	
+	int watchfd;												//!< eventfd to stop watcher()
+	int inotifyfd;
+	bool watching;											//!< Is watcher() running (atomic)
+	pthread::thread watchthr;
+	void watcher();
+	
+	const snapshot *get() const { return __atomic_load_n(&current, __ATOMIC_ACQUIRE); }
+	
+	std::string pvar(const std::string &var) const {
 		if (prefix != "") return prefix + "." + var;
 		else return var;
 	}
 	
+	// Only call these inside a pthread::rcu::reader on readers
+	const cell *findcell(const std::string &var) const; //!< Look up var (relative to prefix), NULL if absent
+	const entry *find(const std::string &var) const { const cell *c = findcell(var); return c ? c->get() : NULL; }
+	const entry &need(const std::string &var) const { const entry *e = find(var); if(!e) throw exception("Variable " + pvar(var) + " is required"); return *e; }
+	
+	template<typename T> T value(const std::string &var, T entry::*field) const { pthread::rcu::reader r(&readers); return need(var).*field; }
+	template<typename T> T value(const std::string &var, T entry::*field, const T def) const { pthread::rcu::reader r(&readers); const entry *e = find(var); return e ? e->*field : def; }
+	
+	void store(const std::string &name, const std::string &value); //!< Store value under full name
+	void publish(const std::map<std::string, std::string> &vars, bool replace); //!< Merge vars into (or replace by vars) the current variables
+	bool readfile(std::map<std::string, std::string> &vars) const;
+	
 public:
 	std::string filename;
 	std::string prefix;
 	bool autosave;
 
-	config(const Path &path, const std::string &prefix = ""): filename(path.str()), prefix(prefix), autosave(false) { parse(); }
-	config(const std::string &filename, const std::string &prefix = ""): filename(filename), prefix(prefix), autosave(false) { parse(); }
-	config(): prefix(""), autosave(false) {};
-	~config() { if(autosave) write(); }
+	config(const Path &path, const std::string &prefix = ""): current(new snapshot), watchfd(-1), inotifyfd(-1), watching(false), filename(path.str()), prefix(prefix), autosave(false) { parse(); }
+	config(const std::string &filename, const std::string &prefix = ""): current(new snapshot), watchfd(-1), inotifyfd(-1), watching(false), filename(filename), prefix(prefix), autosave(false) { parse(); }
+	config(): current(new snapshot), watchfd(-1), inotifyfd(-1), watching(false), prefix(""), autosave(false) {};
+	config(const config &other);				//!< Copy of the variables and settings of other (not watching)
+	config &operator =(const config &other);
+	~config();
 
 	/*! @brief Parse configuration from disk.
 	 
+	 Values from the file are added to, or replace, the current variables.
+	 
 	 @param [in] &path Path to read file from.
 	 @param [in] &prefix Only parse variables starting with this prefix.
 	 */
@@ -67,6 +175,21 @@ public:
 	void parse(const std::string &filename, const std::string &prefix = "") { this->filename = filename; this->prefix = prefix; parse(); }
 	void parse();
 	
+	/*! @brief Replace all variables by the contents of the file 
+	 
+	 Unlike parse(), variables that are not in the file anymore are removed. 
+	 If the file cannot be read, nothing changes and false is returned.
+	 */
+	bool reload();
+	
+	/*! @brief Reload the file whenever it changes on disk
+	 
+	 Starts a thread that uses inotify to watch the directory of the file, 
+	 so that editors that replace the file are noticed as well.
+	 */
+	bool watch();
+	void unwatch();
+	
 	/*! @brief Write configuration to disk. 
 	 
 	 N.B. This method overwrites the file, and does not retain variable order.
@@ -95,50 +218,49 @@ public:
 	void update(config *cfg);
 	void update(config &cfg) { update(&cfg); }
 
-	class exception: public std::runtime_error {
-		public:
-		exception(const std::string reason): runtime_error(reason) {}
-	};
+	void require(const std::string &var) const { pthread::rcu::reader r(&readers); need(var); }
+	handle gethandle(const std::string &var) const; //!< Handle to var, throws if it does not exist
+	
+	bool getbool(const std::string &var) const { return value(var, &entry::b); }
+	int getchoice(const std::string &var, const std::map<std::string, int> &choices) const;
+	int getint(const std::string &var) const { return (int) value(var, &entry::i); }
+	double getdouble(const std::string &var) const { return value(var, &entry::d); }
+	uint16_t getuint16(const std::string &var) const { return (uint16_t) value(var, &entry::u); }
+	int16_t getint16(const std::string &var) const { return (int16_t) value(var, &entry::i); }
+	uint32_t getuint32(const std::string &var) const { return (uint32_t) value(var, &entry::u); }
+	int32_t getint32(const std::string &var) const { return (int32_t) value(var, &entry::i); }
+	uint64_t getuint64(const std::string &var) const { return value(var, &entry::u); }
+	int64_t getint64(const std::string &var) const { return value(var, &entry::i); }
+	std::string getstring(const std::string &var) const { return value(var, &entry::str); }
 
-	void require(const std::string &var) { if(variables.find(pvar(var)) == variables.end()) throw exception("Variable " + pvar(var) + " is required"); }
-	bool getbool(const std::string &var) { require(pvar(var)); return variables[pvar(var)] == "yes" || variables[pvar(var)] == "true"; }
-	int getchoice(const std::string &var, const std::map<std::string, int> &choices);
-	int getint(const std::string &var) { require(var); return strtoll(variables[pvar(var)].c_str(), NULL, 0); }
-	double getdouble(const std::string &var) { require(var); return atof(variables[pvar(var)].c_str()); }
-	uint16_t getuint16(const std::string &var) { require(var); return (uint16_t) strtoumax(variables[pvar(var)].c_str(), NULL, 0); }
-	int16_t getint16(const std::string &var) { require(var); return (int16_t) strtoimax(variables[pvar(var)].c_str(), NULL, 0); }
-	uint32_t getuint32(const std::string &var) { require(var); return (uint32_t) strtoumax(variables[pvar(var)].c_str(), NULL, 0); }
-	int32_t getint32(const std::string &var) { require(var); return (int32_t) strtoimax(variables[pvar(var)].c_str(), NULL, 0); }
-	uint64_t getuint64(const std::string &var) { require(var); return (uint64_t) strtoumax(variables[pvar(var)].c_str(), NULL, 0); }
-	int64_t getint64(const std::string &var) { require(var); return (int64_t) strtoimax(variables[pvar(var)].c_str(), NULL, 0); }
-	std::string getstring(const std::string &var) { require(var); return variables[pvar(var)]; }
-
-	bool exists(const std::string &var) { return variables.find(pvar(var)) != variables.end(); }
-	std::map<std::string, std::string> getall() const { return variables; }
-	size_t get_numentries() const { return variables.size(); }
+	bool exists(const std::string &var) const { pthread::rcu::reader r(&readers); return find(var); }
+	std::map<std::string, std::string> getall() const;
+	size_t get_numentries() const { pthread::rcu::reader r(&readers); return get()->variables.size(); }
 	
-	bool getbool(const std::string &var, bool def) { if(!exists(var)) return def; else return variables[pvar(var)] == "yes" || variables[pvar(var)] == "true"; }
-	int getchoice(const std::string &var, const std::map<std::string, int> &choices, int def);
-	int getint(const std::string &var, int def) { if(!exists(var)) return def; else return strtoll(variables[pvar(var)].c_str(),0, 0); }
-	double getdouble(const std::string &var, double def) { if(!exists(var)) return def; else return atof(variables[pvar(var)].c_str()); }
-	uint16_t getuint16(const std::string &var, uint16_t def) { if(!exists(var)) return def; else return (uint16_t) strtoumax(variables[pvar(var)].c_str(), 0, 0); }
-	int16_t getint16(const std::string &var, int16_t def) { if(!exists(var)) return def; else return (int16_t) strtoimax(variables[pvar(var)].c_str(), 0, 0); }
-	uint32_t getuint32(const std::string &var, uint32_t def) { if(!exists(var)) return def; else return (uint32_t) strtoumax(variables[pvar(var)].c_str(), 0, 0); }
-	int32_t getint32(const std::string &var, int32_t def) { if(!exists(var)) return def; else return (int32_t) strtoimax(variables[pvar(var)].c_str(), 0, 0); }
-	uint64_t getuint64(const std::string &var, uint64_t def) { if(!exists(var)) return def; else return (uint64_t) strtoumax(variables[pvar(var)].c_str(), 0, 0); }
-	int64_t getint64(const std::string &var, int64_t def) { if(!exists(var)) return def; else return (int64_t) strtoimax(variables[pvar(var)].c_str(), 0, 0); }
-	std::string getstring(const std::string &var, const std::string def) { if(!exists(var)) return def; else return variables[pvar(var)]; }
-
-	void set(const std::string &var, bool value) { variables[pvar(var)] = value ? "yes" : "no"; }
-	void set(const std::string &var, double value) { variables[pvar(var)] = format("%lg", value); }
-	void set(const std::string &var, uint16_t value) { variables[pvar(var)] = format("%"PRIu16, value); }
-	void set(const std::string &var, int16_t value) { variables[pvar(var)] = format("%"PRIi16, value); }
-	void set(const std::string &var, uint32_t value) { variables[pvar(var)] = format("%"PRIu32, value); }
-	void set(const std::string &var, int32_t value) { variables[pvar(var)] = format("%"PRIi32, value); }
-	void set(const std::string &var, uint64_t value) { variables[pvar(var)] = format("%"PRIu64, value); }
-	void set(const std::string &var, int64_t value) { variables[pvar(var)] = format("%"PRIi64, value); }
-	void set(const std::string var, const std::string &value) { variables[pvar(var)] = value; }
+	bool getbool(const std::string &var, bool def) const { return value(var, &entry::b, def); }
+	int getchoice(const std::string &var, const std::map<std::string, int> &choices, int def) const;
+	int getint(const std::string &var, int def) const { return (int) value(var, &entry::i, (int64_t) def); }
+	double getdouble(const std::string &var, double def) const { return value(var, &entry::d, def); }
+	uint16_t getuint16(const std::string &var, uint16_t def) const { return (uint16_t) value(var, &entry::u, (uint64_t) def); }
+	int16_t getint16(const std::string &var, int16_t def) const { return (int16_t) value(var, &entry::i, (int64_t) def); }
+	uint32_t getuint32(const std::string &var, uint32_t def) const { return (uint32_t) value(var, &entry::u, (uint64_t) def); }
+	int32_t getint32(const std::string &var, int32_t def) const { return (int32_t) value(var, &entry::i, (int64_t) def); }
+	uint64_t getuint64(const std::string &var, uint64_t def) const { return value(var, &entry::u, def); }
+	int64_t getint64(const std::string &var, int64_t def) const { return value(var, &entry::i, def); }
+	std::string getstring(const std::string &var, const std::string def) const { return value(var, &entry::str, def); }
+
+	void set(const std::string &var, bool value) { store(pvar(var), value ? "yes" : "no"); }
+	void set(const std::string &var, double value) { store(pvar(var), format("%lg", value)); }
+	void set(const std::string &var, uint16_t value) { store(pvar(var), format("%"PRIu16, value)); }
+	void set(const std::string &var, int16_t value) { store(pvar(var), format("%"PRIi16, value)); }
+	void set(const std::string &var, uint32_t value) { store(pvar(var), format("%"PRIu32, value)); }
+	void set(const std::string &var, int32_t value) { store(pvar(var), format("%"PRIi32, value)); }
+	void set(const std::string &var, uint64_t value) { store(pvar(var), format("%"PRIu64, value)); }
+	void set(const std::string &var, int64_t value) { store(pvar(var), format("%"PRIi64, value)); }
+	void set(const std::string var, const std::string &value) { store(pvar(var), value); }
 	void setchoice(const std::string &var, const std::map<std::string, int> &choices, int value);
+	
+	sigc::slot<void, std::string> slot_changed; //!< Called with the full name of each added, changed or removed variable
 };
 
 #endif // HAVE_CONFIGCLASS_H
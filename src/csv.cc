@@ -19,9 +19,6 @@
 
 #include "autoconfig.h"
 
-#include <iostream>
-#include <sstream>
-#include <fstream>
 #include <string>
 #include <vector>
 #include <stdexcept>
@@ -31,7 +28,19 @@
 #endif
 
 #include <time.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <math.h>
 
+#include <algorithm>
+
+#include "pthread++.h"
 #include "utils.h"
 #include "format.h"
 #include "path++.h"
@@ -42,7 +51,7 @@ using namespace std;
 // Constructors / destructors
 Csv::Csv(const string newfile, const char cpref, const char wsep, const char lsep):
 commpref(cpref), wordsep(wsep), linesep(lsep), 
-file(newfile) {
+file(newfile), nrows(0), ncols(0), columnar(false) {
 	DEBUGPRINT("FILE:%s, '%c', '%c', '%c')\n", newfile.c_str(), commpref, wordsep, linesep);
 	read(file);
 	
@@ -50,13 +59,13 @@ file(newfile) {
 
 Csv::Csv(vector< vector<double> > &newdata, const char cpref, const char wsep, const char lsep, bool copy):
 commpref(cpref), wordsep(wsep), linesep(lsep),
-csvdata(newdata) {
+csvdata(newdata), nrows(0), ncols(0), columnar(false) {
 	DEBUGPRINT("DATA:..., '%c', '%c', '%c')\n", commpref, wordsep, linesep);
 }
 
 #if HAVE_GSL
 Csv::Csv(gsl_vector_float *newdata, const char cpref, const char wsep, const char lsep):
-commpref(cpref), wordsep(wsep), linesep(lsep) {
+commpref(cpref), wordsep(wsep), linesep(lsep), nrows(0), ncols(0), columnar(false) {
 	DEBUGPRINT("DATA:..., '%c', '%c', '%c')\n", commpref, wordsep, linesep);
 	for (size_t i=0; i<newdata->size; i++) {
 		vector<double> line(1, gsl_vector_float_get(newdata, i));
@@ -67,7 +76,7 @@ commpref(cpref), wordsep(wsep), linesep(lsep) {
 #endif
 
 Csv::Csv(const char cpref, const char wsep, const char lsep):
-commpref(cpref), wordsep(wsep), linesep(lsep) {
+commpref(cpref), wordsep(wsep), linesep(lsep), nrows(0), ncols(0), columnar(false) {
 	DEBUGPRINT("VANILLA: '%c', '%c', '%c')\n", commpref, wordsep, linesep);
 }
 
@@ -76,95 +85,648 @@ Csv::~Csv() {
 
 // Read/write routines
 
-bool Csv::read(string file) {
-	DEBUGPRINT("%s\n", file.c_str());
+// Exact powers of ten for parsedouble()
+static const double pow10tab[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static double slowparse(const char *b, const char *e) {
+	char buf[64];
+	if ((size_t) (e - b) < sizeof buf) {
+		memcpy(buf, b, e - b);
+		buf[e - b] = 0;
+		return strtod(buf, NULL);
+	}
+	return strtod(string(b, e).c_str(), NULL);
+}
+
+/*! @brief Parse a decimal number in [b, e), same result as strtod()
+ 
+ Plain decimals with at most 2^53 as mantissa and a power of ten up to 22 
+ are exact in double precision, such that one multiplication or division 
+ gives the correctly rounded result (Clinger's fast path). Everything else 
+ (long mantissas, large exponents, hex, inf, nan, trailing garbage) is left 
+ to strtod(). isint is set for plain integers (no fraction or exponent) 
+ that are exact as double.
+ */
+static double parsedouble(const char *b, const char *e, bool &isint) {
+	isint = false;
+	const char *p = b;
+	while (p < e && (*p == ' ' || *p == '\t'))
+		p++;
 	
-	ifstream dataio(file.c_str());
-	if (!dataio.good())
-		throw(std::runtime_error("Csv::read(): Error opening " + file));
-		
-	string buf, cell;
-	vector<double> dataline;
-	size_t linewidth = 0;
+	bool neg = false;
+	if (p < e && (*p == '-' || *p == '+'))
+		neg = (*p++ == '-');
 	
-	csvdata.clear();
+	uint64_t mant = 0;
+	int exp10 = 0;
+	bool digits = false;
+	for (; p < e && *p >= '0' && *p <= '9'; p++) {
+		if (mant > (~(uint64_t) 0)/10 - 1)
+			return slowparse(b, e);
+		mant = mant*10 + (*p - '0');
+		digits = true;
+	}
+	bool fraction = false;
+	if (p < e && *p == '.') {
+		fraction = true;
+		for (p++; p < e && *p >= '0' && *p <= '9'; p++) {
+			if (mant > (~(uint64_t) 0)/10 - 1)
+				return slowparse(b, e);
+			mant = mant*10 + (*p - '0');
+			exp10--;
+			digits = true;
+		}
+	}
+	if (!digits)
+		return slowparse(b, e);
 	
-	while (getline (dataio, buf, linesep)) {
-		// Empty line, skip
-		if (buf.size() <= 0)
-			continue;
+	if (p < e && (*p == 'e' || *p == 'E')) {
+		p++;
+		bool eneg = false;
+		if (p < e && (*p == '-' || *p == '+'))
+			eneg = (*p++ == '-');
+		if (p == e || *p < '0' || *p > '9')
+			return slowparse(b, e);
+		int ex = 0;
+		for (; p < e && *p >= '0' && *p <= '9'; p++)
+			if (ex < 10000)
+				ex = ex*10 + (*p - '0');
+		exp10 += eneg ? -ex : ex;
+		fraction = true;
+	}
+	
+	while (p < e && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+	if (p != e)
+		return slowparse(b, e);
+	
+	if (mant > (1ULL << 53) || exp10 < -22 || exp10 > 22) {
+		if (mant == 0)
+			return neg ? -0.0 : 0.0;
+		return slowparse(b, e);
+	}
+	
+	double v = (double) mant;
+	if (exp10 == 0 && !fraction)
+		isint = true;
+	else
+		v = (exp10 < 0) ? v / pow10tab[-exp10] : v * pow10tab[exp10];
+	return neg ? -v : v;
+}
+
+void Csv::parsechunk(chunk &c) const {
+	c.rows = 0;
+	c.width = 0;
+	c.isint.clear();
+	c.ok = true;
+	
+	const char *p = c.begin;
+	while (p < c.end) {
+		const char *eol = (const char *) memchr(p, linesep, c.end - p);
+		if (!eol)
+			eol = c.end;
+		const char *line = p;
+		p = eol + 1;
 		
-		DEBUGPRINT("line = %s, comp = %d\n", buf.c_str(), buf[0] == commpref);
-		// Line starts with 'commpref', skip it
-		if (buf[0] == commpref)
+		// Skip empty lines, comments and lines with only whitespace
+		if (eol == line || *line == commpref)
 			continue;
-		
-		// Empty line, continue
-		if (buf.find_first_not_of(" \t", 0) == string::npos)
+		const char *q = line;
+		while (q < eol && (*q == ' ' || *q == '\t'))
+			q++;
+		if (q == eol)
 			continue;
 		
-		// Read rest of the line, store in 
-		stringstream bufstrm(buf);
-		while(std::getline(bufstrm, cell, wordsep)) {
-			dataline.push_back(strtod(cell.c_str(), NULL));
-			DEBUGPRINT("element = %s\n", cell.c_str());
+		// Split on wordsep, a trailing wordsep does not start a new cell
+		size_t width = 0;
+		const char *cell = line;
+		while (true) {
+			const char *sep = (const char *) memchr(cell, wordsep, eol - cell);
+			bool cellint;
+			c.values.push_back(parsedouble(cell, sep ? sep : eol, cellint));
+			if (c.width == 0)
+				c.isint.push_back(cellint);
+			else if (width < c.isint.size())
+				c.isint[width] &= cellint;
+			width++;
+			if (!sep || sep + 1 == eol)
+				break;
+			cell = sep + 1;
 		}
 		
-		// If linewidth != the width of this line, not all lines have the same nr of elements, abort
-		if (linewidth == 0)
-			linewidth = dataline.size();
-		else if (linewidth != dataline.size())
-			return false;
+		if (c.width == 0)
+			c.width = width;
+		else if (c.width != width) {
+			c.ok = false;
+			return;
+		}
+		c.rows++;
+	}
+}
+
+bool Csv::load(const string file, size_t nthreads) {
+	DEBUGPRINT("%s\n", file.c_str());
+	
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw(std::runtime_error("Csv::load(): Error opening " + file));
+	
+	struct stat st;
+	if (fstat(fd, &st)) {
+		close(fd);
+		throw(std::runtime_error("Csv::load(): Error opening " + file));
+	}
+	
+	data.clear();
+	isint.clear();
+	header.clear();
+	nrows = ncols = 0;
+	size_t size = st.st_size;
+	if (size == 0) {
+		close(fd);
+		return true;
+	}
+	
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		throw(std::runtime_error("Csv::load(): Error mapping " + file));
+	madvise(map, size, MADV_SEQUENTIAL);
+	
+	const char *begin = (const char *) map;
+	const char *end = begin + size;
+	
+	// Threads only pay off for large files
+	if (nthreads == 0)
+		nthreads = (size > (16 << 20)) ? pthread::pool::ncpus() : 1;
+	nthreads = min(nthreads, size);
+	
+	// Split at line boundaries
+	chunks.resize(nthreads);
+	const char *p = begin;
+	for (size_t i=0; i<nthreads; i++) {
+		chunks[i].begin = p;
+		const char *q = (i == nthreads-1) ? end : begin + (size * (i+1)) / nthreads;
+		if (q < p)
+			q = p;
+		if (q < end) {
+			const char *eol = (const char *) memchr(q, linesep, end - q);
+			q = eol ? eol + 1 : end;
+		}
+		chunks[i].end = p = q;
+		chunks[i].values.reserve((q - chunks[i].begin) / 8);
+	}
+	
+	if (nthreads == 1) {
+		parsechunk(chunks[0]);
+	} else {
+		pthread::pool workers(nthreads);
+		workers.parallel_for(0, nthreads, sigc::mem_fun(*this, &Csv::parsechunks), 1);
+	}
+	
+	// Check widths, then concatenate
+	bool ok = true;
+	size_t total = 0;
+	for (size_t i=0; i<chunks.size(); i++) {
+		if (!chunks[i].ok || (chunks[i].width && ncols && chunks[i].width != ncols))
+			ok = false;
+		if (chunks[i].width) {
+			if (!ncols)
+				isint = chunks[i].isint;
+			else if (ok)
+				for (size_t j=0; j<ncols; j++)
+					isint[j] &= chunks[i].isint[j];
+			ncols = chunks[i].width;
+		}
+		total += chunks[i].values.size();
+	}
+	
+	if (ok)
+		parseheader(begin, end);
+	munmap(map, size);
+	
+	if (ok) {
+		if (chunks.size() == 1) {
+			data.swap(chunks[0].values);
+		} else {
+			data.resize(total);
+			size_t off = 0;
+			for (size_t i=0; i<chunks.size(); i++) {
+				if (chunks[i].values.size())
+					memcpy(&data[off], &chunks[i].values[0], chunks[i].values.size() * sizeof(double));
+				off += chunks[i].values.size();
+			}
+		}
+		nrows = ncols ? data.size() / ncols : 0;
+	} else {
+		ncols = 0;
+	}
+	chunks.clear();
+	
+	DEBUGPRINT("read %zu lines, each %zu elems\n", nrows, ncols);
+	return ok;
+}
+
+void Csv::parseheader(const char *begin, const char *end) {
+	// Find the last comment line before the first data line
+	const char *comment = NULL, *commentend = NULL;
+	const char *p = begin;
+	while (p < end) {
+		const char *eol = (const char *) memchr(p, linesep, end - p);
+		if (!eol)
+			eol = end;
+		const char *line = p;
+		p = eol + 1;
 		
-		DEBUGPRINT("read %d elements on this line\n", (int) linewidth);
+		if (eol == line)
+			continue;
+		if (*line == commpref) {
+			comment = line + 1;
+			commentend = eol;
+			continue;
+		}
+		const char *q = line;
+		while (q < eol && (*q == ' ' || *q == '\t'))
+			q++;
+		if (q != eol)
+			break;
+	}
+	
+	header.clear();
+	if (!comment)
+		return;
+	
+	const char *cell = comment;
+	while (true) {
+		const char *sep = (const char *) memchr(cell, wordsep, commentend - cell);
+		const char *b = cell, *e = sep ? sep : commentend;
+		while (b < e && (*b == ' ' || *b == '\t'))
+			b++;
+		while (e > b && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r'))
+			e--;
+		header.push_back(string(b, e));
+		if (!sep)
+			break;
+		cell = sep + 1;
+	}
+	
+	if (header.size() != ncols)
+		header.clear();
+}
 
-		csvdata.push_back(dataline);
-		dataline.clear();
+void Csv::tocolumns() {
+	size_t nint = 0, ndouble = 0;
+	
+	columns.resize(ncols);
+	for (size_t j=0; j<ncols; j++) {
+		columns[j].name = header.empty() ? "" : header[j];
+		columns[j].type = isint[j] ? COL_INT64 : COL_DOUBLE;
+		columns[j].idx = isint[j] ? nint++ : ndouble++;
+	}
+	
+	icols.resize(nint * nrows);
+	dcols.resize(ndouble * nrows);
+	for (size_t j=0; j<ncols; j++) {
+		const column_t &c = columns[j];
+		if (c.type == COL_INT64) {
+			int64_t *col = &icols[c.idx * nrows];
+			for (size_t i=0; i<nrows; i++)
+				col[i] = (int64_t) data[i*ncols + j];
+		} else {
+			double *col = &dcols[c.idx * nrows];
+			for (size_t i=0; i<nrows; i++)
+				col[i] = data[i*ncols + j];
+		}
 	}
 	
-	DEBUGPRINT("read %d lines, each %d elems\n", (int) csvdata.size(), (int) csvdata[0].size());
+	// Only keep the columns
+	vector<double>().swap(data);
+}
+
+size_t Csv::findcolumn(const string &name) const {
+	size_t j;
+	for (j=0; j<columns.size() && columns[j].name != name; j++) { ; }
+	return j;
+}
+
+void Csv::addcolumn(const string &name, const vector<double> &values) {
+	if (columns.empty())
+		nrows = values.size();
+	else if (values.size() != nrows)
+		throw(std::runtime_error("Csv::addcolumn(): column " + name + " has wrong length"));
+	
+	column_t c;
+	c.name = name;
+	c.type = COL_DOUBLE;
+	c.idx = dcols.size() / max(nrows, (size_t) 1);
+	columns.push_back(c);
+	dcols.insert(dcols.end(), values.begin(), values.end());
+	ncols = columns.size();
+	columnar = true;
+}
+
+void Csv::addcolumn(const string &name, const vector<int64_t> &values) {
+	if (columns.empty())
+		nrows = values.size();
+	else if (values.size() != nrows)
+		throw(std::runtime_error("Csv::addcolumn(): column " + name + " has wrong length"));
+	
+	column_t c;
+	c.name = name;
+	c.type = COL_INT64;
+	c.idx = icols.size() / max(nrows, (size_t) 1);
+	columns.push_back(c);
+	icols.insert(icols.end(), values.begin(), values.end());
+	ncols = columns.size();
+	columnar = true;
+}
+
+#if HAVE_GSL
+gsl_vector_view Csv::as_gsl(const size_t col) {
+	if (col >= columns.size() || columns[col].type != COL_DOUBLE)
+		throw(std::runtime_error("Csv::as_gsl(): column is not of type double"));
+	return gsl_vector_view_array(getdouble(col), nrows);
+}
+#endif
+
+bool Csv::read(string file) {
+	DEBUGPRINT("%s\n", file.c_str());
+	
+	csvdata.clear();
+	columns.clear();
+	icols.clear();
+	dcols.clear();
+	if (!load(file))
+		return false;
+	
+	if (columnar) {
+		tocolumns();
+		DEBUGPRINT("read %d lines, %d columns\n", (int) nrows, (int) ncols);
+		return true;
+	}
+	
+	csvdata.resize(nrows);
+	for (size_t i=0; i<nrows; i++)
+		csvdata[i].assign(data.begin() + i*ncols, data.begin() + (i+1)*ncols);
+	
+	DEBUGPRINT("read %d lines, each %d elems\n", (int) nrows, (int) ncols);
 	return true;
 }
 
 bool Csv::write(string file, const string &comment, const bool app, const bool date) {
 	DEBUGPRINT("%s, %s, %d\n", file.c_str(), comment.c_str(), app);
-	if (csvdata.size() == 0)
+	if ((columnar && columns.empty()) || (!columnar && csvdata.size() == 0))
 		return false;
-
-	ofstream filestr;
-	if (!filestr.good())
-		throw(std::runtime_error("Csv::write(): Error opening " + file));
-
-	if (app)
-		filestr.open(file.c_str(), ios::out | ios::app); 
-	else
-		filestr.open(file.c_str(), ios::out); 
 	
-	if (filestr.fail())
+	CsvWriter *out;
+	try {
+		out = new CsvWriter(file, app, false, 1<<20, commpref, wordsep, linesep);
+	} catch (std::runtime_error &e) {
 		return false;
+	}
+	out->interval = 0;
 
 	if (comment != "")
-		filestr << commpref << comment << linesep;
+		out->comment(comment);
 
 	if (date) {
 		time_t rawtime = time(NULL);
-		struct tm * timeinfo = gmtime(&rawtime);
-		filestr << commpref << asctime(timeinfo) << linesep;
+		struct tm timeinfo;
+		char buf[32];
+		asctime_r(gmtime_r(&rawtime, &timeinfo), buf);
+		out->comment(string(buf, strcspn(buf, "\n")));
+	}
+
+	if (columnar)
+		writecolumns(*out);
+	else
+		for (size_t i=0; i<csvdata.size(); i++)
+			out->addrow(csvdata[i]);
+	
+	bool ok = out->flush();
+	delete out;
+	
+	DEBUGPRINT("wrote %d lines, each %d elems\n", (int) csvdata.size(), (int) ncols);
+	return ok;
+}
+
+void Csv::writecolumns(CsvWriter &out) {
+	// Names go on the last comment line, so read() finds them again
+	bool named = false;
+	for (size_t j=0; j<columns.size(); j++)
+		if (!columns[j].name.empty())
+			named = true;
+	
+	if (named) {
+		string names = columns[0].name;
+		for (size_t j=1; j<columns.size(); j++)
+			names += wordsep + columns[j].name;
+		out.comment(names);
+	}
+	
+	for (size_t i=0; i<nrows; i++) {
+		for (size_t j=0; j<columns.size(); j++) {
+			if (columns[j].type == COL_INT64)
+				out.addcell(icols[columns[j].idx * nrows + i]);
+			else
+				out.addcell(dcols[columns[j].idx * nrows + i]);
+		}
+		out.endrow();
+	}
+}
+
+// Format integer value in out, return length
+static int formatint(char *out, int64_t value) {
+	char tmp[24];
+	int n = 0;
+	uint64_t v = (value < 0) ? -(uint64_t) value : value;
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	
+	int len = 0;
+	if (value < 0)
+		out[len++] = '-';
+	while (n)
+		out[len++] = tmp[--n];
+	return len;
+}
+
+/*! @brief Format value in out (at least 32 bytes) with the least digits that round-trip
+ 
+ Integral values are formatted directly, others with %.15g, which is 
+ enough for most values, or else %.16g or %.17g (which always round-trips).
+ The result always has a decimal point or exponent (1.0, not 1), so 
+ Csv::read() does not take a double column for an integer one.
+ */
+static int formatdouble(char *out, double value) {
+	int len;
+	if (value >= -1e15 && value <= 1e15 && value == (double) (int64_t) value && (value != 0 || !signbit(value))) {
+		len = formatint(out, (int64_t) value);
+	} else {
+		len = snprintf(out, 32, "%.15g", value);
+		if (isfinite(value) && strtod(out, NULL) != value) {
+			len = snprintf(out, 32, "%.16g", value);
+			if (strtod(out, NULL) != value)
+				len = snprintf(out, 32, "%.17g", value);
+		}
+		if (!isfinite(value) || memchr(out, '.', len) || memchr(out, 'e', len))
+			return len;
+	}
+	
+	out[len++] = '.';
+	out[len++] = '0';
+	return len;
+}
+
+CsvWriter::CsvWriter(const string file, const bool app, const bool background, const size_t bufsize, const char cpref, const char wsep, const char lsep):
+commpref(cpref), wordsep(wsep), linesep(lsep),
+buf(max(bufsize, (size_t) 64)), len(0), rowstart(true), failed(false),
+background(background), running(false), pendlen(0),
+interval(1.0), nrows(0)
+{
+	DEBUGPRINT("FILE:%s, app=%d, bg=%d\n", file.c_str(), app, background);
+	fd = open(file.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (app ? O_APPEND : O_TRUNC), 0666);
+	if (fd < 0)
+		throw(std::runtime_error("CsvWriter: Error opening " + file));
+	
+	clock_gettime(CLOCK_MONOTONIC, &lastflush);
+	
+	if (background) {
+		pending.resize(buf.size());
+		running = true;
+		flushthr.create(sigc::mem_fun(*this, &CsvWriter::flusher));
+	}
+}
+
+CsvWriter::~CsvWriter() {
+	flush();
+	
+	if (background) {
+		{
+			pthread::mutexholder h(&mutex);
+			running = false;
+			cond.broadcast();
+		}
+		flushthr.join();
+	}
+	
+	close(fd);
+}
+
+bool CsvWriter::writeout(const char *p, size_t n) {
+	while (n > 0) {
+		ssize_t r = ::write(fd, p, n);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			failed = true;
+			return false;
+		}
+		p += r;
+		n -= r;
 	}
+	return true;
+}
 
-	for (size_t i=0; i<csvdata.size(); i++) {
-		vector<double> dataline = csvdata[i];
+void CsvWriter::handoff() {
+	clock_gettime(CLOCK_MONOTONIC, &lastflush);
+	if (!len)
+		return;
+	
+	if (!background) {
+		writeout(&buf[0], len);
+		len = 0;
+		return;
+	}
+	
+	// Wait until flusher() is done with the previous buffer, then swap
+	pthread::mutexholder h(&mutex);
+	while (pendlen)
+		cond.wait(mutex);
+	if (pending.size() < buf.size())
+		pending.resize(buf.size());
+	buf.swap(pending);
+	pendlen = len;
+	len = 0;
+	cond.broadcast();
+}
+
+void CsvWriter::flusher() {
+	pthread::mutexholder h(&mutex);
+	
+	while (running || pendlen) {
+		if (!pendlen) {
+			cond.wait(mutex);
+			continue;
+		}
 		
-		filestr << dataline[0];
-		for (size_t j=1; j<dataline.size(); j++)
-			filestr << wordsep << dataline[j];
+		// pending is ours until pendlen is reset
+		mutex.unlock();
+		writeout(&pending[0], pendlen);
+		mutex.lock();
 		
-		filestr << linesep;
+		pendlen = 0;
+		cond.broadcast();
 	}
+}
+
+bool CsvWriter::flush() {
+	handoff();
 	
-  filestr.close();
+	if (background) {
+		pthread::mutexholder h(&mutex);
+		while (pendlen)
+			cond.wait(mutex);
+	}
 	
-	DEBUGPRINT("wrote %d lines, each %d elems\n", (int) csvdata.size(), (int) csvdata[0].size());
-	return true;
+	return !failed;
+}
+
+void CsvWriter::comment(const string &line) {
+	if (!rowstart)
+		endrow();
+	reserve(line.size() + 2);
+	buf[len++] = commpref;
+	memcpy(&buf[len], line.data(), line.size());
+	len += line.size();
+	buf[len++] = linesep;
 }
 
+void CsvWriter::addcell(const double value) {
+	reserve(34);
+	sep();
+	len += formatdouble(&buf[len], value);
+}
+
+void CsvWriter::addcell(const int64_t value) {
+	reserve(24);
+	sep();
+	len += formatint(&buf[len], value);
+}
+
+void CsvWriter::endrow() {
+	reserve(1);
+	buf[len++] = linesep;
+	rowstart = true;
+	nrows++;
+	
+	if (len > buf.size() - 64) {
+		handoff();
+	} else if (interval > 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - lastflush.tv_sec) + (now.tv_nsec - lastflush.tv_nsec) * 1e-9 >= interval)
+			handoff();
+	}
+}
+
+void CsvWriter::addrow(const double *values, const size_t n) {
+	for (size_t i=0; i<n; i++)
+		addcell(values[i]);
+	endrow();
+}
@@ -25,12 +25,17 @@
 #include <string>
 #include <vector>
 
+#include <stdint.h>
+
 #if HAVE_GSL
 #include <gsl/gsl_vector.h>
 #endif
 
+#include "pthread++.h"
 #include "path++.h"
 
+class CsvWriter;
+
 /*! @brief Simple CSV parser for reading and writing
  
  This class can read a CSV file with specific options (see Csv()), and stores
@@ -44,6 +49,25 @@ private:
 	const char linesep;									//!< Line seperator (like '\n')
 	
 	string file;												//!< CSV file
+	
+	/*! @brief Part of a file parsed by one thread in load() */
+	struct chunk {
+		const char *begin, *end;					//!< Start of a line, end just after a line separator (or EOF)
+		vector<double> values;
+		size_t rows;
+		size_t width;											//!< Number of columns, 0 if no rows
+		vector<char> isint;								//!< Per column, whether all cells were plain integers
+		bool ok;													//!< False if not all rows have the same width
+	};
+	vector<chunk> chunks;
+	void parsechunk(chunk &c) const;
+	void parsechunks(size_t b, size_t e) { for (size_t i=b; i<e; i++) parsechunk(chunks[i]); }
+	
+	vector<char> isint;									//!< Per column of data, whether load() found only integers
+	vector<string> header;							//!< Names from the last comment line before the data, if it has ncols fields
+	void parseheader(const char *begin, const char *end);
+	void tocolumns();										//!< Convert data to columns
+	void writecolumns(CsvWriter &out);
 
 public:
 	/*! @brief Init new object based on 'file'
@@ -73,10 +97,63 @@ public:
 	
 	vector< vector<double> > csvdata;			//!< CSV data is stored here
 	
+	vector<double> data;								//!< Data read by load(), row-major in one buffer
+	size_t nrows;												//!< Number of rows in data
+	size_t ncols;												//!< Number of columns in data
+	double get(const size_t row, const size_t col) const { return data[row*ncols + col]; }
+	
+	/*!
+	 @brief Read 'f' as fast as possible, store data in data member
+	 
+	 The file is memory-mapped and numbers are parsed in place, large files 
+	 are split at line boundaries and parsed by multiple threads. Parsing 
+	 rules are the same as read(). If file cannot be opened, throw 
+	 std::runtime_error()
+	 
+	 @param [in] f File to read
+	 @param [in] nthreads Number of threads to use (0 for automatic)
+	 */
+	bool load(const string f, size_t nthreads=0);
+	
+	typedef enum {
+		COL_INT64=0,											//!< Column stored in icols
+		COL_DOUBLE												//!< Column stored in dcols
+	} coltype_t;
+	
+	typedef struct column_t {
+		string name;											//!< Column name from the header, or empty
+		coltype_t type;
+		size_t idx;												//!< Index of this column in icols or dcols
+	} column_t;
+	
+	/*! @brief Store data by column instead of in csvdata
+	 
+	 If set, read() stores columns with only plain integers as int64_t in 
+	 icols and other columns as double in dcols, and write() writes these. 
+	 Each block is column-major, such that every column is one contiguous 
+	 array and all columns of one type form a 2-D (nrows x ncolumns) array, 
+	 see getint(), getdouble(), as_gsl() and ImgData::setdata(Csv &). Names 
+	 are taken from a comment line like '# time,x,y' preceding the data.
+	 */
+	bool columnar;
+	vector<column_t> columns;						//!< Column layout when columnar
+	vector<double> dcols;								//!< Data of COL_DOUBLE columns, column-major
+	vector<int64_t> icols;							//!< Data of COL_INT64 columns, column-major
+	
+	size_t findcolumn(const string &name) const; //!< Index of column 'name' in columns, or columns.size()
+	double *getdouble(const size_t col) { return (columns[col].type == COL_DOUBLE) ? &dcols[columns[col].idx * nrows] : NULL; }
+	int64_t *getint(const size_t col) { return (columns[col].type == COL_INT64) ? &icols[columns[col].idx * nrows] : NULL; }
+	void addcolumn(const string &name, const vector<double> &values); //!< Add a column (all columns should have nrows values)
+	void addcolumn(const string &name, const vector<int64_t> &values);
+#if HAVE_GSL
+	gsl_vector_view as_gsl(const size_t col);	//!< View COL_DOUBLE column 'col' as gsl_vector, without copying
+#endif
+	
 	/*!
 	 @brief Read 'f', store data in csvdata member
 	 
-	 If file cannot be opened, throw std::runtime_error()
+	 Uses load(), data is available in both csvdata and data afterwards. If 
+	 file cannot be opened, throw std::runtime_error()
 	 
 	 @param [in] f File to read
 	 */
@@ -95,4 +172,69 @@ public:
 };
 
 
+/*! @brief Streaming CSV writer for logging rows as they are produced
+ 
+ Rows are formatted into a large buffer which is written to the file when 
+ it is full, or at the first row after 'interval' seconds. With background 
+ set, the write() calls are done by a separate thread while the next 
+ buffer fills, such that addrow() only formats. Doubles are written with 
+ the least digits (15 to 17) that read back to the identical value.
+ 
+ Only one thread should add rows at a time.
+ */
+class CsvWriter {
+private:
+	int fd;
+	const char commpref;
+	const char wordsep;
+	const char linesep;
+	
+	vector<char> buf;										//!< Buffer being filled
+	size_t len;
+	bool rowstart;											//!< No cell added to the current row yet
+	struct timespec lastflush;
+	bool failed;												//!< A write() failed
+	
+	// Background flushing
+	bool background;
+	bool running;
+	vector<char> pending;								//!< Buffer being written by flusher()
+	size_t pendlen;											//!< Bytes in pending, 0 when flusher() is idle
+	pthread::mutex mutex;
+	pthread::cond cond;
+	pthread::thread flushthr;
+	void flusher();
+	
+	bool writeout(const char *p, size_t n);
+	void handoff();											//!< Write out buf (or pass it to flusher())
+	void reserve(size_t n) { if (len + n > buf.size()) handoff(); if (n > buf.size()) buf.resize(n); }
+	void sep() { if (!rowstart) buf[len++] = wordsep; rowstart = false; }
+	
+public:
+	/*! @brief Open 'file' for writing
+	 
+	 If file cannot be opened, throw std::runtime_error()
+	 
+	 @param [in] file File to write to
+	 @param [in] app Append to file instead of overwriting
+	 @param [in] background Write to disk in a separate thread
+	 @param [in] bufsize Buffer size in bytes
+	 */
+	CsvWriter(const string file, const bool app=false, const bool background=false, const size_t bufsize=1<<20, const char cpref='#', const char wsep=',', const char lsep='\n');
+	~CsvWriter();
+	
+	double interval;										//!< Write out at least every interval seconds, 0 to only write full buffers [1.0]
+	size_t nrows;												//!< Number of rows added
+	
+	void comment(const string &line);		//!< Add a comment line
+	void addcell(const double value);
+	void addcell(const int64_t value);
+	void endrow();
+	void addrow(const double *values, const size_t n);
+	void addrow(const vector<double> &values) { addrow(values.empty() ? NULL : &values[0], values.size()); }
+	
+	bool flush();												//!< Write everything buffered to disk
+	bool good() const { return !failed; }
+};
+
 #endif // HAVE_CSV_H
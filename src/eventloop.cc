@@ -0,0 +1,174 @@
+/*
+ eventloop.cc -- epoll based file descriptor event dispatcher
+ Copyright (C) 2012 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <string>
+
+#include "eventloop.h"
+
+using namespace std;
+
+EventLoop::EventLoop(): running(false) {
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(epfd < 0)
+		throw exception((string) "EventLoop: could not create epoll instance: " + strerror(errno));
+
+	wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(wakefd < 0) {
+		int err = errno;
+		close(epfd);
+		throw exception((string) "EventLoop: could not create eventfd: " + strerror(err));
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.fd = wakefd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+}
+
+EventLoop::~EventLoop() {
+	stop();
+	close(wakefd);
+	close(epfd);
+}
+
+bool EventLoop::add(const int fd, const uint32_t events, const handler_t &handler) {
+	pthread::mutexholder h(&mutex);
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = events;
+	ev.data.fd = fd;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+		return false;
+
+	handlers[fd] = handler;
+	return true;
+}
+
+bool EventLoop::modify(const int fd, const uint32_t events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = events;
+	ev.data.fd = fd;
+	return !epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+bool EventLoop::remove(const int fd) {
+	pthread::mutexholder h(&mutex);
+
+	handlers.erase(fd);
+	const bool ok = !epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+
+	// Wait for slots of fd in other threads, a slot removing itself would deadlock
+	for(;;) {
+		bool waiting = false;
+		pair<multimap<int, pthread_t>::iterator, multimap<int, pthread_t>::iterator> r = busy.equal_range(fd);
+		for(multimap<int, pthread_t>::iterator it = r.first; it != r.second; ++it)
+			if(!pthread_equal(it->second, pthread_self()))
+				waiting = true;
+		if(!waiting)
+			break;
+		idle.wait(mutex);
+	}
+
+	return ok;
+}
+
+int EventLoop::run(const int timeout) {
+	struct epoll_event events[64];
+
+	int n = epoll_wait(epfd, events, 64, timeout);
+	if(n < 0)
+		return errno == EINTR ? 0 : -1;
+
+	int handled = 0;
+	for(int i = 0; i < n; i++) {
+		const int fd = events[i].data.fd;
+
+		if(fd == wakefd) {
+			// Only resets the counter, EAGAIN means another run() already did
+			uint64_t count;
+			if(read(wakefd, &count, sizeof count) < 0) {}
+			continue;
+		}
+
+		// Copy the slot, so it can remove itself (or others) while it runs
+		handler_t handler;
+		multimap<int, pthread_t>::iterator self;
+		{
+			pthread::mutexholder h(&mutex);
+			map<int, handler_t>::iterator it = handlers.find(fd);
+			if(it == handlers.end())
+				continue;
+			handler = it->second;
+			self = busy.insert(make_pair(fd, pthread_self()));
+		}
+
+		try {
+			handler(fd, events[i].events);
+		} catch(...) {
+			done(self);
+			throw;
+		}
+		done(self);
+		handled++;
+	}
+
+	return handled;
+}
+
+void EventLoop::done(const multimap<int, pthread_t>::iterator self) {
+	pthread::mutexholder h(&mutex);
+	busy.erase(self);
+	idle.broadcast();
+}
+
+void EventLoop::loop() {
+	while(running)
+		if(run() < 0)
+			break;
+}
+
+void EventLoop::start(const pthread::rtconfig &rt) {
+	if(running)
+		return;
+
+	running = true;
+	thread.create(sigc::mem_fun(*this, &EventLoop::loop), rt);
+}
+
+void EventLoop::stop() {
+	if(!running)
+		return;
+
+	running = false;
+	// This only fails if the counter is about to overflow, the loop wakes up anyway
+	uint64_t one = 1;
+	if(write(wakefd, &one, sizeof one) < 0) {}
+
+	if(!thread.isself())
+		thread.join();
+}
@@ -0,0 +1,81 @@
+/*
+ eventloop.h -- epoll based file descriptor event dispatcher
+ Copyright (C) 2012 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HAVE_EVENTLOOP_H
+#define HAVE_EVENTLOOP_H
+
+#include <sys/epoll.h>
+#include <stdint.h>
+
+#include <sigc++/slot.h>
+#include <stdexcept>
+#include <string>
+#include <map>
+#include <pthread.h>
+
+#include "pthread++.h"
+
+/*! @brief Call slots when file descriptors become readable or writable
+
+ Register file descriptors with add(), each with the epoll events (EPOLLIN,
+ EPOLLOUT, ...) to watch and a slot that is called as slot(fd, events).
+ Either call run() from your own loop, or start() a thread that does that
+ until stop(). One thread can thus serve many devices or sockets.
+
+ add(), modify() and remove() can be called from any thread, including from
+ within a slot. A slot for a removed descriptor is not called anymore after
+ remove() returns. If the slot is running in another thread, remove() waits
+ until it has returned, so the descriptor and whatever the slot uses can be
+ freed right after remove(). Called from the slot itself, remove() returns
+ immediately.
+ */
+class EventLoop {
+	int epfd;
+	int wakefd;													//!< eventfd to interrupt epoll_wait() for stop()
+
+	typedef sigc::slot<void, int, uint32_t> handler_t;
+	std::map<int, handler_t> handlers;
+	std::multimap<int, pthread_t> busy;	//!< Slots being called, and by which thread
+	pthread::mutex mutex;								//!< Protects handlers and busy
+	pthread::cond idle;									//!< Signalled when a slot returns
+	void done(const std::multimap<int, pthread_t>::iterator self); //!< Slot self has returned
+
+	bool running;
+	pthread::thread thread;
+	void loop();
+
+public:
+	EventLoop();
+	~EventLoop();
+
+	bool add(const int fd, const uint32_t events, const handler_t &handler);
+	bool modify(const int fd, const uint32_t events);
+	bool remove(const int fd);					//!< Stop watching fd, waits for its slot if it is running in another thread
+
+	int run(const int timeout = -1);		//!< Wait at most timeout ms for events and handle them, returns number handled or -1
+	void start(const pthread::rtconfig &rt = pthread::rtconfig()); //!< Call run() in a new thread until stop()
+	void stop();
+
+	class exception: public std::runtime_error {
+		public:
+		exception(const std::string reason): runtime_error(reason) {}
+	};
+};
+
+#endif // HAVE_EVENTLOOP_H
@@ -332,8 +332,8 @@ void ImgData::_swapaxes(const int* /* order */, T datacast) {
 	data.data = tmp;
 }
 
-int ImgData::setdata(void *newdata, int nd, size_t dims[], dtype_t dt, int bpp) {
-	io.msg(IO_DEB2, "ImgData::setdata(%p, %d, ..., ..., %d)", newdata, nd, bpp);
+int ImgData::setdata(void *newdata, int nd, size_t dims[], dtype_t dt, int bpp, const bool own) {
+	io.msg(IO_DEB2, "ImgData::setdata(%p, %d, ..., ..., %d, own=%d)", newdata, nd, bpp, own);
 	size_t nel=1;
 	
 	data.data = newdata;
@@ -342,6 +342,7 @@ int ImgData::setdata(void *newdata, int nd, size_t dims[], dtype_t dt, int bpp)
 		if (d >= IMGDATA_MAXNDIM)
 			return io.msg(IO_ERR, "ImgData::setdata(): number of dimensions too big!");
 		
+		data.strides[d] = nel;
 		nel *= dims[d];
 		data.dims[d] = dims[d];
 	}
@@ -349,18 +350,34 @@ int ImgData::setdata(void *newdata, int nd, size_t dims[], dtype_t dt, int bpp)
 	data.bpp = bpp;
 	
 	data.nel = nel;
-	data.size = nel * bpp;
+	data.size = nel * bpp/8;
 	
 	// New data, so stats are wrong now
 	stats.init = false;
 	
-	// This is only a reference, so somebody 
-	//! @todo Add references
-	data.refs = 1;
+	// 1 ref if this object owns the data, 2 if somebody else frees it
+	data.refs = own ? 1 : 2;
 	
 	return 0;
 }
 
+int ImgData::setdata(Csv &csv, const dtype_t dt) {
+	size_t dims[2] = {csv.nrows, 0};
+	void *block = NULL;
+	
+	if (dt == FLOAT64) {
+		dims[1] = csv.dcols.size() / max(csv.nrows, (size_t) 1);
+		block = csv.dcols.empty() ? NULL : &(csv.dcols[0]);
+	} else if (dt == INT64) {
+		dims[1] = csv.icols.size() / max(csv.nrows, (size_t) 1);
+		block = csv.icols.empty() ? NULL : &(csv.icols[0]);
+	} else {
+		return io.msg(IO_ERR, "ImgData::setdata(): Csv columns are FLOAT64 or INT64");
+	}
+	
+	return setdata(block, 2, dims, dt, 64, false);
+}
+
 #if HAVE_GSL
 gsl_matrix *ImgData::as_GSL(bool copy) {
 	if (data.ndims != 2)
@@ -453,6 +470,43 @@ int ImgData::loaddata(const Path &f, imgtype_t t) {
 	return -1;
 }
 
+int ImgData::loadrows(const Path &f, const size_t row0, const size_t nrows, size_t *height, imgtype_t t) {
+	if (t == ImgData::AUTO)
+		t = guesstype(f);
+
+	if (!nrows) {
+		err = ERR_LOAD_FILE;
+		return io.msg(IO_ERR, "ImgData::loadrows(f=%s): need at least one row.", f.c_str());
+	}
+
+	switch (t) {
+		case ImgData::FITS:
+			return loadFITS(f, row0, nrows, height);
+		case ImgData::PGM:
+			return loadPGM(f, row0, nrows, height);
+		default:
+			break;
+	}
+
+	// Other formats: load everything, then keep only the rows we need
+	if (loaddata(f, t))
+		return -1;
+	if (data.ndims != 2 || row0 >= data.dims[1]) {
+		err = ERR_LOAD_FILE;
+		return io.msg(IO_ERR, "ImgData::loadrows(f=%s): row %zu not in 2-d image.", f.c_str(), row0);
+	}
+
+	if (height)
+		*height = data.dims[1];
+	const size_t n = min(nrows, data.dims[1] - row0), rowsize = data.dims[0] * data.bpp/8;
+	memmove(data.data, (uint8_t *) data.data + row0 * rowsize, n * rowsize);
+	data.dims[1] = n;
+	data.nel = data.dims[0] * n;
+	data.size = n * rowsize;
+
+	return 0;
+}
+
 int ImgData::writedata(const Path &f, const imgtype_t t, const bool overwrite) {
 	if (f.exists()) {
 		if (!overwrite) {
@@ -489,7 +543,7 @@ int ImgData::writedata(const Path &f, const imgtype_t t, const bool overwrite) {
 }
 
 #if HAVE_CFITSIO
-int ImgData::loadFITS(const Path &file) {
+int ImgData::loadFITS(const Path &file, const size_t row0, const size_t nrows, size_t *height) {
 	io.msg(IO_DEB2, "ImgData::loadFITS(): %s", file.c_str());
 	fitsfile *fptr;
 	char fits_err[30];
@@ -526,6 +580,21 @@ int ImgData::loadFITS(const Path &file) {
 		data.dims[d] = naxes[d];
 		data.nel *= naxes[d];
 	}
+	
+	// Only read rows [row0, row0+nrows), these are contiguous in a 2-d image
+	long firstelem = 1;
+	if (nrows) {
+		if (ndims != 2 || row0 >= data.dims[1]) {
+			fits_close_file(fptr, &stat);
+			err = ERR_LOAD_FILE;
+			return io.msg(IO_ERR, "ImgData::loadFITS(): row %zu not in 2-d image.", row0);
+		}
+		if (height)
+			*height = data.dims[1];
+		data.dims[1] = min(nrows, data.dims[1] - row0);
+		data.nel = data.dims[0] * data.dims[1];
+		firstelem += row0 * data.dims[0];
+	}
 	data.size = data.nel * data.bpp/8;
 	data.data = (void *) malloc(data.size);
 	data.refs++;
@@ -538,7 +607,7 @@ int ImgData::loadFITS(const Path &file) {
 	switch (bitpix) {
 		case BYTE_IMG: {
 			uint8_t nulval = 0;
-			fits_read_img(fptr, TBYTE, 1, data.nel, &nulval, \
+			fits_read_img(fptr, TBYTE, firstelem, data.nel, &nulval, \
 						  (uint8_t *) (data.data), &anynul, &stat);
 			data.dt = UINT8;
 			break;
@@ -546,35 +615,35 @@ int ImgData::loadFITS(const Path &file) {
 		case SHORT_IMG: {
 			uint16_t nulval = 0;
 			//! @bug gives datatype conversion overflow
-			fits_read_img(fptr, TUSHORT, 1, data.nel, &nulval, \
+			fits_read_img(fptr, TUSHORT, firstelem, data.nel, &nulval, \
 						  (uint16_t *) (data.data), &anynul, &stat);					
 			data.dt = UINT16;
 			break;
 		}
 		case LONG_IMG: {
 			uint32_t nulval = 0;
-			fits_read_img(fptr, TUINT, 1, data.nel, &nulval, \
+			fits_read_img(fptr, TUINT, firstelem, data.nel, &nulval, \
 						  (uint32_t *) (data.data), &anynul, &stat);					
 			data.dt = UINT32;
 			break;
 		}
 		case LONGLONG_IMG: {
 			uint64_t nulval = 0;
-			fits_read_img(fptr, TULONG, 1, data.nel, &nulval, \
+			fits_read_img(fptr, TULONG, firstelem, data.nel, &nulval, \
 										(uint32_t *) (data.data), &anynul, &stat);					
 			data.dt = UINT32;
 			break;
 		}
 		case FLOAT_IMG: {
 			float nulval = 0;
-			fits_read_img(fptr, TFLOAT, 1, data.nel, &nulval, \
+			fits_read_img(fptr, TFLOAT, firstelem, data.nel, &nulval, \
 						  (float *) (data.data), &anynul, &stat);					
 			data.dt = FLOAT32;
 			break;
 		}
 		case DOUBLE_IMG: {
 			double nulval = 0;
-			fits_read_img(fptr, TDOUBLE, 1, data.nel, &nulval, \
+			fits_read_img(fptr, TDOUBLE, firstelem, data.nel, &nulval, \
 						  (double *) (data.data), &anynul, &stat);					
 			data.dt = FLOAT64;
 			break;
@@ -603,7 +672,7 @@ int ImgData::loadFITS(const Path &file) {
 	return 0;
 }
 #else
-int ImgData::loadFITS(const Path &file) {
+int ImgData::loadFITS(const Path &file, const size_t, const size_t, size_t *) {
 	return io.msg(IO_ERR, "ImgData::loadFITS(): not supported, library was not available during compilation.");
 }
 #endif // HAVE_CFITSIO
@@ -680,7 +749,7 @@ int ImgData::loadICS(const Path &file) {
 }
 #endif // HAVE_ICS
 
-int ImgData::loadPGM(const Path &file) {
+int ImgData::loadPGM(const Path &file, const size_t row0, const size_t nrows, size_t *height) {
 	io.msg(IO_DEB2, "ImgData::loadPGM(): %s", file.c_str());
 
 	// see http://netpbm.sourceforge.net/doc/pgm.html
@@ -697,6 +766,7 @@ int ImgData::loadPGM(const Path &file) {
 	// Read magic
 	fread(magic, 2, 1, fd);
 	if (ferror(fd)) {
+		fclose(fd);
 		err = ERR_LOAD_FILE;
 		return io.msg(IO_ERR, "ImgData::loadPGM(): Error reading PGM file.");
 	}
@@ -708,6 +778,7 @@ int ImgData::loadPGM(const Path &file) {
 	data.nel = data.dims[0] * data.dims[1];
 	
 	if (data.dims[0] <= 0 || data.dims[1] <= 0) {
+		fclose(fd);
 		err = ERR_LOAD_FILE;
 		return io.msg(IO_ERR, "ImgData::loadPGM(): Unable to read image width and height");
 	}
@@ -715,10 +786,26 @@ int ImgData::loadPGM(const Path &file) {
 	// Maxval
 	maxval = readNumber(fd);
 	if (maxval <= 0 || maxval > 65536) {
+		fclose(fd);
 		err = ERR_TYPE_UNSUPP;
 		return io.msg(IO_ERR, "ImgData::loadPGM(): Unsupported PGM format");
 	}
 	
+	// Only rows [row0, row0+nrows)
+	size_t skip = 0;
+	if (nrows) {
+		if (row0 >= data.dims[1]) {
+			fclose(fd);
+			err = ERR_LOAD_FILE;
+			return io.msg(IO_ERR, "ImgData::loadPGM(): row %zu not in image.", row0);
+		}
+		if (height)
+			*height = data.dims[1];
+		data.dims[1] = min(nrows, data.dims[1] - row0);
+		data.nel = data.dims[0] * data.dims[1];
+		skip = row0 * data.dims[0];
+	}
+	
 	if (maxval <= 255) {
 		data.dt = UINT8;
 		data.bpp = 8;
@@ -727,13 +814,18 @@ int ImgData::loadPGM(const Path &file) {
 		data.dt = UINT16;
 		data.bpp = 16;
 	}
-	data.data = malloc(data.nel * data.bpp/8);
+	data.size = data.nel * data.bpp/8;
+	data.data = malloc(data.size);
 	data.refs++;
+	stats.init = false;
 	
 	// Read the rest
 	if (!strncmp(magic, "P5", 2)) { // Binary
+		if (skip)
+			fseeko(fd, skip * data.bpp/8, SEEK_CUR);
 		n = fread(data.data, data.bpp/8, data.nel, fd);
 		if (ferror(fd)) {
+			fclose(fd);
 			err = ERR_LOAD_FILE;
 			if (data.data)
 				free(data.data);
@@ -743,6 +835,8 @@ int ImgData::loadPGM(const Path &file) {
 		}
 	}
 	else if (!strncmp(magic, "P2", 2)) { // ASCII
+		for (size_t p=0; p < skip; p++)
+			readNumber(fd);
 		if (data.dt == UINT8)
 			for (size_t p=0; p < data.nel; p++)
 				((uint8_t *) data.data)[p] = readNumber(fd);
@@ -751,10 +845,12 @@ int ImgData::loadPGM(const Path &file) {
 				((uint16_t *) data.data)[p] = readNumber(fd);
 	}
 	else {
+		fclose(fd);
 		err = ERR_TYPE_UNSUPP;
 		return io.msg(IO_ERR, "ImgData::loadPGM(): Unsupported PGM format");
 	}
 	
+	fclose(fd);
 	return 0;
 }
 
@@ -873,6 +969,10 @@ int ImgData::writePGM(const Path &file) {
 	io.msg(IO_DEB2, "ImgData::writePGM()");	
 	
 	FILE *fd = fopen(file.c_str(), "wb+");
+	if (!fd) {
+		err = ERR_CREATE_FILE;
+		return io.msg(IO_ERR, "ImgData::writePGM(): Could not create file '%s'.", file.c_str());
+	}
 	
 	int maxval=0;
 	switch (data.dt) {
@@ -42,6 +42,7 @@
 #include "types.h"
 #include "path++.h"
 #include "io.h"
+#include "csv.h"
 
 const uint8_t IMGDATA_MAXNDIM = 32;
 
@@ -112,10 +113,10 @@ private:
 	error_t err;
 	data_t data;
 	
-	int loadFITS(const Path&);					//!< Load FITS Files (cfitsio)
+	int loadFITS(const Path&, const size_t row0=0, const size_t nrows=0, size_t *height=NULL); //!< Load FITS Files (cfitsio), or only rows [row0, row0+nrows)
 	int loadICS(const Path&);						//!< Load ICS Files (libics)
 	int loadGSL(const Path&);						//!< Load GSL matrices (lgsl)
-	int loadPGM(const Path&);						//!< Load PGM files
+	int loadPGM(const Path&, const size_t row0=0, const size_t nrows=0, size_t *height=NULL); //!< Load PGM files, or only rows [row0, row0+nrows)
 	
 	int writeFITS(const Path&);					//!< Write FITS
 	int writeICS(const Path&);					//!< Write ICS
@@ -164,11 +165,15 @@ public:
 	
 	// Generic data IO routines
 	int loaddata(const Path&, imgtype_t);
+	// Load rows [row0, row0+nrows) of a 2-d image as a (width x nrows) image, the file's full height is stored in height. FITS and PGM only read these rows from disk.
+	int loadrows(const Path &f, const size_t row0, const size_t nrows, size_t *height=NULL, imgtype_t t=AUTO);
 	int writedata(const Path &p, const imgtype_t t, const bool overwrite=false);
 	int writedata(const std::string pstr, const imgtype_t t, const bool overwrite=false) { Path p(pstr); return writedata(p, t, overwrite); }
 	
-	// Create from data
-	int setdata(void *data, int nd, size_t dims[], dtype_t dt, int bpp);
+	// Create from data. If own is false, data is only referenced and not freed.
+	int setdata(void *data, int nd, size_t dims[], dtype_t dt, int bpp, const bool own=true);
+	// Reference all columns of type dt (FLOAT64 or INT64) of csv as 2-d (nrows x ncolumns) data, without copying
+	int setdata(Csv &csv, const dtype_t dt=FLOAT64);
 	
 	// Return a single pixel at (1-d) index idx
 	double getpixel(const int idx);
@@ -0,0 +1,457 @@
+/*
+ imgpipe.cc -- process directories of image frames in a pipeline of threads
+ Copyright (C) 2012 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include <sigc++/sigc++.h>
+
+#include "time++.h"
+#include "imgpipe.h"
+
+using namespace std;
+
+namespace {
+	template <typename T, typename O>
+	void convert(const void *data, size_t begin, size_t end, O *out) {
+		const T *in = (const T *) data;
+		for (size_t p=begin; p<end; p++)
+			*out++ = (O) in[p];
+	}
+
+	template <typename O>
+	void convert(const ImgData &img, size_t begin, size_t end, O *out) {
+		const void *d = img.getdata();
+		switch (img.getdtype()) {
+			case UINT8: convert<uint8_t>(d, begin, end, out); break;
+			case INT8: convert<int8_t>(d, begin, end, out); break;
+			case UINT16: convert<uint16_t>(d, begin, end, out); break;
+			case INT16: convert<int16_t>(d, begin, end, out); break;
+			case UINT32: convert<uint32_t>(d, begin, end, out); break;
+			case INT32: convert<int32_t>(d, begin, end, out); break;
+			case UINT64: convert<uint64_t>(d, begin, end, out); break;
+			case INT64: convert<int64_t>(d, begin, end, out); break;
+			case FLOAT32: convert<float>(d, begin, end, out); break;
+			case FLOAT64: convert<double>(d, begin, end, out); break;
+			default: memset(out, 0, (end - begin) * sizeof(O)); break;
+		}
+	}
+
+	bool cmp_index(const pair<size_t, float *> &a, const pair<size_t, float *> &b) { return a.first < b.first; }
+
+	struct inrange {
+		inrange(const double lo, const double hi): lo(lo), hi(hi) { }
+		bool operator()(const float v) const { return v >= lo && v <= hi; }
+		double lo, hi;
+	};
+
+	const char *typeext(const ImgData::imgtype_t t) {
+		switch (t) {
+			case ImgData::FITS: return "fits";
+			case ImgData::ICS: return "ics";
+			case ImgData::PGM: return "pgm";
+			case ImgData::GSL: return "gsl";
+			default: return "";
+		}
+	}
+}
+
+/*
+ * ImgCombine
+ */
+
+ImgCombine::ImgCombine(Io &io, const method_t m): io(io), method(m), ndims(0), nel(0), nframes(0) {
+	dims[0] = dims[1] = 0;
+}
+
+ImgCombine::~ImgCombine() {
+	for (size_t i=0; i<frames.size(); i++)
+		free(frames[i].second);
+}
+
+void ImgCombine::todouble(const ImgData &img, size_t begin, size_t end, double *out) { convert(img, begin, end, out); }
+void ImgCombine::tofloat(const ImgData &img, size_t begin, size_t end, float *out) { convert(img, begin, end, out); }
+
+void ImgCombine::add(ImgData *img, size_t idx) {
+	if (!img || !img->getdata())
+		return;
+
+	// Convert outside the lock, frames can arrive from several threads
+	float *pix = NULL;
+	if (method != MEAN) {
+		pix = (float *) malloc(img->getnel() * sizeof(float));
+		tofloat(*img, 0, img->getnel(), pix);
+	}
+
+	pthread::mutexholder h(&mutex);
+	if (nframes == 0) {
+		nel = img->getnel();
+		ndims = img->getndims() >= 2 ? 2 : 1;
+		dims[0] = img->getwidth();
+		dims[1] = ndims == 2 ? nel / dims[0] : 1;
+		if (method == MEAN)
+			sum.assign(nel, 0.0);
+	} else if (img->getnel() != nel) {
+		free(pix);
+		io.msg(IO_WARN, "ImgCombine::add(): frame %zu has %zu pixels instead of %zu, skipping", idx, img->getnel(), nel);
+		return;
+	}
+
+	if (method == MEAN) {
+		// Convert per block to keep the temporary small
+		double buf[1024];
+		for (size_t b=0; b<nel; b += 1024) {
+			const size_t e = min(nel, b + 1024);
+			todouble(*img, b, e, buf);
+			for (size_t p=b; p<e; p++)
+				sum[p] += buf[p - b];
+		}
+	} else {
+		frames.push_back(make_pair(idx, pix));
+	}
+	nframes++;
+}
+
+ImgData *ImgCombine::result() {
+	pthread::mutexholder h(&mutex);
+	if (!nframes)
+		return NULL;
+
+	ImgData *out = new ImgData(io);
+
+	if (method == STACK) {
+		sort(frames.begin(), frames.end(), cmp_index);
+		float *cube = (float *) malloc(nel * nframes * sizeof(float));
+		for (size_t i=0; i<nframes; i++)
+			memcpy(cube + i * nel, frames[i].second, nel * sizeof(float));
+		size_t cdims[3] = {dims[0], dims[1], nframes};
+		out->setdata(cube, 3, cdims, FLOAT32, 32);
+		return out;
+	}
+
+	double *res = (double *) malloc(nel * sizeof(double));
+	if (method == MEAN) {
+		for (size_t p=0; p<nel; p++)
+			res[p] = sum[p] / nframes;
+	} else {
+		vector<float> vals(nframes);
+		for (size_t p=0; p<nel; p++) {
+			for (size_t i=0; i<nframes; i++)
+				vals[i] = frames[i].second[p];
+			res[p] = ImgStack::median(&vals[0], nframes);
+		}
+	}
+	out->setdata(res, ndims, dims, FLOAT64, 64);
+	return out;
+}
+
+/*
+ * ImgStack
+ */
+
+ImgStack::ImgStack(Io &io, const size_t nworkers, const size_t bandmem):
+io(io), workers(nworkers), bandmem(bandmem), nsigma(3.0), maxiter(5),
+files(NULL), method(MEDIAN), width(0), height(0), bandrows(0), result(NULL), nfailed(0)
+{ }
+
+// Batcher's odd-even merge sort of 16 values. Dropping the comparisons 
+// beyond n sorts n < 16 values, as if the rest were +infinity.
+static const unsigned char network[63][2] = {
+	{0,1}, {2,3}, {4,5}, {6,7}, {8,9}, {10,11}, {12,13}, {14,15},
+	{0,2}, {1,3}, {4,6}, {5,7}, {8,10}, {9,11}, {12,14}, {13,15},
+	{1,2}, {5,6}, {9,10}, {13,14},
+	{0,4}, {1,5}, {2,6}, {3,7}, {8,12}, {9,13}, {10,14}, {11,15},
+	{2,4}, {3,5}, {10,12}, {11,13},
+	{1,2}, {3,4}, {5,6}, {9,10}, {11,12}, {13,14},
+	{0,8}, {1,9}, {2,10}, {3,11}, {4,12}, {5,13}, {6,14}, {7,15},
+	{4,8}, {5,9}, {6,10}, {7,11},
+	{2,4}, {3,5}, {6,8}, {7,9}, {10,12}, {11,13},
+	{1,2}, {3,4}, {5,6}, {7,8}, {9,10}, {11,12}, {13,14}
+};
+
+float ImgStack::median(float *v, const size_t n) {
+	const size_t mid = n / 2;
+	if (n <= 16) {
+		// Sorting network for the few frames of a typical stack: the same 
+		// comparisons for any data, each a branch-free min/max exchange
+		for (size_t c=0; c<sizeof network / sizeof network[0]; c++) {
+			const size_t lo = network[c][0], hi = network[c][1];
+			if (hi < n) {
+				const float a = v[lo], b = v[hi];
+				v[lo] = min(a, b);
+				v[hi] = max(a, b);
+			}
+		}
+		return n % 2 ? v[mid] : (v[mid-1] + v[mid]) / 2;
+	}
+
+	nth_element(v, v + mid, v + n);
+	if (n % 2)
+		return v[mid];
+	// Even number: average with the largest value of the lower half
+	return (v[mid] + *max_element(v, v + mid)) / 2;
+}
+
+float ImgStack::sigmaclip(float *v, const size_t n, const double nsigma, const int maxiter) {
+	size_t k = n;
+	double mean = 0;
+	for (int iter=0; ; iter++) {
+		double sum = 0, sumsq = 0;
+		for (size_t i=0; i<k; i++) {
+			sum += v[i];
+			sumsq += (double) v[i] * v[i];
+		}
+		mean = sum / k;
+		if (iter >= maxiter || k < 3)
+			break;
+
+		const double var = sumsq / k - mean * mean;
+		const double lim = nsigma * (var > 0 ? sqrt(var) : 0);
+		const double med = median(v, k);
+		// Move the values we keep to the front
+		const size_t keep = partition(v, v + k, inrange(med - lim, med + lim)) - v;
+		if (keep == k || keep == 0)
+			break;
+		k = keep;
+	}
+	return mean;
+}
+
+void ImgStack::band(size_t begin, size_t end) {
+	const size_t nf = files->size();
+	vector<float> frame, pixels;
+
+	for (size_t b=begin; b<end; b++) {
+		const size_t row0 = b * bandrows;
+		const size_t npix = min(bandrows, height - row0) * width;
+
+		// Pixel-major: the values of one pixel are contiguous for median()
+		frame.resize(npix);
+		pixels.resize(npix * nf);
+		for (size_t f=0; f<nf; f++) {
+			ImgData img(io);
+			if (img.loadrows((*files)[f], row0, bandrows) || img.getwidth() != width || img.getnel() != npix) {
+				io.msg(IO_ERR, "ImgStack::band(): could not load rows %zu-%zu of '%s'", row0, row0 + npix/width, (*files)[f].c_str());
+				__atomic_add_fetch(&nfailed, 1, __ATOMIC_RELAXED);
+				return;
+			}
+			ImgCombine::tofloat(img, 0, npix, &frame[0]);
+			for (size_t p=0; p<npix; p++)
+				pixels[p * nf + f] = frame[p];
+		}
+
+		float *out = result + row0 * width;
+		for (size_t p=0; p<npix; p++)
+			out[p] = method == MEDIAN ? median(&pixels[p * nf], nf) : sigmaclip(&pixels[p * nf], nf, nsigma, maxiter);
+	}
+}
+
+ImgData *ImgStack::stack(const std::vector<Path> &f, const method_t m) {
+	if (f.empty())
+		return NULL;
+
+	// Frame size from the first row of the first frame
+	ImgData first(io);
+	if (first.loadrows(f[0], 0, 1, &height))
+		return NULL;
+	width = first.getwidth();
+
+	// Bands in memory at once: one per worker, plus the calling thread
+	const size_t perband = bandmem / (workers.size() + 1);
+	bandrows = max((size_t) 1, min(height, perband / (width * f.size() * sizeof(float))));
+	const size_t nbands = (height + bandrows - 1) / bandrows;
+	io.msg(IO_INFO, "ImgStack::stack(): %zu frames of %zux%zu in %zu bands of %zu rows", f.size(), width, height, nbands, bandrows);
+
+	files = &f;
+	method = m;
+	nfailed = 0;
+	result = (float *) malloc(width * height * sizeof(float));
+
+	workers.parallel_for(0, nbands, sigc::mem_fun(*this, &ImgStack::band), 1);
+
+	files = NULL;
+	if (nfailed) {
+		free(result);
+		return NULL;
+	}
+
+	ImgData *out = new ImgData(io);
+	size_t dims[2] = {width, height};
+	out->setdata(result, 2, dims, FLOAT32, 32);
+	return out;
+}
+
+int ImgStack::stack(const std::vector<Path> &f, const method_t m, const Path &out, const ImgData::imgtype_t t, const bool overwrite) {
+	ImgData *img = stack(f, m);
+	if (!img)
+		return -1;
+	int ret = img->writedata(out, t, overwrite);
+	delete img;
+	return ret;
+}
+
+/*
+ * ImgPipeline
+ */
+
+ImgPipeline::ImgPipeline(Io &io, const size_t nreaders, const size_t nworkers, const size_t depth):
+io(io), nreaders(max(nreaders, (size_t) 1)), depth(max(depth, (size_t) 1)), workers(nworkers),
+files(NULL), nextfile(0), readersleft(0), loaded(depth), computed(depth), inflight(0),
+outtype(ImgData::FITS), overwrite(false)
+{
+	perf[0] = perf[1] = perf[2] = NULL;
+}
+
+ImgPipeline::~ImgPipeline() {
+	for (int i=0; i<3; i++)
+		delete perf[i];
+}
+
+void ImgPipeline::setoutput(const Path &dir, const ImgData::imgtype_t t, const bool ow) {
+	outdir = dir;
+	outtype = t;
+	overwrite = ow;
+}
+
+void ImgPipeline::setperflog(const double interval, const bool print) {
+	for (int i=0; i<3; i++) {
+		delete perf[i];
+		perf[i] = new PerfLog(interval, true, print);
+	}
+}
+
+void ImgPipeline::reader() {
+	size_t i;
+	while ((i = __atomic_fetch_add(&nextfile, 1, __ATOMIC_RELAXED)) < files->size()) {
+		ImgData *img = new ImgData(io, (*files)[i]);
+		if (img->geterr() != ImgData::ERR_NO_ERROR || !img->getdata()) {
+			io.msg(IO_WARN, "ImgPipeline::reader(): could not load '%s'", (*files)[i].c_str());
+			__atomic_add_fetch(&st.nfailed, 1, __ATOMIC_RELAXED);
+			delete img;
+			continue;
+		}
+		__atomic_add_fetch(&st.nread, 1, __ATOMIC_RELAXED);
+		if (perf[0])
+			perf[0]->addlog("read");
+		loaded.push(item_t(img, i));
+	}
+
+	// Last reader out marks the end
+	if (__atomic_sub_fetch(&readersleft, 1, __ATOMIC_ACQ_REL) == 0)
+		loaded.push(item_t(NULL, SIZE_MAX));
+}
+
+void ImgPipeline::compute(item_t it) {
+	ImgData *out = it.img;
+	if (!slot_compute.empty()) {
+		out = slot_compute(it.img, it.idx);
+		if (out != it.img)
+			delete it.img;
+	}
+
+	if (out) {
+		__atomic_add_fetch(&st.ncomputed, 1, __ATOMIC_RELAXED);
+		if (perf[1])
+			perf[1]->addlog("compute");
+		computed.push(item_t(out, it.idx));
+	}
+
+	pthread::mutexholder h(&inflight_mutex);
+	inflight--;
+	inflight_cond.signal();
+}
+
+void ImgPipeline::writer() {
+	item_t it;
+	while (true) {
+		computed.pop(it);
+		if (it.idx == SIZE_MAX)
+			break;
+
+		bool ok = true;
+		if (outdir.isset()) {
+			string name = (*files)[it.idx].basename().str();
+			name = name.substr(0, name.rfind('.')) + "." + typeext(outtype);
+			ok = !it.img->writedata(outdir + name, outtype, overwrite);
+		}
+		if (!slot_write.empty())
+			slot_write(it.img, it.idx);
+
+		if (ok)
+			st.nwritten++;
+		else
+			__atomic_add_fetch(&st.nfailed, 1, __ATOMIC_RELAXED);
+		if (perf[2])
+			perf[2]->addlog("write");
+		delete it.img;
+	}
+}
+
+int ImgPipeline::run(const std::vector<Path> &f) {
+	MonoTime start = MonoTime::now();
+	st = stats_t();
+	files = &f;
+	nextfile = 0;
+	readersleft = nreaders;
+
+	pthread::thread wthr;
+	wthr.create(sigc::mem_fun(*this, &ImgPipeline::writer));
+
+	vector<pthread::thread> rthr(nreaders);
+	for (size_t i=0; i<nreaders; i++)
+		rthr[i].create(sigc::mem_fun(*this, &ImgPipeline::reader));
+
+	// Hand frames to the pool, but keep at most 2 per worker in there
+	const size_t maxinflight = 2 * workers.size();
+	item_t it;
+	while (true) {
+		loaded.pop(it);
+		if (it.idx == SIZE_MAX)
+			break;
+
+		{
+			pthread::mutexholder h(&inflight_mutex);
+			while (inflight >= maxinflight)
+				inflight_cond.wait(inflight_mutex);
+			inflight++;
+		}
+		workers.post(sigc::bind(sigc::mem_fun(*this, &ImgPipeline::compute), it));
+	}
+
+	// Drain the compute stage, then stop the writer
+	{
+		pthread::mutexholder h(&inflight_mutex);
+		while (inflight > 0)
+			inflight_cond.wait(inflight_mutex);
+	}
+	computed.push(item_t(NULL, SIZE_MAX));
+
+	wthr.join();
+	for (size_t i=0; i<nreaders; i++)
+		rthr[i].join();
+
+	st.seconds = (MonoTime::now() - start).as_sec();
+	io.msg(IO_INFO, "ImgPipeline::run(): %zu files, %zu read, %zu written, %zu failed in %.2f s (%.1f frames/s)",
+				 f.size(), st.nread, st.nwritten, st.nfailed, st.seconds, st.nwritten / max(st.seconds, 1e-9));
+
+	files = NULL;
+	return st.nfailed;
+}
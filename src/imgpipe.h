@@ -0,0 +1,208 @@
+/*
+ imgpipe.h -- process directories of image frames in a pipeline of threads
+ Copyright (C) 2012 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HAVE_IMGPIPE_H
+#define HAVE_IMGPIPE_H
+
+#include <stdint.h>
+
+#include <sigc++/slot.h>
+#include <string>
+#include <vector>
+
+#include "pthread++.h"
+#include "imgdata.h"
+#include "perflogger.h"
+#include "path++.h"
+#include "io.h"
+
+/*! @brief Combine frames into one: a cube, or the per-pixel mean or median
+
+ Frames can be added from any thread with add(), in any order: they are
+ ordered by their index. STACK and MEDIAN keep all frames in memory (as
+ float), MEAN only keeps a running sum. All frames must have the same
+ number of pixels. See ImgStack for a median over more frames than fit in
+ memory.
+ */
+class ImgCombine {
+public:
+	typedef enum {
+		STACK=0,													//!< width x height x nframes cube (FLOAT32)
+		MEAN,															//!< Per-pixel mean (FLOAT64)
+		MEDIAN														//!< Per-pixel median (FLOAT64)
+	} method_t;
+
+private:
+	Io &io;
+	const method_t method;
+
+	size_t ndims;
+	size_t dims[2];
+	size_t nel;														//!< Pixels per frame
+
+	std::vector<double> sum;							//!< Running sum for MEAN
+	std::vector< std::pair<size_t, float *> > frames; //!< (index, pixels) for STACK and MEDIAN
+	size_t nframes;
+	pthread::mutex mutex;									//!< Protects all of the above
+
+public:
+	ImgCombine(Io &io, const method_t m);
+	~ImgCombine();
+
+	void add(ImgData *img, size_t idx);		//!< Add frame number idx, can be connected to ImgPipeline::slot_write
+	ImgData *result();										//!< New image with the combination of all frames (caller deletes), or NULL if there are none
+	size_t getnframes() { pthread::mutexholder h(&mutex); return nframes; }
+
+	static void todouble(const ImgData &img, size_t begin, size_t end, double *out); //!< Convert pixels [begin, end) of any type to double
+	static void tofloat(const ImgData &img, size_t begin, size_t end, float *out); //!< Convert pixels [begin, end) of any type to float
+};
+
+/*! @brief Per-pixel median or sigma-clipped mean of many 2-d frames
+
+ Frames are not loaded completely: the image is split in bands of rows, and
+ for each band only those rows are read from every file (see
+ ImgData::loadrows()). Bands are combined in parallel in a pthread::pool,
+ with at most bandmem bytes of frame data in memory for all bands together,
+ so hundreds of large frames can be combined. The result is one FLOAT32
+ frame.
+
+ SIGMACLIP iteratively rejects values more than nsigma standard deviations
+ from the median, and returns the mean of the rest (see setclip()).
+ */
+class ImgStack {
+public:
+	typedef enum {
+		MEDIAN=0,													//!< Per-pixel median
+		SIGMACLIP													//!< Per-pixel sigma-clipped mean
+	} method_t;
+
+private:
+	Io &io;
+	pthread::pool workers;
+	const size_t bandmem;									//!< Maximum bytes of frame data in memory
+
+	double nsigma;												//!< Clipping threshold for SIGMACLIP
+	int maxiter;													//!< Maximum clipping iterations for SIGMACLIP
+
+	const std::vector<Path> *files;				//!< Frames being stacked
+	method_t method;
+	size_t width, height;
+	size_t bandrows;											//!< Rows per band
+	float *result;
+	size_t nfailed;												//!< Bands that could not be loaded (atomic)
+
+	void band(size_t begin, size_t end);	//!< Load and combine bands [begin, end)
+
+public:
+	ImgStack(Io &io, const size_t nworkers=0, const size_t bandmem=64*1024*1024);
+
+	void setclip(const double n=3.0, const int iter=5) { nsigma = n; maxiter = iter; }
+
+	ImgData *stack(const std::vector<Path> &files, const method_t m); //!< New image with the combination of files (caller deletes), NULL on error
+	int stack(const std::vector<Path> &files, const method_t m, const Path &out, const ImgData::imgtype_t t=ImgData::FITS, const bool overwrite=false); //!< Combine files and write the result to out
+
+	static float median(float *v, const size_t n); //!< Median of v[0..n), reorders v
+	static float sigmaclip(float *v, const size_t n, const double nsigma, const int maxiter); //!< Sigma-clipped mean of v[0..n), reorders v
+};
+
+/*! @brief Load, process and write many image frames in parallel
+
+ Three stages run at the same time, connected by bounded queues:
+
+ - read: nreaders threads load the files with ImgData (I/O bound, so more
+   threads than CPUs can help on network or RAID storage)
+ - compute: slot_compute(frame, index) runs in a pthread::pool of nworkers
+ - write: one thread writes each frame to the output directory (see
+   setoutput()), and/or passes it to slot_write(frame, index), e.g.
+   ImgCombine::add()
+
+ At most depth frames wait between two stages, and at most 2 * nworkers
+ frames are being computed, so memory use is bounded no matter how many
+ files there are. Frames may complete out of order, use the index to sort.
+
+ slot_compute can modify the frame and return it, or return a new ImgData
+ (the input frame is then deleted), or return NULL to drop the frame.
+ Frames are deleted after the write stage.
+
+ With setperflog(), each stage logs its rate (frames/s) in its own PerfLog.
+ */
+class ImgPipeline {
+public:
+	typedef sigc::slot<ImgData *, ImgData *, size_t> compute_t;
+	typedef sigc::slot<void, ImgData *, size_t> write_t;
+
+	typedef struct stats {
+		stats(): nread(0), nfailed(0), ncomputed(0), nwritten(0), seconds(0) { }
+		size_t nread;												//!< Frames loaded
+		size_t nfailed;											//!< Frames that failed to load or write
+		size_t ncomputed;										//!< Frames returned by slot_compute
+		size_t nwritten;										//!< Frames passed through the write stage
+		double seconds;											//!< Wall-clock time of run()
+	} stats_t;
+
+private:
+	typedef struct item {
+		item(ImgData *i=NULL, size_t n=0): img(i), idx(n) { }
+		ImgData *img;
+		size_t idx;													//!< Index in the file list, SIZE_MAX marks the end
+	} item_t;
+
+	Io &io;
+	const size_t nreaders;
+	const size_t depth;
+	pthread::pool workers;
+
+	const std::vector<Path> *files;
+	size_t nextfile;											//!< Next file for a reader (atomic)
+	size_t readersleft;										//!< Running readers (atomic), the last one marks the end
+
+	pthread::mpmc_queue<item_t> loaded;		//!< read -> compute
+	pthread::mpmc_queue<item_t> computed;	//!< compute -> write
+
+	size_t inflight;											//!< Frames in the compute stage
+	pthread::mutex inflight_mutex;
+	pthread::cond inflight_cond;
+
+	Path outdir;
+	ImgData::imgtype_t outtype;
+	bool overwrite;
+
+	PerfLog *perf[3];											//!< read, compute, write
+
+	stats_t st;
+
+	void reader();
+	void compute(item_t it);
+	void writer();
+
+public:
+	ImgPipeline(Io &io, const size_t nreaders=2, const size_t nworkers=0, const size_t depth=16);
+	~ImgPipeline();
+
+	compute_t slot_compute;								//!< Process one frame (empty: pass through)
+	write_t slot_write;										//!< Called for each frame after it is written, from the writer thread
+
+	void setoutput(const Path &dir, const ImgData::imgtype_t t=ImgData::FITS, const bool overwrite=false); //!< Write each frame to dir, with the same basename
+	void setperflog(const double interval=1.0, const bool print=true); //!< Log per-stage throughput every interval seconds
+
+	int run(const std::vector<Path> &files); //!< Push all files through the pipeline, returns number of failures
+	stats_t getstats() const { return st; }
+};
+
+#endif // HAVE_IMGPIPE_H
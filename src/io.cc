@@ -26,35 +26,37 @@
 */
 
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <sigc++/signal.h>
 #include "pthread++.h"
 #include "path++.h"
 #include "format.h"
+#include "periodic.h"
 #include "io.h"
+#include "sighandle.h"
 
 const std::string PREFIX[] = {"",  "err ", "warn", "info", "xnfo", "dbg1", "dbg2"};
 
-Io::Io(const int l): verb(l), termfd(stdout), logfd(NULL), defmask(0), do_log(true), totmsg(0), lockfail(0), buffull(0) { 
+Io::Io(const int l, const pthread::rtconfig &rt): verb(l), termfd(stdout), logfd(NULL), defmask(0), clocksrc(Clock::REALTIME), do_log(true), totmsg(0), buffull(0), ringpos(0) { 
+	memset(ring, 0, sizeof ring);
 	verb = max(1, min(l, IO_MAXLEVEL)); 
 
 	// Start handler thread, which will take care of emptying the buffer
 	{
 		pthread::mutexholder h(&handler_mutex);
-		handler_thr.create(sigc::mem_fun(*this, &Io::handler));
+		handler_thr.create(sigc::mem_fun(*this, &Io::handler), rt);
 		handler_cond.wait(handler_mutex);
 	}
 }
 
 Io::~Io(void) {
-	parse_msg(IO_INFO, format("Stopping Io, total messages: %zu, lockfail lost: %zu, buffer lost: %zu", totmsg, lockfail, buffull));
-	// Stop handler() thread
+	// The crash handler must not read our ring after this
+	SigHandle::removecrashdump(Io::crashdump, this);
+	parse_msg(IO_INFO, format("Stopping Io, total messages: %zu, buffer lost: %zu", totmsg, buffull), Clock::timeval(clocksrc));
+	// Stop handler() thread, it checks do_log at least every 50 ms. Don't 
+	// cancel it: asynchronous cancellation could hit it inside free().
 	do_log = false;
-
-	// Wait until handler() stops
-	//! @bug: Illegal free() somewhere in parse_msg() during stopping.
-	pthread::mutexholder h(&handler_runmutex);
-	handler_thr.cancel();
 	handler_thr.join();
 	
 	// Close FD if necessary
@@ -65,6 +67,7 @@ Io::~Io(void) {
 void Io::handler() {
 	pthread::setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS);
 	bool init=false;
+	Periodic tick(Duration::msec(50));
 	
 	pthread::mutexholder h(&handler_runmutex);
 	
@@ -77,30 +80,29 @@ void Io::handler() {
 		}
 		// Wait until there is a new message
 		//!< @todo Can we improve this with signals?
-		usleep(0.05 * 1e6);
+		tick.wait();
 		
-		while (!msgbuf.empty()) {
-			// Get mutex to delete with data
-			pthread::mutexholder h(&log_mutex);
-			
-			// Print & store messages
-			IoMessage *thismsg = msgbuf.front();
-			parse_msg(thismsg->type, thismsg->msg);
-			
-			//fprintf(stderr, "Io::lockfail: %zu, got msg: %s\n", lockfail, thismsg->msg.c_str());
-			delete thismsg;
-			msgbuf.pop();
-		}
+		flush();
 	}
 	
 	// Flush one last time
-	while (!msgbuf.empty()) {
-		pthread::mutexholder h(&log_mutex);
-		
-		IoMessage *thismsg = msgbuf.front();
-		parse_msg(thismsg->type, thismsg->msg);
+	flush();
+}
+
+void Io::flush() {
+	// Take all messages at once and print them without holding log_mutex, so 
+	// msg() never waits for terminal or file I/O.
+	deque<IoMessage *> todo;
+	{
+		pthread::lockholder<pthread::spinmutex> h(&log_mutex);
+		todo.swap(msgbuf);
+	}
+	
+	while (!todo.empty()) {
+		IoMessage *thismsg = todo.front();
+		parse_msg(thismsg->type, thismsg->msg, thismsg->tv);
 		delete thismsg;
-		msgbuf.pop();
+		todo.pop_front();
 	}
 }
 
@@ -112,7 +114,7 @@ int Io::setLogfile(const Path &file) {
 	return 0;
 }
 
-int Io::parse_msg(const int type, const std::string &message) {
+int Io::parse_msg(const int type, const std::string &message, const struct timeval &tv) {
 	std::string tmpmsg = "";
 
 	// Apply default mask
@@ -152,8 +154,11 @@ int Io::parse_msg(const int type, const std::string &message) {
 		fputs(tmpmsg.c_str(), termfd);
 		fflush(termfd);
 		
-		// If we're logging to a file, check this as well
+		// If we're logging to a file, check this as well. Lines in the logfile 
+		// start with the time the message was logged, from clocksrc.
 		if (logfd) {
+			if (!(mytype & IO_NOID))
+				fprintf(logfd, "%ld.%06ld ", (long) tv.tv_sec, (long) tv.tv_usec);
 			fputs(tmpmsg.c_str(), logfd);
 			fflush(logfd);
 		}
@@ -165,25 +170,26 @@ int Io::parse_msg(const int type, const std::string &message) {
 int Io::msg(const int type, const std::string message) {
 	totmsg++;
 	
+	// Keep a copy for crashdump(), with the level prefix
+	char *entry = ring[__atomic_fetch_add(&ringpos, 1, __ATOMIC_RELAXED) % IO_RINGSIZE];
+	snprintf(entry, IO_RINGLEN, "[%s] %s", PREFIX[min(type & IO_LEVEL_MASK, IO_MAXLEVEL)].c_str(), message.c_str());
+	
 	// Low priority messages get queued...
 	if ((type & IO_LEVEL_MASK) > IO_WARN) {
+		IoMessage *m = new IoMessage(type, message, Clock::timeval(clocksrc));
+		
+		pthread::lockholder<pthread::spinmutex> h(&log_mutex);
 		// Buffer full, discard this message
 		if (msgbuf.size() > 100000) {
 			buffull++;
+			delete m;
 			return 0;
 		}
-
-		pthread::mutexholdertry h(&log_mutex);
-		if (h.havelock()) {
-			msgbuf.push(new IoMessage(type, message));
-		}
-		else {
-			lockfail++;
-		}
+		msgbuf.push_back(m);
 	}
 	// High priority messages are printed immediately.
 	else {
-		parse_msg(type, message);
+		parse_msg(type, message, Clock::timeval(clocksrc));
 	}
 	
 	if (type & (IO_FATAL)) exit(-1);
@@ -211,3 +217,15 @@ int Io::msg(const int type, const char *fmtstr, ...) {
 	
 	return 0;	
 }
+
+void Io::crashdump(int fd, void *arg) {
+	const Io *io = (const Io *) arg;
+	const unsigned int last = __atomic_load_n(&io->ringpos, __ATOMIC_RELAXED);
+	
+	// Oldest first
+	for (unsigned int i = (last > IO_RINGSIZE ? last - IO_RINGSIZE : 0); i < last; i++) {
+		const char *entry = io->ring[i % IO_RINGSIZE];
+		SigHandle::crash_write(fd, entry);
+		SigHandle::crash_write(fd, "\n");
+	}
+}
@@ -31,6 +31,7 @@
 
 #include "path++.h"
 #include "pthread++.h"
+#include "clock++.h"
 
 // Logging flags
 #define IO_NOID         0x00000100      //!< Do not add loglevel string
@@ -49,6 +50,10 @@
 #define IO_LEVEL_MASK   0x000000FF
 #define IO_MAXLEVEL     0x00000006
 
+// Crash dump ring
+#define IO_RINGSIZE     32              //!< Number of recent messages kept for crashdump()
+#define IO_RINGLEN      160             //!< Maximum length of each of those
+
 using namespace std;
 
 /*! @brief Logmessage holder class
@@ -57,7 +62,7 @@ using namespace std;
  */
 class IoMessage {
 public:
-	IoMessage(const int t, const string &m): type(t), msg(m) { gettimeofday(&tv, NULL); }
+	IoMessage(const int t, const string &m, const struct timeval &_tv): type(t), tv(_tv), msg(m) { }
 	~IoMessage() { ; }
 	
 	const int type;										//!< Type of message
@@ -68,7 +73,9 @@ public:
 /*! @brief Messaging class
  
  Simple logging to terminal, file, etc. Messages are queued first and 
- displayed in a separate thread, making it non-blocking.
+ displayed in a separate thread, making it non-blocking. Each line in the 
+ logfile starts with the time the message was logged, in seconds from the 
+ clock set by setclock().
  */
 class Io {
 	int verb, level_mask;								//!< Verbosity that we display
@@ -76,9 +83,10 @@ class Io {
 	FILE *logfd;
 	Path logfile;												//!< File to log to
 	uint32_t defmask;										//!< Default type mask, applied to all message masks
+	Clock::source_t clocksrc;						//!< Clock to timestamp messages with
 	
-	queue< IoMessage *> msgbuf; 				//!< Message buffer
-	pthread::mutex log_mutex;						//!< msgbuf access mutex
+	deque< IoMessage *> msgbuf; 				//!< Message buffer
+	pthread::spinmutex log_mutex;				//!< msgbuf access mutex, only held to push or swap out msgbuf
 	
 	pthread::thread handler_thr;				//!< Thread that handles messages
 	pthread::cond handler_cond;
@@ -86,16 +94,19 @@ class Io {
 	pthread::mutex handler_runmutex;		//!< Handler is running mutex
 	
 	void handler();											//!< Handler function, prints & saves log messages
+	void flush();												//!< Print & save all queued messages
 	bool do_log;												//!< Flag controlling handler() shutdown
 	
 	size_t totmsg;											//!< Total number of messages parsed
-	size_t lockfail;										//!< Lost messages due to lock fails
 	size_t buffull;											//!< Lost messages due to overfull backlog
 	
-	int parse_msg(const int type, const string &message);
+	char ring[IO_RINGSIZE][IO_RINGLEN];	//!< Most recent messages, for crashdump()
+	unsigned int ringpos;								//!< Next entry in ring to write
+	
+	int parse_msg(const int type, const string &message, const struct timeval &tv); //!< Print message, tv prefixes it in the logfile
 	
 public:
-	Io(const int l=IO_MAXLEVEL);
+	Io(const int l=IO_MAXLEVEL, const pthread::rtconfig &rt=pthread::rtconfig()); //!< rt is applied to the handler thread
 	~Io();
 
 	int msg(const int, const char*, ...);	//!< Log message
@@ -111,7 +122,12 @@ public:
 	uint32_t setdefmask(const uint32_t m) { defmask = m; return m; } //!< Set default mask defmask
 	uint32_t getdefmask() const { return defmask; } //!< Get default mask defmask
 	
+	void setclock(const Clock::source_t src) { clocksrc = src; } //!< Set clock for logfile timestamps [Clock::REALTIME]
+	Clock::source_t getclock() const { return clocksrc; }
+	
 		
+	static void crashdump(int fd, void *io); //!< Write the last IO_RINGSIZE messages of Io *io to fd, async-signal-safe (see SigHandle::addcrashdump())
+	
 	int incVerb() { return setVerb(verb+1); }
 	int decVerb() { return setVerb(verb-1); }
 };
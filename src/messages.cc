@@ -4,6 +4,7 @@
 #include <cstdio>
 #include <stdarg.h>
 #include <cstring>
+#include <errno.h>
 
 #include "messages.h"
 
@@ -35,57 +36,181 @@ string message::pop_front() {
 
 void message::reply(const string line) {
 	if(returnqueue)
-		*returnqueue << new message(replyheader + line);
+		*returnqueue << returnqueue->alloc(replyheader + line);
 }
 
-messagequeue &messagequeue::operator<<(message *m) {
+static struct timespec *getdeadline(struct timespec *ts, int timeout) {
+	if(timeout < 0)
+		return NULL;
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	ts->tv_sec = tv.tv_sec + timeout / 1000;
+	ts->tv_nsec = tv.tv_usec * 1000L + (timeout % 1000) * 1000000L;
+	if(ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+	return ts;
+}
+
+messagequeue::messagequeue(const size_t capacity, const size_t poolmax): capacity(capacity), total(0), poolmax(poolmax) {
+	pool.reserve(poolmax);
+}
+
+messagequeue::~messagequeue() {
+	flush();
+	for(size_t i = 0; i < pool.size(); i++)
+		delete pool[i];
+}
+
+void messagequeue::setcapacity(const size_t capacity) {
 	pthread::mutexholder h(&mutex);
+	this->capacity = capacity;
+	notfull.broadcast();
+}
 
-	queue.push(m);
-	cond.signal();
+message *messagequeue::alloc(const string &line) {
+	{
+		pthread::mutexholder h(&poolmutex);
+		if(!pool.empty()) {
+			message *m = pool.back();
+			pool.pop_back();
+			// Reuses the string's buffer if it is large enough
+			m->assign(line);
+			return m;
+		}
+	}
 
-	return *this;
+	return new message(line);
 }
 
-messagequeue &messagequeue::operator<<(const string line) {
+void messagequeue::release(message *m) {
+	if(!m)
+		return;
+
+	m->returnqueue = NULL;
+	m->replyheader.clear();
+
+	{
+		pthread::mutexholder h(&poolmutex);
+		if(pool.size() < poolmax) {
+			pool.push_back(m);
+			return;
+		}
+	}
+
+	delete m;
+}
+
+// Called with mutex held and room in the lane
+void messagequeue::put(message *m, const priority prio) {
+	lane &l = lanes[prio];
+
+	if(l.count == l.ring.size()) {
+		// Grow the ring, unwrapping it so head is at 0 again
+		vector<message *> bigger(l.ring.size() ? 2 * l.ring.size() : 16);
+		for(size_t i = 0; i < l.count; i++)
+			bigger[i] = l.ring[(l.head + i) % l.ring.size()];
+		l.ring.swap(bigger);
+		l.head = 0;
+	}
+
+	l.ring[(l.head + l.count) % l.ring.size()] = m;
+	l.count++;
+	total++;
+	notempty.signal();
+}
+
+// Called with mutex held and total > 0
+message *messagequeue::take() {
+	for(int p = 0; p < NPRIORITY; p++) {
+		lane &l = lanes[p];
+		if(!l.count)
+			continue;
+
+		message *m = l.ring[l.head];
+		l.head = (l.head + 1) % l.ring.size();
+		l.count--;
+		total--;
+		if(capacity && l.count == capacity - 1)
+			notfull.broadcast();
+		return m;
+	}
+
+	return NULL;
+}
+
+// Called with mutex held, returns false on timeout
+bool messagequeue::wait(pthread::cond &cond, const struct timespec *deadline) {
+	if(!deadline)
+		return !cond.wait(mutex);
+	return cond.timedwait(mutex, deadline) != ETIMEDOUT;
+}
+
+bool messagequeue::push(message *m, const priority prio, const int timeout) {
+	struct timespec ts, *deadline = getdeadline(&ts, timeout);
+
 	pthread::mutexholder h(&mutex);
 
-	queue.push(new message(line));
-	cond.signal();
+	while(full(prio)) {
+		if(!timeout)
+			return false;
+		if(!wait(notfull, deadline) && full(prio))
+			return false;
+	}
+
+	put(m, prio);
+	return true;
+}
+
+messagequeue &messagequeue::operator<<(message *m) {
+	push(m);
+	return *this;
+}
 
+messagequeue &messagequeue::operator<<(const string line) {
+	push(alloc(line));
 	return *this;
 }
 
 message *messagequeue::pop(unsigned int timeout) {
-	struct timeval tv;
-	struct timespec ts;
-	message *m = NULL;
-	gettimeofday(&tv, NULL);
-	ts.tv_nsec = tv.tv_usec + timeout * 1000;
-	ts.tv_sec = tv.tv_sec + ts.tv_nsec / 1000000;
-	ts.tv_nsec %= 1000000;
-	ts.tv_nsec *= 1000;
+	struct timespec ts, *deadline = getdeadline(&ts, timeout);
+
+	pthread::mutexholder h(&mutex);
+
+	// Loop to survive spurious wakeups, the deadline is absolute
+	while(!total)
+		if(!wait(notempty, deadline))
+			break;
+
+	return total ? take() : NULL;
+}
+
+size_t messagequeue::pop(vector<message *> &batch, const size_t n, const int timeout) {
+	struct timespec ts, *deadline = getdeadline(&ts, timeout);
 
 	pthread::mutexholder h(&mutex);
 
-	if(!queue.size())
-		cond.timedwait(mutex, &ts);
+	while(!total && timeout)
+		if(!wait(notempty, deadline))
+			break;
 
-	if(queue.size()) {
-		m = queue.front();
-		queue.pop();
+	size_t got = 0;
+	while(total && got < n) {
+		batch.push_back(take());
+		got++;
 	}
 
-	return m;
+	return got;
 }
 
-messagequeue messagequeue::operator>>(message *&m) {
+messagequeue &messagequeue::operator>>(message *&m) {
 	pthread::mutexholder h(&mutex);
 
-	while(!queue.size())
-		cond.wait(mutex);
-	m = queue.front();
-	queue.pop();
+	while(!total)
+		notempty.wait(mutex);
+	m = take();
 
 	return *this;
 }
@@ -93,8 +218,6 @@ messagequeue messagequeue::operator>>(message *&m) {
 void messagequeue::flush() {
 	pthread::mutexholder h(&mutex);
 
-	while(queue.size()) {
-		delete queue.front();
-		queue.pop();
-	}
+	while(total)
+		release(take());
 }
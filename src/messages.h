@@ -3,27 +3,79 @@
 
 #include "pthread++.h"
 #include <string>
-#include <queue>
+#include <vector>
 
+/*! @brief Bounded queue of messages with priority lanes
+
+ Messages in the URGENT lane are always popped before NORMAL ones, which go
+ before BULK ones. Each lane holds at most capacity messages (0 means
+ unbounded), push() then blocks, fails or waits up to a timeout, depending
+ on its timeout argument. Timeouts are in ms, -1 waits forever and 0 does
+ not wait at all.
+
+ Get messages with alloc() and give them back with release() when done, the
+ queue keeps those in a pool so steady-state traffic does not allocate. The
+ lanes are rings that only grow, never shrink.
+ */
 class messagequeue {
-	std::queue<class message *> queue;
+	public:
+	enum priority {
+		URGENT = 0,											//!< Control messages
+		NORMAL,
+		BULK,														//!< Telemetry and other data that can wait
+		NPRIORITY
+	};
+
+	private:
+	struct lane {
+		std::vector<class message *> ring;
+		size_t head;										//!< Index of oldest message
+		size_t count;
+		lane(): head(0), count(0) {}
+	} lanes[NPRIORITY];
+	size_t capacity;									//!< Maximum messages per lane (0 is unbounded)
+	size_t total;											//!< Messages in all lanes
 	pthread::mutex mutex;
-	pthread::cond cond;
-	
+	pthread::cond notempty;
+	pthread::cond notfull;
+
+	std::vector<class message *> pool; //!< Released messages, reused by alloc()
+	size_t poolmax;
+	pthread::mutex poolmutex;
+
+	bool full(const priority prio) const { return capacity && lanes[prio].count >= capacity; }
+	void put(message *m, const priority prio);
+	message *take();
+	bool wait(pthread::cond &cond, const struct timespec *deadline);
+
 	public:
+	messagequeue(const size_t capacity = 0, const size_t poolmax = 1024);
+	~messagequeue();
+
 	messagequeue &operator<<(message *m);
 	messagequeue &operator<<(const std::string line);
-	messagequeue operator>>(message *&m);
+	messagequeue &operator>>(message *&m);
 	void flush();
-	message *pop(unsigned int timeout);
+	message *pop(unsigned int timeout);	//!< Oldest most urgent message, or NULL after timeout ms
+
+	bool push(message *m, const priority prio = NORMAL, const int timeout = -1);
+	bool trypush(message *m, const priority prio = NORMAL) { return push(m, prio, 0); }
+	size_t pop(std::vector<message *> &batch, const size_t n, const int timeout = -1); //!< Append up to n messages to batch, returns how many
+
+	message *alloc(const std::string &line);
+	void release(message *m);
+
+	size_t size() const { return total; }
+	size_t getcapacity() const { return capacity; }
+	void setcapacity(const size_t capacity);
 };
 
 class message: public std::string {
 	public:
 	class messagequeue *returnqueue;
 	std::string replyheader;
-	
-	message(const std::string line): std::string(line) {}
+
+	message(const std::string line): std::string(line), returnqueue(NULL) {}
 	void reply(const std::string line);
 	std::string pop_front();
 	message operator>>(std::string &word) { word = pop_front(); return *this; }
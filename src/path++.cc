@@ -22,6 +22,15 @@
 #include <sys/stat.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
 
 #include "path++.h"
 
@@ -99,3 +108,120 @@ bool Path::stat(const mode_t test_mode) const {
 bool Path::access(int test_mode) const {
 	return ::access(this->c_str(), test_mode);
 }
+
+/* 
+ * Directory listing
+ */
+
+namespace {
+	bool cmp_name(const Path::entry &a, const Path::entry &b) { 
+		return a.name < b.name; 
+	}
+	bool cmp_mtime(const Path::entry &a, const Path::entry &b) { 
+		if (a.mtime.tv_sec != b.mtime.tv_sec) return a.mtime.tv_sec < b.mtime.tv_sec;
+		if (a.mtime.tv_nsec != b.mtime.tv_nsec) return a.mtime.tv_nsec < b.mtime.tv_nsec;
+		return a.name < b.name;
+	}
+	bool cmp_size(const Path::entry &a, const Path::entry &b) { 
+		if (a.size != b.size) return a.size < b.size;
+		return a.name < b.name;
+	}
+	
+	void addentry(vector<Path::entry> &entries, const Path &dir, const char *name, const unsigned char type, const string &pattern) {
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			return;
+		// Leading dots must be matched explicitly, like in the shell
+		if (fnmatch(pattern.c_str(), name, FNM_PERIOD))
+			return;
+		
+		entries.push_back(Path::entry());
+		Path::entry &e = entries.back();
+		e.name = name;
+		e.path = dir + e.name;
+		e.type = type;
+	}
+}
+
+int Path::list(vector<entry> &entries, const string &pattern, const sort_t sort, const bool dostat) const {
+	entries.clear();
+	
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	
+#ifdef __linux__
+	// Read many entries per syscall, readdir() uses a buffer of only 32k
+	struct linux_dirent64 {
+		ino64_t d_ino;
+		off64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[];
+	};
+	
+	vector<char> buf(256*1024);
+	long n;
+	while ((n = syscall(SYS_getdents64, fd, &buf[0], buf.size())) > 0) {
+		for (long off = 0; off < n; ) {
+			const struct linux_dirent64 *d = (const struct linux_dirent64 *) &buf[off];
+			addentry(entries, *this, d->d_name, d->d_type, pattern);
+			off += d->d_reclen;
+		}
+	}
+	if (n < 0) {
+		close(fd);
+		return -1;
+	}
+#else
+	DIR *dir = fdopendir(dup(fd));
+	if (!dir) {
+		close(fd);
+		return -1;
+	}
+	struct dirent *d;
+	while ((d = readdir(dir)))
+		addentry(entries, *this, d->d_name, d->d_type, pattern);
+	closedir(dir);
+#endif
+	
+	// Stat relative to the directory fd, which saves resolving the full path 
+	// each time. Also needed if the file system does not report types.
+	for (size_t i=0; i < entries.size(); i++) {
+		entry &e = entries[i];
+		if (!(dostat || sort == SORT_MTIME || sort == SORT_SIZE || e.type == DT_UNKNOWN))
+			continue;
+		
+		struct stat st;
+		if (fstatat(fd, e.name.c_str(), &st, 0) && fstatat(fd, e.name.c_str(), &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+		e.hasstat = true;
+		e.size = st.st_size;
+		e.mtime = st.st_mtim;
+		e.mode = st.st_mode;
+		if (e.type == DT_UNKNOWN)
+			e.type = IFTODT(st.st_mode);
+	}
+	close(fd);
+	
+	switch (sort) {
+		case SORT_NAME: std::sort(entries.begin(), entries.end(), cmp_name); break;
+		case SORT_MTIME: std::sort(entries.begin(), entries.end(), cmp_mtime); break;
+		case SORT_SIZE: std::sort(entries.begin(), entries.end(), cmp_size); break;
+		default: break;
+	}
+	
+	return entries.size();
+}
+
+vector<Path> Path::glob(const string &pattern, const sort_t sort) const {
+	vector<entry> entries;
+	vector<Path> paths;
+	if (list(entries, pattern, sort) <= 0)
+		return paths;
+	
+	paths.reserve(entries.size());
+	for (size_t i=0; i < entries.size(); i++)
+		if (entries[i].isfile() || (entries[i].islink() && entries[i].path.isfile()))
+			paths.push_back(entries[i].path);
+	return paths;
+}
@@ -21,15 +21,34 @@
 #define HAVE_PATHPP_H
 
 #include <string>
+#include <vector>
 #include <stdio.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
 
 using namespace std;
 
 /*!
  @brief Implements easier path-handling, loosely based on Python's os.path
+ 
+ For a directory, list() returns the entries matching a glob pattern, 
+ optionally with their metadata (size, mtime, mode) from one fstatat() each, 
+ sorted by name, mtime or size. This reads the directory in large batches 
+ with getdents64(2) and avoids path lookups from the root for every file, 
+ so listing 100k files takes a fraction of a second.
  */
 class Path {
+public:
+	class entry;
+	typedef enum {
+		SORT_NONE=0,											//!< Directory order
+		SORT_NAME,												//!< By name (byte order)
+		SORT_MTIME,												//!< By modification time, then name (implies stat)
+		SORT_SIZE													//!< By size, then name (implies stat)
+	} sort_t;
+	
 private:
 	string path;				//!< Full path
 	string sep;					//!< Directory seperator (will never change runtime) @todo cannot make this const? foamctrl.cc gives ../libsiu/path++.h: In member function ‘Path& Path::operator=(const Path&)’:	../libsiu/path++.h:31: error: non-static const member ‘const std::string Path::sep’, can't use default assignment operator
@@ -50,6 +69,7 @@ public:
 	Path operator+=(const Path& rhs);
 	Path operator+=(const string& rhs);
 	Path operator=(const string& rhs);
+	Path &operator=(const Path& rhs) { path = rhs.path; return *this; }
 	
 	Path append(const string &p1); //!< Append string p1 to current path 
 	Path append(const Path &p1) { return append(p1.str()); } //!< Append Path p1 to the current path
@@ -80,6 +100,29 @@ public:
 	bool islink() const { return stat(S_IFLNK); }
 	
 	FILE *fopen(const string mode="a+") const { return ::fopen(path.c_str(), mode.c_str()); }
+	
+	int list(vector<entry> &entries, const string &pattern="*", const sort_t sort=SORT_NAME, const bool dostat=false) const; //!< List entries matching glob pattern (see fnmatch(3)) of this directory, returns number of entries or -1 on error
+	vector<Path> glob(const string &pattern="*", const sort_t sort=SORT_NAME) const; //!< Return paths of regular files (or links to them) matching pattern in this directory, without directories
+};
+
+/*!
+ @brief Directory entry with cached metadata, see Path::list()
+ */
+class Path::entry {
+public:
+	entry(): type(DT_UNKNOWN), hasstat(false), size(0), mode(0) { mtime.tv_sec = 0; mtime.tv_nsec = 0; }
+	
+	Path path;													//!< Full path (directory + name)
+	string name;												//!< Name within the directory
+	unsigned char type;									//!< DT_REG, DT_DIR, DT_LNK, ... (see readdir(3))
+	bool hasstat;												//!< Are size, mtime and mode valid?
+	off_t size;													//!< Size in bytes
+	struct timespec mtime;							//!< Modification time
+	mode_t mode;												//!< Mode, including file type (see stat(2))
+	
+	bool isfile() const { return type == DT_REG; }
+	bool isdir() const { return type == DT_DIR; }
+	bool islink() const { return type == DT_LNK; }
 };
 
 #endif // HAVE_PATHPP_H
@@ -26,6 +26,7 @@
 #include <sys/time.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 
 #include <vector>
 
@@ -33,34 +34,37 @@
 #include <pthread++.h>
 
 #include "perflogger.h"
+#include "sighandle.h"
 #include "utils.h"
 
 using namespace std;
 
-PerfLog::PerfLog(const double i, const bool live, const bool print):
-interval(i), totaliter(0), init(false), do_live(live), do_print(print), do_callback(true), do_alwaysupdate(false)
+PerfLog::PerfLog(const double i, const bool live, const bool print, const pthread::rtconfig &rt):
+interval(i), totaliter(0), lastiter(0), logtimer(Duration::fsec(i)), clocksrc(Clock::REALTIME), init(false), do_live(live), do_print(print), do_callback(true), do_alwaysupdate(false)
 {
 	// Pre-allocate memory in vectors (10 stages should be enough for most purposes, will be dynamically added if necessary)
 	allocate(10);
 
 	DEBUGPRINT("sizes %zu, %zu, %zu %zu and %zu\n", last.size(), minlat.size(), maxlat.size(), sumlat.size(), sumsqlat.size());
 	
+	crashstage[0] = '\0';
+	
 	// Clear struct timeval's
 	for (size_t i=0; i < last.size(); i++)
 		timerclear(&(last.at(i)));
 	reset_logs();
 	
 	// Start logger thread and return
-	logthr.create(sigc::mem_fun(*this, &PerfLog::logger));
+	if (do_live)
+		logtimer.start(sigc::mem_fun(*this, &PerfLog::logger), rt);
 }
 
 PerfLog::~PerfLog() {
 	DEBUGPRINT("%s", "\n");
-	// Stop logger thread
+	SigHandle::removecrashdump(PerfLog::crashdump, this);
+	// Stop logger thread, this waits for at most one interval
 	do_live = false;
-	//! @bug This does not work properly, thread carries on and locks program on exit
-	logthr.cancel();
-	logthr.join();
+	logtimer.stop();
 }
 
 void PerfLog::allocate(const size_t size) {
@@ -85,6 +89,10 @@ void PerfLog::reset_logs() {
 
 bool PerfLog::addlog(const string stagename) {
 	DEBUGPRINT("PerfLog::addlog(%s)\n", stagename.c_str());
+	// logger() only holds the mutex to copy the data, so wait for it instead 
+	// of dropping this entry
+	pthread::lockholder<pthread::spinmutex> h(&mutex);
+	
 	// Check if we've monitored this stage before (stage starts at 0)
 	size_t stageidx=0;
 	for (stageidx=0; stageidx < stagenames.size() && stagenames[stageidx] != stagename; stageidx++) { ; }
@@ -97,6 +105,10 @@ bool PerfLog::addlog(const string stagename) {
 		stagenames.push_back(stagename);
 	}
 
+	// Remember where we are in case we crash before the next stage
+	strncpy(crashstage, stagename.c_str(), sizeof(crashstage) - 1);
+	crashstage[sizeof(crashstage) - 1] = '\0';
+	
 	// Check if this is the first stage (in that case increase loopcount)
 	if (stageidx == 0)
 		totaliter++;
@@ -105,17 +117,10 @@ bool PerfLog::addlog(const string stagename) {
 	if (stagenames.size() > sumlat.size())
 		allocate(stagenames.size()+5);
 
-	// Try to get mutex, otherwise abort (logger() needs mutex for reporting)
-	pthread::mutexholdertry htry(&mutex);
-	if (!htry.havelock()) {
-		DEBUGPRINT("stage[%zu]=%s lockfail\n", stageidx, stagename.c_str());
-		return false;
-	}
-	
 	// Initialize here, but only in stage 0 (otherwise do later)
 	if (!init) {
 		if (stageidx == 0) {
-			gettimeofday(&(last[0]), 0);
+			last[0] = Clock::timeval(clocksrc);
 			init = true;
 			DEBUGPRINT("stage[%zu]=%s init\n", stageidx, stagename.c_str());
 			return true;
@@ -132,7 +137,7 @@ bool PerfLog::addlog(const string stagename) {
 	if (stageidx == 0) cmpstage = 0;
 	
 	// Get current time, calculate difference with previous, then store this timestamp in last
-	gettimeofday(&now, 0);
+	now = Clock::timeval(clocksrc);
 	timersub(&now, &(last.at(cmpstage)), &diff);
 	last.at(stageidx) = now;
 	
@@ -172,75 +177,97 @@ bool PerfLog::addlog(const string stagename) {
 	return true;
 }
 
+void PerfLog::setclock(const Clock::source_t src) {
+	pthread::lockholder<pthread::spinmutex> h(&mutex);
+	// Timestamps of different clocks can't be compared, start over
+	clocksrc = src;
+	init = false;
+}
+
+bool PerfLog::setinterval(double i) {
+	interval = i;
+	logtimer.setperiod(Duration::fsec(i));
+	return true;
+}
+
 bool PerfLog::addlog(const size_t stage) {
 	addlog(format("%04zu", stage));
 	return true;
 }
 
+void PerfLog::crashdump(int fd, void *arg) {
+	const PerfLog *log = (const PerfLog *) arg;
+	
+	SigHandle::crash_write(fd, "iteration ");
+	SigHandle::crash_write(fd, log->totaliter);
+	SigHandle::crash_write(fd, ", in progress after stage '");
+	SigHandle::crash_write(fd, log->crashstage);
+	SigHandle::crash_write(fd, "'\n");
+}
+
 void PerfLog::print_report(FILE *stream) {
+	// Can be called from any thread, while logger() replaces the report
+	pthread::mutexholder r(&repmutex);
 	fprintf(stream, "PerfLog: In the last measurement, we got these latencies:\n");
+	if (rep_stagenames.empty())
+		return;
 	
-	double sum0 = (double) sumlat.at(0).tv_sec + ((double) sumlat.at(0).tv_usec)/1E6;
+	double sum0 = (double) rep_sumlat.at(0).tv_sec + ((double) rep_sumlat.at(0).tv_usec)/1E6;
 
-	for (size_t i=0; i < stagenames.size(); i++) {
+	for (size_t i=0; i < rep_stagenames.size(); i++) {
 		string rep = "";
-		rep += format("PerfLog: %zu/%zu %s: #=%zu", i, stagenames.size()-1, stagenames[i].c_str(), avgcount.at(i));
+		rep += format("PerfLog: %zu/%zu %s: #=%zu", i, rep_stagenames.size()-1, rep_stagenames[i].c_str(), rep_avgcount.at(i));
 
-		double sum = (double) sumlat.at(i).tv_sec + ((double) sumlat.at(i).tv_usec)/1E6;
+		double sum = (double) rep_sumlat.at(i).tv_sec + ((double) rep_sumlat.at(i).tv_usec)/1E6;
 
 		// If this is not the first stage, also check the percentage we spend in this stage
 		if (i != 0)
 			rep += format(" (%.0f%%):", 100.0*sum/sum0);
 
 		// Get sum^2/n
-		double sumsq = sumsqlat.at(i);
+		double sumsq = rep_sumsqlat.at(i);
 		// Calculate (sum/n)^2
-		double sqsum = (sum/avgcount.at(i)) * (sum/avgcount.at(i));
+		double sqsum = (sum/rep_avgcount.at(i)) * (sum/rep_avgcount.at(i));
 		// Calculate stddev = sqrt( sum^2/n - (sum/n)^2 )
-		double stddev = sqrt((sumsq/avgcount.at(i)) - sqsum);
+		double stddev = sqrt((sumsq/rep_avgcount.at(i)) - sqsum);
 
 		// Print average with stddev
-		rep += format(" avg: %.3g (±%.1g)", sum/avgcount.at(i), stddev);
-		rep += format(", rate: %.3g", 1.0/(sum/avgcount.at(i)));
+		rep += format(" avg: %.3g (±%.1g)", sum/rep_avgcount.at(i), stddev);
+		rep += format(", rate: %.3g", 1.0/(sum/rep_avgcount.at(i)));
 
 		fprintf(stream, "%s\n", rep.c_str());
 	}
 }
 
 void PerfLog::logger() {
-	struct timeval now, next, diff;
-	size_t lastiter=0;
-
-	while (do_live) {
-		gettimeofday(&lastlog, 0);
-		{
-			// Get mutex to work with data
-			pthread::mutexholder h(&mutex);
-			if (totaliter > lastiter || do_alwaysupdate) {
-				if (do_print)
-					print_report();
-				if (do_callback)
-					slot_report(interval, get_nstages(), minlat, maxlat, sumlat, avgcount);
-			}
-			
-			// Reset latencies
-			reset_logs();
-			// Last iteration that we updated is this one
-			lastiter = totaliter;
+	bool report;
+	{
+		// Copy the data and reset, report after releasing the mutex so 
+		// addlog() is never held up by printing or slot_report()
+		pthread::mutexholder r(&repmutex);
+		pthread::lockholder<pthread::spinmutex> h(&mutex);
+		report = (totaliter > lastiter || do_alwaysupdate);
+		if (report) {
+			rep_minlat = minlat;
+			rep_maxlat = maxlat;
+			rep_sumlat = sumlat;
+			rep_sumsqlat = sumsqlat;
+			rep_avgcount = avgcount;
+			rep_stagenames = stagenames;
 		}
 		
-		// Sleep until next iteration
-		if (interval > 0) {
-			// Make sure each iteration takes at minimum 'interval' seconds:
-			diff.tv_sec = (int) interval; // use (int) to floor() in case interval > 1
-			diff.tv_usec = interval * 1.0e6;
-			timeradd(&lastlog, &diff, &next);
-			
-			gettimeofday(&now, 0);
-			timersub(&next, &now, &diff);
-			if(diff.tv_sec >= 0)
-				usleep(diff.tv_sec * 1.0e6 + diff.tv_usec);
+		// Reset latencies
+		reset_logs();
+		// Last iteration that we updated is this one
+		lastiter = totaliter;
+	}
+	
+	if (report) {
+		if (do_print)
+			print_report();
+		if (do_callback) {
+			pthread::mutexholder r(&repmutex);
+			slot_report(interval, rep_stagenames.size(), rep_minlat, rep_maxlat, rep_sumlat, rep_avgcount);
 		}
 	}
-	DEBUGPRINT("%s\n", "ending");
 }
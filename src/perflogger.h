@@ -33,6 +33,8 @@
 
 #include <sigc++/signal.h>
 #include <pthread++.h>
+#include "clock++.h"
+#include "periodic.h"
 
 using namespace std;
 
@@ -76,19 +78,22 @@ using namespace std;
  
  N.B. This class struct timeval to store each latency, meaning that the 
  resolution is 1µs. If your iterations are faster than 10µs this code will 
- give poor results.
+ give poor results. For short stages, use setclock(Clock::TSC) to reduce the 
+ overhead of taking timestamps.
  */
 class PerfLog {
 private:
 //	const size_t nhist;					//!< Length of history to remember (default 100)
 	
-	struct timeval lastlog;			//!< Last log entry (to measure interval in logthr)
 	double interval;						//!< Performance averaging interval
 
 	size_t totaliter;						//!< Total number of iterations done
+	size_t lastiter;						//!< totaliter at the last report
 	
-	pthread::thread logthr;			//!< Logger thread
-	pthread::mutex mutex;				//!< Data access mutex
+	Periodic logtimer;					//!< Runs logger() every interval seconds
+	pthread::spinmutex mutex;		//!< Data access mutex, held by logger() only to copy the data
+	
+	Clock::source_t clocksrc;		//!< Clock to time stages with
 	
 	bool init;									//!< Is this the first call? Then only note the time and return.
 	bool do_live;								//!< Print performance live in logger()
@@ -101,13 +106,21 @@ private:
 	vector< double > sumsqlat; //!< Summed squared latency (in seconds) for each stage in the last interval (to calculate standard deviation)
 	
 	vector<string> stagenames;	//!< List of names for each stage
+	char crashstage[64];				//!< Copy of the last logged stage name, for crashdump()
+	
+	// Copy of the data of the last interval, for reporting without holding mutex
+	pthread::mutex repmutex;		//!< Protects rep_*, taken before mutex
+	vector< struct timeval > rep_minlat, rep_maxlat, rep_sumlat;
+	vector< double > rep_sumsqlat;
+	vector< size_t > rep_avgcount;
+	vector<string> rep_stagenames;
 	
-	void logger();							//!< Performance logger thread
+	void logger();							//!< Report the last interval, called from logtimer
 	void reset_logs();					//!< Reset logs
 	void allocate(size_t size);	//!< (re-)allocate memory for logging
 	
 public:
-	PerfLog(const double i=1.0, const bool live=false, const bool print=false);
+	PerfLog(const double i=1.0, const bool live=false, const bool print=false, const pthread::rtconfig &rt=pthread::rtconfig()); //!< rt is applied to the logger thread
 	~PerfLog();
 	
 	bool do_print;							//!< Whether or not to print performance every interval seconds [false]
@@ -119,8 +132,11 @@ public:
 	bool addlog(const size_t stage);		//!< Add log entry for specific stage, with name for this stage
 	bool addlog(const string stagename);
 	bool setinterval(double i=1.0); //!< Set new update interval (in seconds)
+	void setclock(const Clock::source_t src); //!< Set clock to time stages with (Clock::TSC for fast loops) [Clock::REALTIME]
+	Clock::source_t getclock() const { return clocksrc; }
 	
-	void print_report(FILE *stream=stdout); //!< Print last report to some stream
+	void print_report(FILE *stream=stdout); //!< Print report of the last completed interval to some stream, from any thread
+	static void crashdump(int fd, void *log); //!< Write the stage in progress of PerfLog *log to fd, async-signal-safe (see SigHandle::addcrashdump())
 	
 	sigc::slot<void, double, size_t, vector< struct timeval >, vector< struct timeval >, vector< struct timeval >, vector< size_t > > slot_report; //!< Slot for performance reporting, will be called as slot_report(interval, last, minlat, maxlat, sumlat, avgcount);
 };
@@ -0,0 +1,131 @@
+/*
+ periodic.cc -- run code at a fixed rate, with jitter and overrun statistics
+ Copyright (C) 2012 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <math.h>
+
+#include "periodic.h"
+#include "perflogger.h"
+
+double Periodic::stats::stddev() const {
+	if (iter < 2)
+		return 0;
+	const double m = mean();
+	const double var = sumsqlat / iter - m * m;
+	return var > 0 ? sqrt(var) : 0;
+}
+
+Periodic::Periodic(const Duration p): period(p), init(false), perflog(NULL), running(false) {
+}
+
+Periodic::~Periodic() {
+	stop();
+}
+
+void Periodic::reset() {
+	pthread::lockholder<pthread::spinmutex> h(&mutex);
+	next = MonoTime::now() + period;
+	__atomic_store_n(&init, true, __ATOMIC_RELEASE);
+}
+
+void Periodic::setperiod(const Duration p) {
+	pthread::lockholder<pthread::spinmutex> h(&mutex);
+	period = p;
+}
+
+Periodic::stats_t Periodic::getstats(const bool clear) {
+	pthread::lockholder<pthread::spinmutex> h(&mutex);
+	stats_t ret = st;
+	if (clear)
+		st = stats_t();
+	return ret;
+}
+
+bool Periodic::wait() {
+	if (!__atomic_load_n(&init, __ATOMIC_ACQUIRE))
+		reset();
+
+	Duration p;
+	{
+		pthread::lockholder<pthread::spinmutex> h(&mutex);
+		p = period;
+	}
+
+	// Deadline already passed: skip the periods we missed, but keep the phase
+	bool ontime = true;
+	const MonoTime now = MonoTime::now();
+	if (now > next && p > Duration()) {
+		const int64_t missed = (now - next) / p + 1;
+		next += p * missed;
+		ontime = false;
+
+		pthread::lockholder<pthread::spinmutex> h(&mutex);
+		st.overruns++;
+		st.missed += missed;
+	}
+
+	const struct timespec deadline = next.as_timespec();
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) { ; }
+
+	const Duration lat = MonoTime::now() - next;
+	next += p;
+
+	{
+		pthread::lockholder<pthread::spinmutex> h(&mutex);
+		if (st.iter == 0 || lat < st.minlat)
+			st.minlat = lat;
+		if (lat > st.maxlat)
+			st.maxlat = lat;
+		st.sumlat += lat;
+		st.sumsqlat += lat.as_sec() * lat.as_sec();
+		st.iter++;
+	}
+
+	if (perflog)
+		perflog->addlog(perfstage);
+
+	return ontime;
+}
+
+void Periodic::loop() {
+	reset();
+	while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		wait();
+		if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+			break;
+		slot();
+	}
+}
+
+void Periodic::start(const sigc::slot<void> &s, const pthread::rtconfig &rt) {
+	if (__atomic_exchange_n(&running, true, __ATOMIC_ACQ_REL))
+		return;
+
+	slot = s;
+	thread.create(sigc::mem_fun(*this, &Periodic::loop), rt);
+}
+
+void Periodic::stop() {
+	if (!__atomic_exchange_n(&running, false, __ATOMIC_ACQ_REL))
+		return;
+
+	if (!thread.isself())
+		thread.join();
+}
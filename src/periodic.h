@@ -0,0 +1,104 @@
+/*
+ periodic.h -- run code at a fixed rate, with jitter and overrun statistics
+ Copyright (C) 2012 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HAVE_PERIODIC_H
+#define HAVE_PERIODIC_H
+
+#include <stdint.h>
+
+#include <sigc++/slot.h>
+#include <string>
+
+#include "pthread++.h"
+#include "time++.h"
+
+class PerfLog;
+
+/*! @brief Run something at a fixed rate
+
+ Deadlines are absolute (CLOCK_MONOTONIC, slept on with clock_nanosleep() and
+ TIMER_ABSTIME), so the time spent working or waking up late does not
+ accumulate: the n-th wakeup is due at start + n * period.
+
+ Either call wait() at the top of your own loop:
+
+ Periodic tick(Duration::msec(1));
+ while (running) {
+   tick.wait();
+   control();
+ }
+
+ or let start() call a slot from a new thread until stop().
+
+ If the work overruns its deadline, the deadlines that have already passed
+ are skipped (keeping the phase) and counted in stats::overruns and
+ stats::missed. The latency of each wakeup w.r.t. its deadline is kept in
+ stats as well, and each wakeup can be logged as a stage of a PerfLog.
+ */
+class Periodic {
+public:
+	typedef struct stats {
+		stats(): iter(0), overruns(0), missed(0), minlat(0), maxlat(0), sumlat(0), sumsqlat(0) { }
+		size_t iter;												//!< Number of wakeups
+		size_t overruns;										//!< Number of times a deadline had passed before wait() was called
+		size_t missed;											//!< Total number of periods skipped because of overruns
+		Duration minlat;										//!< Minimum wakeup latency (jitter)
+		Duration maxlat;										//!< Maximum wakeup latency
+		Duration sumlat;										//!< Sum of wakeup latencies
+		double sumsqlat;										//!< Sum of squared wakeup latencies in s^2
+
+		double mean() const { return iter ? sumlat.as_sec() / iter : 0; } //!< Mean wakeup latency in s
+		double stddev() const;							//!< Standard deviation of the wakeup latency in s
+	} stats_t;
+
+private:
+	Duration period;
+	MonoTime next;												//!< Next deadline
+	bool init;														//!< Has next been set yet? (atomic)
+
+	stats_t st;
+	pthread::spinmutex mutex;							//!< Protects period and st
+
+	PerfLog *perflog;											//!< Log each wakeup here, if set
+	std::string perfstage;
+
+	sigc::slot<void> slot;
+	bool running;													//!< Is the thread started? (atomic)
+	pthread::thread thread;
+	void loop();
+
+public:
+	Periodic(const Duration period);
+	~Periodic();
+
+	bool wait();													//!< Sleep until the next deadline, returns false if it had already passed
+	void reset();													//!< Restart the schedule, the next deadline is one period from now
+
+	void setperiod(const Duration p);		//!< Change the period, takes effect after the next wakeup
+	Duration getperiod() { pthread::lockholder<pthread::spinmutex> h(&mutex); return period; }
+
+	stats_t getstats(const bool clear=false); //!< Statistics since construction or the last clear
+	void setperflog(PerfLog *log, const std::string stage="periodic") { perflog = log; perfstage = stage; } //!< Log each wakeup in log as stage
+
+	void start(const sigc::slot<void> &s, const pthread::rtconfig &rt = pthread::rtconfig()); //!< Call s every period from a new thread
+	void stop();													//!< Stop the thread after its current iteration
+	bool isrunning() const { return __atomic_load_n(&running, __ATOMIC_ACQUIRE); }
+};
+
+#endif // HAVE_PERIODIC_H
@@ -19,6 +19,7 @@
 
 #include <sys/time.h>
 #include <time.h>
+#include <stdlib.h>
 
 #include "format.h"
 #include "protocol.h"
@@ -30,50 +31,75 @@ using namespace std;
 
 namespace Protocol {
 	void Client::handler() {
-		pthread::setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS);
+		// Deferred cancellation: ~Client cancels this thread while it waits in 
+		// connect(), readline() or backoff(), never with a lock held
+		int delay = backoff_min;
 
 		while(running) {
-			socket.connect(host, port);
+			socket.connect(host, port, timeout);
 
 			if(!socket.is_connected()) {
-				sleep(1);
+				backoff(delay);
 				continue;
 			}
 
+			delay = backoff_min;
 			slot_connected(true);
 
 			string line;
 
 			while(running && socket.readline(line)) {
+				uint32_t id = 0;
+				if(!line.empty() && line[0] == '@')
+					id = strtoul(popword(line).c_str() + 1, NULL, 10);
+
 				if(!name.empty() && popword(line) != name)
 					continue;
 
+				if(id && reply(id, line))
+					continue;
+
 				slot_message(line);
 			}
 
 			slot_connected(false);
+			failpending("disconnected");
 
 			socket.close();
+
+			if(running)
+				backoff(delay);
 		}
 	}
 
-	Client::Client() {
+	void Client::backoff(int &delay) {
+		// Sleep somewhere between delay/2 and delay, then double it
+		int ms = delay / 2 + (delay > 1 ? rand_r(&seed) % (delay - delay / 2) : 0);
+		usleep(ms * 1000);
+
+		delay = delay < backoff_max / 2 ? delay * 2 : backoff_max;
+	}
+
+	Client::Client(): shm(0), lastid(0), seed(time(NULL) ^ getpid() ^ (uintptr_t) this), timeout(2000), backoff_min(100), backoff_max(10000) {
 		setup_flag = false;
 		running = false;
+		joinable = false;
 	};
 
-	Client::Client(const std::string &h, const std::string &p, const std::string &n) {
+	Client::Client(const std::string &h, const std::string &p, const std::string &n): shm(0), lastid(0), seed(time(NULL) ^ getpid() ^ (uintptr_t) this), timeout(2000), backoff_min(100), backoff_max(10000) {
 		setup_flag = false;
 		running = false;
+		joinable = false;
 		setup(h, p, n);
 	};
 
 	Client::~Client() {
-		if(running) {
-			close();
-			thread.cancel();
+		close();
+		// The handler may have closed us itself, it still has to finish
+		if(joinable)
 			thread.join();
-		}
+		detachshm();
+		failpending("closed");
 	}
 	
 	void Client::setup(const std::string &h, const std::string &p, const std::string &n) {
@@ -97,9 +123,18 @@ namespace Protocol {
 		if (running || !setup_flag)
 			return;
 
+		// A handler that closed us itself keeps going, otherwise reap it
+		if(joinable && thread.isself()) {
+			running = true;
+			return;
+		}
+		if(joinable)
+			thread.join();
+
 		running = true;
+		joinable = true;
 		attr.setstacksize(65536);
-		thread.create(&attr, sigc::mem_fun(this, &Client::handler));
+		thread.create(&attr, sigc::mem_fun(this, &Client::handler), rt);
 	}
 
 	void Client::close() {
@@ -108,6 +143,14 @@ namespace Protocol {
 
 		running = false;
 		socket.close();
+
+		// Wait for the handler unless it is the one closing, otherwise it 
+		// could still be using us after ~Client
+		if(!thread.isself()) {
+			thread.cancel();
+			thread.join();
+			joinable = false;
+		}
 	}
 
 	bool Client::is_connected() const {
@@ -117,9 +160,96 @@ namespace Protocol {
 	void Client::write(const string &msg) {
 		if(!is_connected())
 			return;
+		pthread::mutexholder h(&writemutex);
 		socket.write(prefix + msg + "\r\n");
 	}
 
+	pthread::future<string> Client::request(const string &msg, const int timeout) {
+		pthread::future<string> result;
+		if(timeout >= 0)
+			result.setdeadline(timeout * 1000L);
+
+		if(!is_connected()) {
+			result.fail("not connected");
+			return result;
+		}
+
+		uint32_t id;
+		{
+			pthread::mutexholder h(&reqmutex);
+
+			// Forget requests that timed out without a reply now and then
+			if(!(lastid % 64)) {
+				map<uint32_t, pthread::future<string> >::iterator i = pending.begin();
+				while(i != pending.end()) {
+					if(i->second.ready())
+						pending.erase(i++);
+					else
+						++i;
+				}
+			}
+
+			if(!++lastid)
+				++lastid;
+			id = lastid;
+			pending[id] = result;
+		}
+
+		// Not under reqmutex: the handler needs it to deliver replies, which 
+		// the server may be waiting on before it reads more from us.
+		bool ok;
+		{
+			pthread::mutexholder h(&writemutex);
+			ok = socket.write(format("@%u ", id) + prefix + msg + "\r\n");
+		}
+
+		if(!ok) {
+			result.fail("write failed");
+			pthread::mutexholder h(&reqmutex);
+			pending.erase(id);
+		}
+
+		return result;
+	}
+
+	// reply() and failpending() run in the handler thread, which ~Client 
+	// cancels. Never with reqmutex held or while futures are being freed, or 
+	// request() in other threads would hang.
+	bool Client::reply(const uint32_t id, const string &line) {
+		int cancelstate;
+		pthread::setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+		bool found = false;
+		{
+			pthread::future<string> result;
+			{
+				pthread::mutexholder h(&reqmutex);
+				map<uint32_t, pthread::future<string> >::iterator i = pending.find(id);
+				if(i != pending.end()) {
+					result = i->second;
+					pending.erase(i);
+					found = true;
+				}
+			}
+			// A late reply after the timeout is dropped
+			if(found)
+				result.set(line);
+		}
+		pthread::setcancelstate(cancelstate);
+		return found;
+	}
+
+	void Client::failpending(const string &reason) {
+		int cancelstate;
+		pthread::setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+		{
+			pthread::mutexholder h(&reqmutex);
+			for(map<uint32_t, pthread::future<string> >::iterator i = pending.begin(); i != pending.end(); ++i)
+				i->second.fail(reason);
+			pending.clear();
+		}
+		pthread::setcancelstate(cancelstate);
+	}
+
 	void Client::write(const void *buf, size_t len) {
 		if(!is_connected())
 			return;
@@ -131,9 +261,27 @@ namespace Protocol {
 	}
 
 	bool Client::read(void *buf, size_t len) {
+		if(shm)
+			return shm->read(buf, len);
 		return socket.read(buf, len);
 	}
 
+	bool Client::attachshm(const std::string &name) {
+		detachshm();
+		try {
+			shm = new ShmRing(name);
+		} catch(ShmRing::exception &e) {
+			shm = 0;
+			return false;
+		}
+		return true;
+	}
+
+	void Client::detachshm() {
+		delete shm;
+		shm = 0;
+	}
+
 	string Client::getpeername() const {
 		return socket.getpeername();
 	}
@@ -142,25 +290,94 @@ namespace Protocol {
 		return socket.getsockname();
 	}
 
+	ClientPool::ClientPool(const std::string &host, const std::string &port, const std::string &name, const size_t size): next(0) {
+		for(size_t i = 0; i < size; i++)
+			clients.push_back(new Client(host, port, name));
+	}
+
+	ClientPool::~ClientPool() {
+		for(size_t i = 0; i < clients.size(); i++)
+			delete clients[i];
+	}
+
+	void ClientPool::connect() {
+		for(size_t i = 0; i < clients.size(); i++)
+			clients[i]->connect();
+	}
+
+	void ClientPool::close() {
+		for(size_t i = 0; i < clients.size(); i++)
+			clients[i]->close();
+	}
+
+	Client *ClientPool::get() {
+		pthread::mutexholder h(&mutex);
+		for(size_t n = 0; n < clients.size(); n++) {
+			Client *client = clients[next];
+			next = (next + 1) % clients.size();
+			if(client->is_connected())
+				return client;
+		}
+		return 0;
+	}
+
+	size_t ClientPool::nconnected() const {
+		size_t n = 0;
+		for(size_t i = 0; i < clients.size(); i++)
+			if(clients[i]->is_connected())
+				n++;
+		return n;
+	}
+
+	void ClientPool::write(const string &msg) {
+		Client *client = get();
+		if(client)
+			client->write(msg);
+	}
+
+	pthread::future<string> ClientPool::request(const string &msg, const int timeout) {
+		Client *client = get();
+		if(client)
+			return client->request(msg, timeout);
+
+		pthread::future<string> result;
+		result.fail("not connected");
+		return result;
+	}
+
+	void ClientPool::set_message(const sigc::slot<void, string> &slot) {
+		for(size_t i = 0; i < clients.size(); i++)
+			clients[i]->slot_message = slot;
+	}
+
 	map<string, Server::Port *> Server::Port::ports;
 	pthread::mutex Server::Port::globalmutex;
 
-	Server::Port::Port(const std::string &port): port(port) {
+	Server::Port::Port(const std::string &port, const pthread::rtconfig &rt): rt(rt), userview(new userlist()), port(port) {
 		attr.setstacksize(65536);
-		thread.create(&attr, sigc::mem_fun(this, &Server::Port::handler));
+		thread.create(&attr, sigc::mem_fun(this, &Server::Port::handler), rt);
 	}
 
 	Server::Port::~Port() {
 		thread.cancel();
 		//For some reason this doesn't work
 		thread.join();
+
+		delete userview;
+	}
+
+	void Server::Port::publish() {
+		// Called with mutex held. Connection handlers look up users without 
+		// locking, so never modify a published list but replace it with a copy, 
+		// and free the old one once no handler can be looking at it anymore.
+		readers.replace(userview, (const userlist *) new userlist(users));
 	}
 
 	Server::Port *Server::Port::get(Server *server) {
 		pthread::mutexholder g(&globalmutex);
 		Port *port = ports[server->port];
 		if(!port)
-			ports[server->port] = port = new Port(server->port);
+			ports[server->port] = port = new Port(server->port, server->rt);
 
 		pthread::mutexholder h(&port->mutex);
 		Server *user = port->users[server->name];
@@ -168,6 +385,7 @@ namespace Protocol {
 			port->users[server->name] = server;
 		else
 			throw exception("Duplicate port+name combination");
+		port->publish();
 
 		return port;
 	}
@@ -185,6 +403,7 @@ namespace Protocol {
 			pthread::mutexholder h(&thisport->mutex);
 			Server *user = thisport->users[server->name];
 			thisport->users.erase(server->name);
+			thisport->publish();
 			if(!user)
 				throw exception("Releasing unknown user from port");
 		}
@@ -197,12 +416,15 @@ namespace Protocol {
 	void Server::Port::close() {
 		socket.close();
 
-		pthread::mutexholder h(&mutex);
+		// Not under mutex, each Connection takes it to unregister itself
+		set<Connection *> closing;
+		{
+			pthread::mutexholder h(&mutex);
+			closing.swap(connections);
+		}
 
-		foreach(c, connections)
+		foreach(c, closing)
 			delete *c;
-
-		connections.clear();
 	}
 
 	void Server::Port::handler() {	
@@ -227,13 +449,13 @@ namespace Protocol {
 		}
 	}
 
-	Server::Connection::Connection(Port *port, Socket *socket, const void *data): port(port), socket(socket), data(data) {
+	Server::Connection::Connection(Port *port, Socket *socket, const void *data): port(port), socket(socket), shm(0), batching(false), data(data) {
 		server = 0;
 		running = true;
 		pthread::mutexholder h(&port->mutex);
 		port->connections.insert(this);
 		attr.setstacksize(65536);
-		thread.create(&attr, sigc::mem_fun(this, &Server::Connection::handler));
+		thread.create(&attr, sigc::mem_fun(this, &Server::Connection::handler), port->rt);
 	}
 
 	Server::Connection::~Connection() {
@@ -244,9 +466,15 @@ namespace Protocol {
 			thread.detach();
 		}
 		socket->close();
-		//! @bug This blocks for some reason when tearing down a Server instance with multiple connected Connections
+		detachshm();
 		pthread::mutexholder h(&port->mutex);
 		port->connections.erase(this);
+		for(set<string>::iterator i = tags.begin(); i != tags.end(); ++i) {
+			set<Connection *> &subs = port->subscribers[*i];
+			subs.erase(this);
+			if(subs.empty())
+				port->subscribers.erase(*i);
+		}
 	}
 
 	void Server::Connection::handler() {
@@ -259,31 +487,65 @@ namespace Protocol {
 			if(!socket->readline(line))
 				break;
 
-			if(line == ",")
-				line = prevline;
-			else
-				prevline = line;
+			// Dispatch this line and all other complete lines that arrived with 
+			// it, then send all replies in one write.
+			batching = true;
+			dispatch(line, prevline);
+			while(running && socket->hasline() && socket->readline(line))
+				dispatch(line, prevline);
+			batching = false;
+			flush();
+		}
 
-			string name = popword(line);
+		running = false;
+		delete this;
+	}
 
-			{
-				pthread::mutexholder h(&port->mutex);
-				map<string, Server *>::iterator i = port->users.find(name);
-				if(i == port->users.end()) {
-					line.insert(0, name + ' ');
-					i = port->users.find("");
-				}
-				if(i == port->users.end())
-					continue;
-				server = i->second;
-			}
+	void Server::Connection::dispatch(string &line, string &prevline) {
+		// Lines from Client::request() start with "@<id>", replies get the same id
+		string id;
+		if(!line.empty() && line[0] == '@')
+			id = popword(line);
+
+		if(line == ",")
+			line = prevline;
+		else
+			prevline = line;
 
-			server->slot_message(this, line);
-			server = 0;
+		string name = popword(line);
+
+		// Only the lookup is a read section, the slot may (un)register Servers. 
+		// This thread is cancelled asynchronously, which must not happen inside.
+		Server *found = 0;
+		int cancelstate;
+		pthread::setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+		{
+			pthread::rcu::reader r(&port->readers);
+			const Port::userlist *users = port->getusers();
+			Port::userlist::const_iterator i = users->find(name);
+			if(i == users->end()) {
+				line.insert(0, name + ' ');
+				i = users->find("");
+			}
+			if(i != users->end())
+				found = i->second;
 		}
+		pthread::setcancelstate(cancelstate);
+		if(!found)
+			return;
 
-		running = false;
-		delete this;
+		server = found;
+		replyid = id;
+		server->slot_message(this, line);
+		replyid.clear();
+		server = 0;
+	}
+
+	void Server::Connection::flush() const {
+		if(outbuf.empty())
+			return;
+		socket->write(outbuf);
+		outbuf.clear();
 	}
 
 	Server::Server(const std::string &port, const std::string &name): port(port), name(name) {
@@ -308,24 +570,67 @@ namespace Protocol {
 		return socket->is_connected();
 	}
 
+	void Server::Connection::send(const string &line) const {
+		// Replies from within slot_message are sent after the whole batch
+		if(batching && thread.isself()) {
+			if(!replyid.empty())
+				outbuf += replyid + ' ';
+			outbuf += line;
+			if(outbuf.size() >= 65536)
+				flush();
+			return;
+		}
+		socket->write(line);
+	}
+
 	void Server::Connection::write(const string &msg) const {
-		socket->write(server->prefix + msg + "\r\n");
+		send(server->prefix + msg + "\r\n");
 	}
 
 	void Server::Connection::write(const void *buf, size_t len) const {
-		socket->write(buf, len);
+		if(batching && thread.isself())
+			flush();
+		if(shm)
+			shm->write(buf, len);
+		else
+			socket->write(buf, len);
+	}
+
+	bool Server::Connection::attachshm(const std::string &name, const size_t size) {
+		detachshm();
+		try {
+			shm = new ShmRing(name, size);
+		} catch(ShmRing::exception &e) {
+			shm = 0;
+			return false;
+		}
+		return true;
+	}
+
+	void Server::Connection::detachshm() {
+		delete shm;
+		shm = 0;
 	}
 
 	void Server::Connection::addtag(const string &tag) {
 		if(!server)
 			return;
+		pthread::mutexholder h(&port->mutex);
 		tags.insert(server->prefix + tag);
+		port->subscribers[server->prefix + tag].insert(this);
 	}
 
 	void Server::Connection::deltag(const string &tag) {
 		if(!server)
 			return;
+		pthread::mutexholder h(&port->mutex);
 		tags.erase(server->prefix + tag);
+		map<string, set<Connection *> >::iterator i = port->subscribers.find(server->prefix + tag);
+		if(i == port->subscribers.end())
+			return;
+		i->second.erase(this);
+		if(i->second.empty())
+			port->subscribers.erase(i);
 	}
 
 	bool Server::Connection::hastag(const string &tag) const {
@@ -339,32 +644,45 @@ namespace Protocol {
 	}
 
 	void Server::Connection::write(const string &msg, const string &tag) const {
+		const string line = server->prefix + msg + "\r\n";
+		send(line);
+
 		pthread::mutexholder h(&port->mutex);
-		for(set<Connection *>::iterator i = port->connections.begin(); i != port->connections.end(); ++i) {
-			Connection *c = *i;
-			if(this == c || c->hastag(tag, server->prefix))
-				c->socket->write(server->prefix + msg + "\r\n");
-		}
+		map<string, set<Connection *> >::const_iterator subs = port->subscribers.find(server->prefix + tag);
+		if(subs == port->subscribers.end())
+			return;
+		for(set<Connection *>::const_iterator i = subs->second.begin(); i != subs->second.end(); ++i)
+			if(*i != this)
+				(*i)->socket->write(line);
 	}
 
 	void Server::broadcast(const string &msg) const {
+		const string line = prefix + msg + "\r\n";
 		pthread::mutexholder h(&theport->mutex);
 		for(set<Connection *>::iterator i = theport->connections.begin(); i != theport->connections.end(); ++i)
-			(*i)->socket->write(prefix + msg + "\r\n");
+			(*i)->socket->write(line);
 	}
 
 	void Server::broadcast(const string &msg, const string &tag) const {
+		const string line = prefix + msg + "\r\n";
 		pthread::mutexholder h(&theport->mutex);
-		for(set<Connection *>::iterator i = theport->connections.begin(); i != theport->connections.end(); ++i)
-			if((*i)->hastag(tag, prefix))
-				(*i)->socket->write(prefix + msg + "\r\n");
+		map<string, set<Connection *> >::const_iterator subs = theport->subscribers.find(prefix + tag);
+		if(subs == theport->subscribers.end())
+			return;
+		for(set<Connection *>::const_iterator i = subs->second.begin(); i != subs->second.end(); ++i)
+			(*i)->socket->write(line);
 	}
 
 	string Server::Connection::read() const {
+		// The peer might wait for our pending replies before sending more
+		if(batching && thread.isself())
+			flush();
 		return socket->readline();
 	}
 
 	bool Server::Connection::read(void *buf, const size_t len) const {
+		if(batching && thread.isself())
+			flush();
 		return socket->read(buf, len);
 	}
 
@@ -4,11 +4,13 @@
 #include <string>
 #include <map>
 #include <set>
+#include <vector>
 #include <sigc++/signal.h>
 #include <string>
 
 #include "format.h"
 #include "socket.h"
+#include "shmring.h"
 #include "pthread++.h"
 
 namespace Protocol {
@@ -20,15 +22,47 @@ namespace Protocol {
 	/*!
 	 @author Guus Sliepen
 	 @brief Client class abstracting sockets.
+	 
+	 Use host "unix:/path/to/socket" to connect to a Server listening on port 
+	 "unix:/path/to/socket" on the same machine, the port argument is then 
+	 ignored.
+	 
+	 For bulk data from a Server on the same machine, the Server can set up a 
+	 shared memory ring with Connection::attachshm() and tell the client its 
+	 name, after which the client calls attachshm() as well. read(buf, len) 
+	 then reads from shared memory instead of the socket. Text lines and 
+	 write() still use the socket.
+	 
+	 request() sends a command prefixed with "@<id>" and returns a future 
+	 that is completed by the first reply the Server sends with that id, so 
+	 many requests can be in flight at once. Replies to requests are not 
+	 passed to slot_message, other lines still are.
+	 
+	 When the connection fails or drops, the handler retries with exponential
+	 backoff between backoff_min and backoff_max ms. Each delay is randomised
+	 between half and all of its value, so many clients do not reconnect to a 
+	 restarted daemon at the same moment.
 	*/
 	class Client {
 		Socket socket;
+		ShmRing *shm;								//!< Shared memory ring for bulk reads (or NULL)
 		bool running; //!< Is the handler running or not
+		bool joinable; //!< Has the handler thread been started and not yet joined
 		bool setup_flag; //!< Are the connection settings setup (host, port, name) or not
 		
 		pthread::attr attr;
 		pthread::thread thread;
 		
+		pthread::mutex writemutex;	//!< Serialises lines from different threads
+		pthread::mutex reqmutex;		//!< Protects lastid and pending
+		uint32_t lastid;						//!< Id of last request()
+		std::map<uint32_t, pthread::future<std::string> > pending; //!< Requests waiting for a reply
+		bool reply(const uint32_t id, const std::string &line);
+		void failpending(const std::string &reason);
+		
+		unsigned int seed;					//!< rand_r() state for backoff jitter
+		void backoff(int &delay);
+		
 		void handler();
 		void setup(const std::string &h, const std::string &p, const std::string &n);
 
@@ -40,6 +74,11 @@ namespace Protocol {
 		std::string port; //!< Port on target machine
 		std::string name;
 
+		int timeout;								//!< Connect timeout in ms (default 2000)
+		int backoff_min;						//!< First reconnect delay in ms (default 100)
+		int backoff_max;						//!< Maximum reconnect delay in ms (default 10000)
+		pthread::rtconfig rt;				//!< Real-time settings for the handler thread, set before connect()
+
 		sigc::slot<void, std::string> slot_message; //!< Slot for data handler function
 		sigc::slot<void, bool> slot_connected; //!< Slot for on (dis)connection handler function
 
@@ -49,7 +88,7 @@ namespace Protocol {
 
 		void connect();
 		void connect(const std::string &h, const std::string &p, const std::string &n);
-		void close();
+		void close();								//!< Disconnect and stop the handler thread
 		void disconnect() { close(); }
 
 		bool is_connected() const;
@@ -60,6 +99,41 @@ namespace Protocol {
 		bool read(void *buf, size_t len);
 		std::string getpeername() const;
 		std::string getsockname() const;
+
+		//! Send msg, the future receives the reply (without name prefix), or fails after timeout ms
+		pthread::future<std::string> request(const std::string &msg, const int timeout = 5000);
+
+		bool attachshm(const std::string &name);
+		void detachshm();
+	};
+
+	/*!
+	 @brief Set of Clients connected to the same Server
+	 
+	 All connections are set up in advance and reconnect by themselves. get() 
+	 hands out the connected ones in turn, so requests are spread over the 
+	 connections and a dropped connection is simply skipped until it is back.
+	*/
+	class ClientPool {
+		std::vector<Client *> clients;
+		size_t next;
+		pthread::mutex mutex;
+
+	public:
+		ClientPool(const std::string &host, const std::string &port, const std::string &name = "", const size_t size = 4);
+		~ClientPool();
+
+		void connect();
+		void close();
+
+		Client *get();							//!< Next connected client, or NULL if none is
+		size_t size() const { return clients.size(); }
+		size_t nconnected() const;
+
+		void write(const std::string &msg);
+		pthread::future<std::string> request(const std::string &msg, const int timeout = 5000);
+
+		void set_message(const sigc::slot<void, std::string> &slot); //!< Set slot_message of all clients
 	};
 
 	class Server {
@@ -71,12 +145,20 @@ namespace Protocol {
 
 			Port *port;
 			Socket *socket;
+			ShmRing *shm;								//!< Shared memory ring for bulk writes (or NULL)
 			std::set<std::string> tags;
 
 			bool running;
 			pthread::attr attr;
 			pthread::thread thread;
 			void handler();
+			void dispatch(std::string &line, std::string &prevline);
+
+			std::string replyid; //!< Request id of the line being dispatched (or empty)
+			mutable bool batching; //!< Is handler() dispatching a batch of lines (replies are coalesced)
+			mutable std::string outbuf; //!< Coalesced replies, written in one go after each batch
+			void flush() const;
+			void send(const std::string &line) const;
 
 			public:
 			Server *server;
@@ -99,6 +181,9 @@ namespace Protocol {
 			std::string getsockname() const;
 			bool is_connected() const;
 			void close();
+
+			bool attachshm(const std::string &name, const size_t size = 1 << 24);
+			void detachshm();
 		};
 
 		private:
@@ -111,14 +196,28 @@ namespace Protocol {
 			pthread::thread thread;
 			void handler();
 
+			const pthread::rtconfig rt; //!< From the Server that created the Port, used for all its threads
+
+			typedef std::map<std::string, Server *> userlist;
+
 			pthread::mutex mutex;
-			std::map<std::string, Server *> users;
+			userlist users;
 			std::set<Connection *> connections;
+			//! Connections subscribed to each (prefixed) tag, kept in sync with Connection::tags
+			std::map<std::string, std::set<Connection *> > subscribers;
+
+			//! Immutable copy of users, replaced (never modified) when users changes
+			const userlist *userview;
+			//! Read sections of handlers using userview, see getusers()
+			pthread::rcu readers;
+			void publish();
+			//! Call only inside a pthread::rcu::reader on readers
+			const userlist *getusers() const { return __atomic_load_n(&userview, __ATOMIC_ACQUIRE); }
 
 			static pthread::mutex globalmutex;
 			static std::map<std::string, Port *> ports;
 
-			Port(const std::string &port);
+			Port(const std::string &port, const pthread::rtconfig &rt);
 			~Port();
 
 			void listen();
@@ -138,9 +237,13 @@ namespace Protocol {
 		const std::string port;
 		const std::string name;
 
+		//! Real-time settings for the listening and connection threads, set before listen(). Only the first Server on a port counts.
+		pthread::rtconfig rt;
+
 		sigc::slot<void, Connection *, std::string> slot_message;
 		sigc::slot<void, Connection *, bool> slot_connected;
 
+		//! Listen on TCP port, or on Unix domain socket if port is "unix:/path/to/socket"
 		Server(const std::string &port, const std::string &name = "");
 		~Server();
 		
@@ -21,11 +21,32 @@
 #define PTHREAD_H_WRAPPER
 
 #include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <string>
 #include <pthread.h>
 #include <signal.h>
 #include <sigc++/slot.h>
 #include <sys/time.h>
 #include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <deque>
+#include <vector>
+#include <alloca.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#endif
+
+// Size of a cache line, used to keep independently written variables apart
+#ifndef PTHREAD_CACHELINE
+#define PTHREAD_CACHELINE 64
+#endif
 
 // Via https://issues.asterisk.org/view.php?id=1411
 #ifndef PTHREAD_MUTEX_RECURSIVE_NP
@@ -44,9 +65,15 @@
 #undef sigmask
 #endif
 
+// Not in older C library headers
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
 namespace pthread {
 	class attr {
 		friend class thread;
+		friend class rtconfig;
 		pthread_attr_t pthread_attr;
 
 		public:
@@ -66,6 +93,151 @@ namespace pthread {
 		int getstacksize(size_t *stacksize) { return pthread_attr_getstacksize(&pthread_attr, stacksize); }
 	};
 
+	//! Touch bytes of stack below the caller so later use does not page fault
+	static inline void prefaultstack(size_t bytes) {
+		volatile char *stack = (volatile char *) alloca(bytes);
+		for(size_t i = 0; i < bytes; i += 4096)
+			stack[i] = 0;
+	}
+
+	//! Lock all current and future pages of the process in memory
+	static inline int lockmemory(int flags = MCL_CURRENT | MCL_FUTURE) { return mlockall(flags) ? errno : 0; }
+
+	//! Page faults and context switches of the calling thread (or the whole process)
+	struct rtstats {
+		long minflt;										//!< Page faults served without I/O
+		long majflt;										//!< Page faults that needed I/O
+		long nvcsw;											//!< Voluntary context switches (blocking)
+		long nivcsw;										//!< Involuntary context switches (preempted)
+	};
+
+	static inline int getrtstats(rtstats *stats, bool thisthread = true) {
+		struct rusage ru;
+#ifdef RUSAGE_THREAD
+		if(getrusage(thisthread ? RUSAGE_THREAD : RUSAGE_SELF, &ru))
+#else
+		if(getrusage(RUSAGE_SELF, &ru))
+#endif
+			return errno;
+		stats->minflt = ru.ru_minflt;
+		stats->majflt = ru.ru_majflt;
+		stats->nvcsw = ru.ru_nvcsw;
+		stats->nivcsw = ru.ru_nivcsw;
+		return 0;
+	}
+
+	/*! @brief Real-time settings for a thread
+
+	 Pass to thread::create() to apply them in the new thread before it runs 
+	 its slot, or call applyself() from a running thread. Default settings 
+	 change nothing.
+
+	 SCHED_FIFO and SCHED_RR use priority, SCHED_DEADLINE uses runtime, 
+	 deadline and period (ns) and needs Linux 3.14. Without privileges these
+	 fail with EPERM, the thread then keeps running with its old settings.
+	 */
+	class rtconfig {
+		public:
+		int policy;											//!< SCHED_OTHER (leave as is), SCHED_FIFO, SCHED_RR or SCHED_DEADLINE
+		int priority;										//!< Static priority for SCHED_FIFO and SCHED_RR
+		uint64_t runtime;								//!< SCHED_DEADLINE: CPU time per period (ns)
+		uint64_t deadline;							//!< SCHED_DEADLINE: relative deadline (ns)
+		uint64_t period;								//!< SCHED_DEADLINE: period (ns)
+		std::vector<int> cpus;					//!< CPUs to run on (empty: leave as is)
+		size_t prefault;								//!< Bytes of stack to pre-fault (0: none), keep well below the stack size
+		bool lockmem;										//!< Call lockmemory() (affects the whole process)
+
+		rtconfig(): policy(SCHED_OTHER), priority(0), runtime(0), deadline(0), period(0), prefault(0), lockmem(false) {}
+
+		rtconfig &setcpu(int cpu) { cpus.assign(1, cpu); return *this; }
+		rtconfig &setcpus(const std::vector<int> &set) { cpus = set; return *this; }
+		rtconfig &setfifo(int prio) { policy = SCHED_FIFO; priority = prio; return *this; }
+		rtconfig &setrr(int prio) { policy = SCHED_RR; priority = prio; return *this; }
+		rtconfig &setdeadline(uint64_t run, uint64_t dl, uint64_t per) { policy = SCHED_DEADLINE; runtime = run; deadline = dl; period = per; return *this; }
+		rtconfig &setprefault(size_t bytes) { prefault = bytes; return *this; }
+		rtconfig &setlockmem(bool lock = true) { lockmem = lock; return *this; }
+
+		bool empty() const { return policy == SCHED_OTHER && cpus.empty() && !prefault && !lockmem; }
+
+		/*! Apply to attributes for a thread still to be created: explicit 
+		 (not inherited) scheduling with SCHED_FIFO or SCHED_RR, and CPU 
+		 affinity. SCHED_DEADLINE and pre-faulting need applyself(). */
+		int apply(attr &a) const {
+			int err = 0;
+			if(policy == SCHED_FIFO || policy == SCHED_RR) {
+				struct sched_param param;
+				param.sched_priority = priority;
+				if((err = pthread_attr_setinheritsched(&a.pthread_attr, PTHREAD_EXPLICIT_SCHED)) ||
+					 (err = pthread_attr_setschedpolicy(&a.pthread_attr, policy)) ||
+					 (err = pthread_attr_setschedparam(&a.pthread_attr, &param)))
+					return err;
+			}
+#ifdef __linux__
+			if(!cpus.empty()) {
+				cpu_set_t set;
+				getcpuset(&set);
+				err = pthread_attr_setaffinity_np(&a.pthread_attr, sizeof set, &set);
+			}
+#endif
+			return err;
+		}
+
+		//! Apply everything to the calling thread, returns 0 or the first error
+		int applyself() const {
+			int err = 0, e;
+
+			if(lockmem && (e = lockmemory()) && !err)
+				err = e;
+#ifdef __linux__
+			if(!cpus.empty()) {
+				cpu_set_t set;
+				getcpuset(&set);
+				if((e = pthread_setaffinity_np(pthread_self(), sizeof set, &set)) && !err)
+					err = e;
+			}
+#endif
+			if(policy == SCHED_FIFO || policy == SCHED_RR) {
+				struct sched_param param;
+				param.sched_priority = priority;
+				if((e = pthread_setschedparam(pthread_self(), policy, &param)) && !err)
+					err = e;
+			} else if(policy == SCHED_DEADLINE) {
+#if defined(__linux__) && defined(SYS_sched_setattr)
+				// Not wrapped by the C library
+				struct {
+					uint32_t size;
+					uint32_t sched_policy;
+					uint64_t sched_flags;
+					int32_t sched_nice;
+					uint32_t sched_priority;
+					uint64_t sched_runtime;
+					uint64_t sched_deadline;
+					uint64_t sched_period;
+				} sa = {sizeof sa, SCHED_DEADLINE, 0, 0, 0, runtime, deadline, period};
+				if(syscall(SYS_sched_setattr, 0, &sa, 0) && !err)
+					err = errno;
+#else
+				if(!err)
+					err = ENOSYS;
+#endif
+			}
+
+			if(prefault)
+				prefaultstack(prefault);
+
+			return err;
+		}
+
+		private:
+#ifdef __linux__
+		void getcpuset(cpu_set_t *set) const {
+			CPU_ZERO(set);
+			for(size_t i = 0; i < cpus.size(); i++)
+				CPU_SET(cpus[i], set);
+		}
+#endif
+	};
+
 	class thread {
 		pthread_t pthread;
 
@@ -76,6 +248,22 @@ namespace pthread {
 			return 0;
 		}
 
+		struct rtstart {
+			sigc::slot<void> slot;
+			rtconfig rt;
+			rtstart(const sigc::slot<void> &slot, const rtconfig &rt): slot(slot), rt(rt) {}
+		};
+
+		static void *start_rt(void *arg) {
+			rtstart *tmp = (rtstart *)arg;
+			sigc::slot<void> slot = tmp->slot;
+			if(int err = tmp->rt.applyself())
+				fprintf(stderr, "pthread::thread: could not apply real-time settings: %s\n", strerror(err));
+			delete tmp;
+			slot();
+			return 0;
+		}
+
 		public:
 		thread(): pthread(0) {}
 		thread(pthread_t initialiser): pthread(initialiser) {}
@@ -89,11 +277,14 @@ namespace pthread {
 		int create(void *(*start_routine)(void *), void *arg = NULL) { return create(NULL, start_routine, arg); }
 		int create(attr *attr, sigc::slot<void> slot) { return create(attr, start_slot, new sigc::slot<void>(slot)); }
 		int create(sigc::slot<void> slot) { return create(NULL, start_slot, new sigc::slot<void>(slot)); }
+		//! Create thread that first applies rt to itself (nothing extra if rt is empty)
+		int create(attr *attr, sigc::slot<void> slot, const rtconfig &rt) { return rt.empty() ? create(attr, slot) : create(attr, start_rt, new rtstart(slot, rt)); }
+		int create(sigc::slot<void> slot, const rtconfig &rt) { return create(NULL, slot, rt); }
 		int join(void **thread_return = NULL) { return pthread_join(pthread, thread_return); }
 		int cancel() { return pthread_cancel(pthread); }
 		int kill(int signo) { return pthread_kill(pthread, signo); }
 		int detach() { return pthread_detach(pthread); }
-		bool isself() { return pthread_equal(this->pthread, pthread_self()); }
+		bool isself() const { return pthread_equal(this->pthread, pthread_self()); }
 		bool operator ==(thread other) { return pthread_equal(this->pthread, other.pthread); }
 		bool operator !=(thread other) { return !pthread_equal(this->pthread, other.pthread); }
 
@@ -162,6 +353,248 @@ namespace pthread {
 		bool havelock() const { return locked; }
 	};
 
+	//! Tell the CPU we are busy-waiting
+	static inline void cpurelax() {
+#if defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#else
+		__asm__ __volatile__("" ::: "memory");
+#endif
+	}
+
+	/*! @brief Mutex that spins briefly before it sleeps
+
+	 For short critical sections: an uncontended lock() or unlock() is one 
+	 atomic instruction, a contended lock() spins up to spins times (the 
+	 holder will probably be done by then) and only then sleeps on a futex 
+	 (sched_yield() loop elsewhere). Same interface as mutex, but cannot be 
+	 used with cond.
+	 */
+	class spinmutex {
+		int state;											//!< 0: unlocked, 1: locked, 2: locked and maybe sleepers
+		int spins;
+
+		spinmutex(const spinmutex &);
+		spinmutex &operator =(const spinmutex &);
+
+		public:
+		spinmutex(int spins = 100): state(0), spins(spins) {}
+
+		int lock() {
+			int c = 0;
+			if(__atomic_compare_exchange_n(&state, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return 0;
+			for(int i = 0; i < spins; i++) {
+				cpurelax();
+				c = 0;
+				if(__atomic_load_n(&state, __ATOMIC_RELAXED) == 0 && __atomic_compare_exchange_n(&state, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+					return 0;
+			}
+			// Mark as contended, so unlock() knows it has to wake someone
+			while(__atomic_exchange_n(&state, 2, __ATOMIC_ACQUIRE)) {
+#ifdef __linux__
+				syscall(SYS_futex, &state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+#else
+				yield();
+#endif
+			}
+			return 0;
+		}
+		int trylock() {
+			int c = 0;
+			return __atomic_compare_exchange_n(&state, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : EBUSY;
+		}
+		int unlock() {
+#ifdef __linux__
+			if(__atomic_exchange_n(&state, 0, __ATOMIC_RELEASE) == 2)
+				syscall(SYS_futex, &state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+			__atomic_store_n(&state, 0, __ATOMIC_RELEASE);
+#endif
+			return 0;
+		}
+	};
+
+	/*! @brief Fair spinlock: threads get the lock in the order they asked for it
+
+	 Waiters spin, and yield the CPU after spins rounds. Only for short 
+	 critical sections with few threads.
+	 */
+	class ticketlock {
+		unsigned int next;							//!< Next ticket to hand out
+		char pad0[PTHREAD_CACHELINE - sizeof(unsigned int)];
+		unsigned int serving;						//!< Ticket that holds the lock
+		char pad1[PTHREAD_CACHELINE - sizeof(unsigned int)];
+		int spins;
+
+		ticketlock(const ticketlock &);
+		ticketlock &operator =(const ticketlock &);
+
+		public:
+		ticketlock(int spins = 100): next(0), serving(0), spins(spins) {}
+
+		int lock() {
+			const unsigned int ticket = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+			for(int i = 0; __atomic_load_n(&serving, __ATOMIC_ACQUIRE) != ticket; i++) {
+				if(i < spins)
+					cpurelax();
+				else
+					yield();
+			}
+			return 0;
+		}
+		int trylock() {
+			unsigned int ticket = __atomic_load_n(&serving, __ATOMIC_ACQUIRE);
+			return __atomic_compare_exchange_n(&next, &ticket, ticket + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : EBUSY;
+		}
+		int unlock() {
+			__atomic_store_n(&serving, serving + 1, __ATOMIC_RELEASE);
+			return 0;
+		}
+	};
+
+	//! Like mutexholder, for any class with lock() and unlock()
+	template<typename M> class lockholder {
+		M *m;
+		public:
+		lockholder(M *m): m(m) { m->lock(); }
+		~lockholder() { m->unlock(); }
+	};
+
+	/*! @brief Value with one writer and any number of lock-free readers
+
+	 The writer bumps a sequence number before and after changing the value,
+	 a reader copies the value and retries if the sequence number was odd or
+	 changed meanwhile. Readers never block the writer or each other, and 
+	 only retry while a write is in progress. T must be plain old data (it is
+	 copied with memcpy()). Use a mutex around write() if there is more than
+	 one writer.
+	 */
+	template<typename T> class seqlock {
+		unsigned int seq;
+		char pad[PTHREAD_CACHELINE - sizeof(unsigned int)];
+		T value;
+
+		public:
+		seqlock(): seq(0), value() {}
+		seqlock(const T &init): seq(0), value(init) {}
+
+		void write(const T &v) {
+			const unsigned int s = __atomic_load_n(&seq, __ATOMIC_RELAXED);
+			__atomic_store_n(&seq, s + 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			memcpy((void *) &value, (const void *) &v, sizeof value);
+			__atomic_store_n(&seq, s + 2, __ATOMIC_RELEASE);
+		}
+
+		//! Copy the value to v, returns false if a write was in progress
+		bool tryread(T &v) const {
+			const unsigned int s = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+			if(s & 1)
+				return false;
+			memcpy((void *) &v, (const void *) &value, sizeof value);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			return __atomic_load_n(&seq, __ATOMIC_RELAXED) == s;
+		}
+
+		T read() const {
+			T v;
+			while(!tryread(v))
+				cpurelax();
+			return v;
+		}
+
+		//! Number of completed writes
+		unsigned int version() const { return __atomic_load_n(&seq, __ATOMIC_ACQUIRE) / 2; }
+	};
+
+	/*! @brief Grace periods for lock-free readers of data that writers replace
+
+	 Readers hold a reader (or call lock()/unlock()) while they use a pointer
+	 that writers may replace. A writer publishes the new pointer and then
+	 calls synchronize(), which returns once every reader that could still
+	 see the old one has left, so it can be freed right away: memory use is
+	 bounded and nothing is guessed. replace() does all three steps.
+
+	 Readers never block, they only count themselves in one of two counters
+	 (selected by the generation). synchronize() waits until the counters of
+	 older generations drain, so reader sections must be short and must not
+	 wait for writers. Readers may nest.
+	 */
+	class rcu {
+		unsigned int gen;
+		char pad0[PTHREAD_CACHELINE - sizeof(unsigned int)];
+		mutable unsigned long readers[2];
+		char pad1[PTHREAD_CACHELINE - 2 * sizeof(unsigned long)];
+		mutex writers;
+
+		rcu(const rcu &);
+		rcu &operator =(const rcu &);
+
+		void drain(const unsigned int g) const {
+			for(int i = 0; __atomic_load_n(&readers[g & 1], __ATOMIC_SEQ_CST); i++) {
+				if(i < 100)
+					cpurelax();
+				else
+					usleep(10);					// Sleep, readers may have a lower priority
+			}
+		}
+
+		public:
+		rcu(): gen(0) { readers[0] = readers[1] = 0; }
+
+		//! Enter a read section, returns the token for unlock()
+		unsigned int lock() const {
+			while(true) {
+				const unsigned int g = __atomic_load_n(&gen, __ATOMIC_SEQ_CST);
+				__atomic_add_fetch(&readers[g & 1], 1, __ATOMIC_SEQ_CST);
+				if(__atomic_load_n(&gen, __ATOMIC_SEQ_CST) == g)
+					return g;
+				// A writer flipped meanwhile, count ourselves in the new generation
+				__atomic_sub_fetch(&readers[g & 1], 1, __ATOMIC_SEQ_CST);
+			}
+		}
+		void unlock(const unsigned int g) const { __atomic_sub_fetch(&readers[g & 1], 1, __ATOMIC_RELEASE); }
+
+		//! Wait until all readers that were active when this was called have left
+		void synchronize() {
+			mutexholder h(&writers);
+			const unsigned int g = __atomic_load_n(&gen, __ATOMIC_SEQ_CST);
+			// Stragglers of the generation before g use the other counter
+			drain(g + 1);
+			__atomic_store_n(&gen, g + 1, __ATOMIC_SEQ_CST);
+			drain(g);
+		}
+
+		//! Publish next in ptr, wait for readers of the old value and delete it
+		template<typename T> void replace(T *&ptr, T *next) {
+			T *old = __atomic_exchange_n(&ptr, next, __ATOMIC_SEQ_CST);
+			synchronize();
+			delete old;
+		}
+
+		//! Read section for the lifetime of this object
+		class reader {
+			const rcu *r;
+			const unsigned int g;
+			public:
+			reader(const rcu *r): r(r), g(r->lock()) {}
+			~reader() { r->unlock(g); }
+		};
+	};
+
+	class condattr {
+		friend class cond;
+		pthread_condattr_t pthread_condattr;
+
+		public:
+		condattr(clockid_t clock) { pthread_condattr_init(&pthread_condattr); setclock(clock); }
+		condattr() { pthread_condattr_init(&pthread_condattr); }
+		~condattr() { pthread_condattr_destroy(&pthread_condattr); }
+		int setclock(clockid_t clock) { return pthread_condattr_setclock(&pthread_condattr, clock); } //!< Clock for timedwait() deadlines
+		int getclock(clockid_t *clock) { return pthread_condattr_getclock(&pthread_condattr, clock); }
+	};
+
 	static const pthread_cond_t COND_INITIALIZER = PTHREAD_COND_INITIALIZER;
 	
 	class cond {
@@ -170,6 +603,7 @@ namespace pthread {
 		public:
 		cond(const pthread_cond_t initialiser = COND_INITIALIZER): pthread_cond(initialiser) {}
 		cond(pthread_condattr_t *cond_attr) { pthread_cond_init(&pthread_cond, cond_attr); }
+		cond(const condattr *attr) { pthread_cond_init(&pthread_cond, &attr->pthread_condattr); } //!< With a clock set, timedwait(mutex, usec) no longer applies
 		~cond() { pthread_cond_destroy(&pthread_cond); }
 
 		int signal() { return pthread_cond_signal(&pthread_cond); }
@@ -190,6 +624,127 @@ namespace pthread {
 		}
 	};
 
+	/*! @brief Result of an operation that completes in another thread
+
+	 Copies of a future share the same state. The producer calls set() or 
+	 fail() once, consumers wait for that with wait() or get(). With a 
+	 deadline the future fails by itself with error "timeout" if it was not 
+	 completed in time. Deadlines are on CLOCK_MONOTONIC, so setting the 
+	 system time does not affect them.
+	 */
+	template<typename T> class future {
+		struct state {
+			mutex m;
+			cond c;
+			int refs;
+			bool done;
+			bool failed;
+			bool hasdeadline;
+			struct timespec deadline;
+			T value;
+			std::string error;
+			state(): c(monotonic()), refs(1), done(false), failed(false), hasdeadline(false), value() {}
+		} *s;
+
+		static const condattr *monotonic() { static const condattr attr(CLOCK_MONOTONIC); return &attr; }
+
+		static void abstime(long usec, struct timespec *ts) {
+			clock_gettime(CLOCK_MONOTONIC, ts);
+			ts->tv_sec += usec / 1000000;
+			ts->tv_nsec += (usec % 1000000) * 1000;
+			if(ts->tv_nsec >= 1000000000) {
+				ts->tv_nsec -= 1000000000;
+				ts->tv_sec++;
+			}
+		}
+
+		static bool before(const struct timespec &a, const struct timespec &b) {
+			return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+		}
+
+		// Called with s->m held
+		void complete(bool failed) const {
+			s->done = true;
+			s->failed = failed;
+			s->c.broadcast();
+		}
+
+		// Called with s->m held
+		bool expired() const {
+			if(s->done || !s->hasdeadline)
+				return s->done;
+			struct timespec now;
+			abstime(0, &now);
+			if(before(now, s->deadline))
+				return false;
+			s->error = "timeout";
+			complete(true);
+			return true;
+		}
+
+		void unref() { if(!__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL)) delete s; }
+
+		public:
+		future(): s(new state()) {}
+		future(long usec): s(new state()) { setdeadline(usec); }
+		future(const future &other): s(other.s) { __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED); }
+		~future() { unref(); }
+		future &operator =(const future &other) {
+			__atomic_add_fetch(&other.s->refs, 1, __ATOMIC_RELAXED);
+			unref();
+			s = other.s;
+			return *this;
+		}
+		bool operator ==(const future &other) const { return s == other.s; }
+
+		//! Fail with "timeout" if not completed within usec from now
+		void setdeadline(long usec) { mutexholder h(&s->m); abstime(usec, &s->deadline); s->hasdeadline = true; }
+
+		//! Complete with value, returns false if already completed
+		bool set(const T &value) {
+			mutexholder h(&s->m);
+			if(s->done)
+				return false;
+			s->value = value;
+			complete(false);
+			return true;
+		}
+		//! Complete with an error, returns false if already completed
+		bool fail(const std::string &reason) {
+			mutexholder h(&s->m);
+			if(s->done)
+				return false;
+			s->error = reason;
+			complete(true);
+			return true;
+		}
+
+		bool ready() const { mutexholder h(&s->m); return expired(); }
+		bool failed() const { mutexholder h(&s->m); return expired() && s->failed; }
+		std::string error() const { mutexholder h(&s->m); return s->error; }
+
+		//! Wait until completed, but at most usec (or until the deadline if usec < 0). Returns ready().
+		bool wait(long usec = -1) const {
+			mutexholder h(&s->m);
+			struct timespec limit;
+			if(usec >= 0)
+				abstime(usec, &limit);
+			if(s->hasdeadline && (usec < 0 || before(s->deadline, limit)))
+				limit = s->deadline;
+			bool timed = usec >= 0 || s->hasdeadline;
+
+			while(!expired()) {
+				if(!timed)
+					s->c.wait(s->m);
+				else if(s->c.timedwait(s->m, &limit) == ETIMEDOUT)
+					return expired();
+			}
+			return true;
+		}
+		//! Wait until completed and return the value (T() on failure)
+		T get() const { wait(); mutexholder h(&s->m); return s->value; }
+	};
+
 	static const pthread_rwlock_t RWLOCK_INITIALIZER = PTHREAD_RWLOCK_INITIALIZER;
 
 	class rwlock {
@@ -231,6 +786,467 @@ namespace pthread {
 		void *getspecific() { return pthread_getspecific(pthread_key); }
 		int setspecific(void *pointer) { return pthread_setspecific(pthread_key, pointer); }
 	};
+	/*! @brief Lets threads sleep until another thread changed something
+
+	 Waiters call prepare(), check their condition again, and then either 
+	 cancel() (condition met) or wait(key). notify() is only a fence and a 
+	 load when nobody waits. Uses a futex on Linux, a mutex and condition 
+	 variable elsewhere.
+	 */
+	class eventcount {
+		int seq;
+		int waiters;
+#ifndef __linux__
+		mutex m;
+		cond c;
+#endif
+
+		eventcount(const eventcount &);
+		eventcount &operator =(const eventcount &);
+
+		public:
+		eventcount(): seq(0), waiters(0) {}
+
+		int prepare() {
+			__atomic_add_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+			return __atomic_load_n(&seq, __ATOMIC_SEQ_CST);
+		}
+		void cancel() { __atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST); }
+		void wait(int key) {
+#ifdef __linux__
+			if(__atomic_load_n(&seq, __ATOMIC_SEQ_CST) == key)
+				syscall(SYS_futex, &seq, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+#else
+			{
+				mutexholder h(&m);
+				while(__atomic_load_n(&seq, __ATOMIC_SEQ_CST) == key)
+					c.wait(m);
+			}
+#endif
+			cancel();
+		}
+		//! Wake up at most n waiting threads
+		void notify(int n = INT_MAX) {
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if(!__atomic_load_n(&waiters, __ATOMIC_SEQ_CST))
+				return;
+#ifdef __linux__
+			__atomic_add_fetch(&seq, 1, __ATOMIC_SEQ_CST);
+			syscall(SYS_futex, &seq, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#else
+			mutexholder h(&m);
+			__atomic_add_fetch(&seq, 1, __ATOMIC_SEQ_CST);
+			if(n == 1)
+				c.signal();
+			else
+				c.broadcast();
+#endif
+		}
+	};
+
+	/*! @brief Bounded lock-free queue for one producer and one consumer thread
+
+	 Capacity is rounded up to a power of two. try_push() and try_pop() never
+	 block. push() and pop() first retry up to spins times, yielding the CPU 
+	 in between, and then sleep until the queue is no longer full or empty. 
+	 T must be default constructible and assignable.
+	 */
+	template<typename T> class spsc_queue {
+		T *buf;
+		size_t mask;
+		char pad0[PTHREAD_CACHELINE];
+		size_t head;										//!< Next slot to write, only written by producer
+		char pad1[PTHREAD_CACHELINE - sizeof(size_t)];
+		size_t tail;										//!< Next slot to read, only written by consumer
+		char pad2[PTHREAD_CACHELINE - sizeof(size_t)];
+		eventcount notempty;
+		eventcount notfull;
+		int spins;
+
+		spsc_queue(const spsc_queue &);
+		spsc_queue &operator =(const spsc_queue &);
+
+		public:
+		spsc_queue(size_t capacity, int spins = 16): head(0), tail(0), spins(spins) {
+			size_t size = 2;
+			while(size < capacity)
+				size <<= 1;
+			buf = new T[size];
+			mask = size - 1;
+		}
+		~spsc_queue() { delete[] buf; }
+
+		bool try_push(const T &value) {
+			const size_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+			if(h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) > mask)
+				return false;
+			buf[h & mask] = value;
+			__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+			notempty.notify();
+			return true;
+		}
+		bool try_pop(T &value) {
+			const size_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+			if(t == __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+				return false;
+			value = buf[t & mask];
+			__atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+			notfull.notify();
+			return true;
+		}
+		void push(const T &value) {
+			for(int i = 0; i < spins; i++) {
+				if(try_push(value))
+					return;
+				yield();
+			}
+			while(!try_push(value)) {
+				int key = notfull.prepare();
+				if(size() <= mask)
+					notfull.cancel();
+				else
+					notfull.wait(key);
+			}
+		}
+		void pop(T &value) {
+			for(int i = 0; i < spins; i++) {
+				if(try_pop(value))
+					return;
+				yield();
+			}
+			while(!try_pop(value)) {
+				int key = notempty.prepare();
+				if(size())
+					notempty.cancel();
+				else
+					notempty.wait(key);
+			}
+		}
+
+		size_t size() const { return __atomic_load_n(&head, __ATOMIC_ACQUIRE) - __atomic_load_n(&tail, __ATOMIC_ACQUIRE); }
+		size_t capacity() const { return mask + 1; }
+	};
+
+	/*! @brief Bounded lock-free queue for any number of producers and consumers
+
+	 Dmitry Vyukov's bounded MPMC queue: every slot carries a sequence number
+	 that tells producers and consumers whose turn it is, so each operation 
+	 is a single compare-and-swap on its index. Capacity is rounded up to a 
+	 power of two. Blocking as in spsc_queue.
+	 */
+	template<typename T> class mpmc_queue {
+		struct cell {
+			size_t seq;
+			T value;
+		};
+
+		cell *buf;
+		size_t mask;
+		char pad0[PTHREAD_CACHELINE];
+		size_t enqueue;
+		char pad1[PTHREAD_CACHELINE - sizeof(size_t)];
+		size_t dequeue;
+		char pad2[PTHREAD_CACHELINE - sizeof(size_t)];
+		eventcount notempty;
+		eventcount notfull;
+		int spins;
+
+		mpmc_queue(const mpmc_queue &);
+		mpmc_queue &operator =(const mpmc_queue &);
+
+		public:
+		mpmc_queue(size_t capacity, int spins = 16): enqueue(0), dequeue(0), spins(spins) {
+			size_t size = 2;
+			while(size < capacity)
+				size <<= 1;
+			buf = new cell[size];
+			mask = size - 1;
+			for(size_t i = 0; i < size; i++)
+				buf[i].seq = i;
+		}
+		~mpmc_queue() { delete[] buf; }
+
+		bool try_push(const T &value) {
+			size_t pos = __atomic_load_n(&enqueue, __ATOMIC_RELAXED);
+			cell *c;
+			while(true) {
+				c = &buf[pos & mask];
+				const intptr_t diff = (intptr_t) __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (intptr_t) pos;
+				if(!diff) {
+					if(__atomic_compare_exchange_n(&enqueue, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+						break;
+				} else if(diff < 0) {
+					return false;
+				} else {
+					pos = __atomic_load_n(&enqueue, __ATOMIC_RELAXED);
+				}
+			}
+			c->value = value;
+			__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+			notempty.notify();
+			return true;
+		}
+		bool try_pop(T &value) {
+			size_t pos = __atomic_load_n(&dequeue, __ATOMIC_RELAXED);
+			cell *c;
+			while(true) {
+				c = &buf[pos & mask];
+				const intptr_t diff = (intptr_t) __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (intptr_t) (pos + 1);
+				if(!diff) {
+					if(__atomic_compare_exchange_n(&dequeue, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+						break;
+				} else if(diff < 0) {
+					return false;
+				} else {
+					pos = __atomic_load_n(&dequeue, __ATOMIC_RELAXED);
+				}
+			}
+			value = c->value;
+			__atomic_store_n(&c->seq, pos + mask + 1, __ATOMIC_RELEASE);
+			notfull.notify();
+			return true;
+		}
+		void push(const T &value) {
+			for(int i = 0; i < spins; i++) {
+				if(try_push(value))
+					return;
+				yield();
+			}
+			while(!try_push(value)) {
+				int key = notfull.prepare();
+				if(try_push(value)) {
+					notfull.cancel();
+					return;
+				}
+				notfull.wait(key);
+			}
+		}
+		void pop(T &value) {
+			for(int i = 0; i < spins; i++) {
+				if(try_pop(value))
+					return;
+				yield();
+			}
+			while(!try_pop(value)) {
+				int key = notempty.prepare();
+				if(try_pop(value)) {
+					notempty.cancel();
+					return;
+				}
+				notempty.wait(key);
+			}
+		}
+
+		//! Approximate number of queued items
+		size_t size() const {
+			const size_t e = __atomic_load_n(&enqueue, __ATOMIC_ACQUIRE), d = __atomic_load_n(&dequeue, __ATOMIC_ACQUIRE);
+			return e > d ? e - d : 0;
+		}
+		size_t capacity() const { return mask + 1; }
+	};
+	/*! @brief Work-stealing thread pool
+
+	 Every worker has its own task deque. Tasks posted from a worker go to the
+	 back of its own deque and are run from the back (most recent, still in 
+	 cache), idle workers steal from the front of other deques. Tasks posted
+	 from other threads are spread round-robin. Idle workers sleep on an 
+	 eventcount.
+
+	 parallel_for() and parallel_reduce() split an index range into chunks 
+	 and return when all chunks are done. The calling thread runs tasks 
+	 itself while it waits, so they can be nested and called from tasks.
+
+	 The destructor runs all tasks still queued before it joins the workers.
+	 */
+	class pool {
+		struct worker {
+			size_t index;
+			mutex m;
+			std::deque<sigc::slot<void> > tasks;
+			thread t;
+			char pad[PTHREAD_CACHELINE];
+		};
+
+		std::vector<worker *> workers;
+		eventcount work;
+		int queued;											//!< Tasks in all deques
+		bool stopping;
+		size_t next;										//!< Worker for the next task posted from outside
+		key self;												//!< worker * of the calling thread, if it is ours
+		bool affinity;
+
+		pool(const pool &);
+		pool &operator =(const pool &);
+
+		bool take(worker *w, sigc::slot<void> &task, bool back) {
+			mutexholder h(&w->m);
+			if(w->tasks.empty())
+				return false;
+			if(back) {
+				task = w->tasks.back();
+				w->tasks.pop_back();
+			} else {
+				task = w->tasks.front();
+				w->tasks.pop_front();
+			}
+			__atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+			return true;
+		}
+
+		//! Run one task, own first, then stolen. Returns false if there was none.
+		bool runone(worker *w) {
+			sigc::slot<void> task;
+			size_t n = workers.size(), start = w ? w->index : 0;
+			if(w && take(w, task, true)) {
+				task();
+				return true;
+			}
+			for(size_t i = 1; i <= n; i++) {
+				if(take(workers[(start + i) % n], task, false)) {
+					task();
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void run(worker *w) {
+			self.setspecific(w);
+#ifdef __linux__
+			if(affinity) {
+				cpu_set_t cpus;
+				CPU_ZERO(&cpus);
+				CPU_SET(w->index % ncpus(), &cpus);
+				pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+			}
+#endif
+			while(true) {
+				if(runone(w))
+					continue;
+				int key = work.prepare();
+				if(__atomic_load_n(&queued, __ATOMIC_SEQ_CST)) {
+					work.cancel();
+					continue;
+				}
+				if(__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)) {
+					work.cancel();
+					break;
+				}
+				work.wait(key);
+			}
+		}
+
+		template<typename T> struct call {
+			sigc::slot<T> f;
+			mutable future<T> result;
+			call(const sigc::slot<T> &f, const future<T> &result): f(f), result(result) {}
+			void operator()() const { result.set(f()); }
+		};
+
+		struct chunk {
+			sigc::slot<void, size_t, size_t> body;
+			size_t begin, end;
+			int *left;
+			mutable future<bool> done;
+			chunk(const sigc::slot<void, size_t, size_t> &body, size_t begin, size_t end, int *left, const future<bool> &done): body(body), begin(begin), end(end), left(left), done(done) {}
+			void operator()() const {
+				body(begin, end);
+				if(!__atomic_sub_fetch(left, 1, __ATOMIC_ACQ_REL))
+					done.set(true);
+			}
+		};
+
+		template<typename T> struct partial {
+			sigc::slot<T, size_t, size_t> body;
+			T *results;
+			size_t begin, grain;
+			partial(const sigc::slot<T, size_t, size_t> &body, T *results, size_t begin, size_t grain): body(body), results(results), begin(begin), grain(grain) {}
+			void operator()(size_t b, size_t e) const { results[(b - begin) / grain] = body(b, e); }
+		};
+
+		size_t autograin(size_t n) const { return (n + 4 * workers.size() - 1) / (4 * workers.size()); }
+
+		public:
+		static size_t ncpus() { long n = sysconf(_SC_NPROCESSORS_ONLN); return n > 0 ? n : 1; }
+
+		//! Start nthreads workers (one per CPU if 0), optionally pinning worker i to CPU i
+		pool(size_t nthreads = 0, bool affinity = false): queued(0), stopping(false), next(0), affinity(affinity) {
+			if(!nthreads)
+				nthreads = ncpus();
+			for(size_t i = 0; i < nthreads; i++) {
+				worker *w = new worker();
+				w->index = i;
+				workers.push_back(w);
+			}
+			for(size_t i = 0; i < nthreads; i++)
+				workers[i]->t.create(sigc::bind(sigc::mem_fun(this, &pool::run), workers[i]));
+		}
+
+		~pool() {
+			__atomic_store_n(&stopping, true, __ATOMIC_SEQ_CST);
+			work.notify();
+			for(size_t i = 0; i < workers.size(); i++) {
+				workers[i]->t.join();
+				delete workers[i];
+			}
+		}
+
+		size_t size() const { return workers.size(); }
+
+		//! Queue task without waiting for it
+		void post(const sigc::slot<void> &task) {
+			worker *w = (worker *) self.getspecific();
+			if(!w)
+				w = workers[__atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % workers.size()];
+			{
+				mutexholder h(&w->m);
+				w->tasks.push_back(task);
+			}
+			__atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+			work.notify(1);
+		}
+
+		//! Queue f, the future receives its return value
+		template<typename T> future<T> submit(const sigc::slot<T> &f) {
+			future<T> result;
+			post(call<T>(f, result));
+			return result;
+		}
+
+		//! Call body(b, e) for consecutive subranges [b, e) of [begin, end) of at most grain indices (0: automatic)
+		void parallel_for(size_t begin, size_t end, const sigc::slot<void, size_t, size_t> &body, size_t grain = 0) {
+			if(end <= begin)
+				return;
+			if(!grain)
+				grain = autograin(end - begin);
+
+			int left = (end - begin + grain - 1) / grain;
+			future<bool> done;
+			for(size_t b = begin; b < end; b += grain)
+				post(chunk(body, b, end - b > grain ? b + grain : end, &left, done));
+
+			// Help out instead of blocking, the caller might be a worker itself
+			worker *w = (worker *) self.getspecific();
+			while(!done.ready())
+				if(!runone(w))
+					done.wait(100);
+		}
+
+		//! Combine body(b, e) of all subranges with combine(), starting from init, in index order
+		template<typename T> T parallel_reduce(size_t begin, size_t end, const sigc::slot<T, size_t, size_t> &body, const sigc::slot<T, T, T> &combine, T init, size_t grain = 0) {
+			if(end <= begin)
+				return init;
+			if(!grain)
+				grain = autograin(end - begin);
+
+			std::vector<T> results((end - begin + grain - 1) / grain);
+			parallel_for(begin, end, partial<T>(body, &results[0], begin, grain), grain);
+
+			for(size_t i = 0; i < results.size(); i++)
+				init = combine(init, results[i]);
+			return init;
+		}
+	};
 }
 
 #endif
@@ -27,10 +27,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/poll.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <syslog.h>
 #include <errno.h>
 
+#include <algorithm>
 #include <string>
 #include <map>
 #include <set>
@@ -47,7 +50,24 @@ namespace serial {
 	static map<string, port *> ports;
 
 	bool port::write(const char *buf, int len) {
-		return ::write(fd, buf, len) >= 0;
+		// write() may return early (signals, full output queue), keep going 
+		// until everything is out
+		while(len > 0) {
+			ssize_t result = ::write(fd, buf, len);
+			if(result < 0) {
+				if(errno == EINTR)
+					continue;
+				if(errno == EAGAIN) {
+					struct pollfd pfd = {fd, POLLOUT};
+					poll(&pfd, 1, -1);
+					continue;
+				}
+				return false;
+			}
+			buf += result;
+			len -= result;
+		}
+		return true;
 	}
 
 	bool port::write(string str) {
@@ -69,37 +89,122 @@ namespace serial {
 		return result;
 	}
 
+	bool port::getline(char *buf, size_t len) {
+		char *newline = (char *)memchr(inbuf, delimiter, inlen);
+		if(!newline)
+			return false;
+
+		size_t linelen = newline - inbuf;
+		size_t skip = 0;
+		// Devices terminating with "\r\n" leave a '\n' in front of the next line
+		if(linelen && inbuf[0] == '\n')
+			skip = 1;
+
+		size_t copylen = min(linelen - skip, len - 1);
+		memcpy(buf, inbuf + skip, copylen);
+		buf[copylen] = 0;
+
+		inlen -= linelen + 1;
+		memmove(inbuf, newline + 1, inlen);
+		return true;
+	}
+
 	bool port::gets(char *buf, int len, int timeout) {
-		int left = len;
-		int result;
-		char *p = buf;
-		char *newline;
+		if(len <= 0)
+			return false;
+
+		// Timeout applies to the whole line, not to each read()
+		struct timespec deadline;
+		if(timeout >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += timeout / 1000;
+			deadline.tv_nsec += (timeout % 1000) * 1000000L;
+			if(deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+		}
+
+		while(true) {
+			if(getline(buf, len))
+				return true;
+
+			// Line does not fit, drop what we have so we can resynchronise
+			if(inlen >= (size_t)len || inlen == sizeof inbuf) {
+				inlen = 0;
+				return false;
+			}
+
+			int wait = -1;
+			if(timeout >= 0) {
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				// Round up, poll() must not return before the deadline
+				long ns = (deadline.tv_sec - now.tv_sec) * 1000000000L + deadline.tv_nsec - now.tv_nsec;
+				wait = ns > 0 ? (ns + 999999) / 1000000L : 0;
+			}
 
-		while(left) {
 			struct pollfd pfd = {fd, POLLIN | POLLERR | POLLHUP};
-			result = poll(&pfd, 1, timeout);
+			int result = poll(&pfd, 1, wait);
 
+			if(result < 0 && errno == EINTR)
+				continue;
 			if(result <= 0)
 				return false;
 
-			result = read(fd, p, left);
+			result = read(fd, inbuf + inlen, sizeof inbuf - inlen);
+			if(result < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
 			if(result <= 0)
 				return false;
 
-			newline = (char *)memchr(p, delimiter, result);
-			
-			if(newline) {
-				*newline = 0;
-				if(*buf == '\n')
-					memmove(buf, buf + 1, strlen(buf));
-				return true;
-			}
-			
-			p += result;
-			left -= result;
+			inlen += result;
+		}
+	}
+
+	void port::handler(int fd, uint32_t events) {
+		ssize_t result = 0;
+		if(events & EPOLLIN)
+			result = read(fd, inbuf + inlen, sizeof inbuf - inlen);
+		if(result <= 0) {
+			if(result < 0 && (errno == EINTR || errno == EAGAIN))
+				return;
+			// Hangup or error, stop watching this port
+			if(loop)
+				loop->remove(fd);
+			loop = NULL;
+			return;
+		}
+
+		inlen += result;
+
+		char buf[sizeof inbuf];
+		while(getline(buf, sizeof buf))
+			slot_line(buf);
+
+		if(inlen == sizeof inbuf)
+			inlen = 0;
+	}
+
+	bool port::setasync(EventLoop *newloop, const sigc::slot<void, string> &slot) {
+		setsync();
+
+		slot_line = slot;
+		loop = newloop;
+		if(!loop->add(fd, EPOLLIN, sigc::mem_fun(*this, &port::handler))) {
+			loop = NULL;
+			return false;
 		}
 
-		return false;
+		return true;
+	}
+
+	void port::setsync() {
+		if(!loop)
+			return;
+
+		loop->remove(fd);
+		loop = NULL;
 	}
 
 	string port::readline(int timeout) {
@@ -110,6 +215,15 @@ namespace serial {
 			return "";
 	}
 
+	scheduler *port::getscheduler() {
+		pthread::mutexholder h(&portmutex);
+
+		if(!sched)
+			sched = new scheduler(this);
+
+		return sched;
+	}
+
 	port &port::operator<<(const string line) {
 		write(line);
 		return *this;
@@ -120,7 +234,7 @@ namespace serial {
 		return *this;
 	}
 
-	port::port(const string device, speed_t speed, int parity, char delimiter): delimiter(delimiter), device(device), speed(speed), parity(parity) {
+	port::port(const string device, speed_t speed, int parity, char delimiter): delimiter(delimiter), inlen(0), loop(NULL), sched(NULL), device(device), speed(speed), parity(parity) {
 		if(device.empty())
 			throw exception("No device name!");
 
@@ -161,6 +275,8 @@ namespace serial {
 		if(!nodes.empty())
 			throw exception(device + ": Port still in use");
 		
+		delete sched;
+		setsync();
 		close(fd);
 
 		ports.erase(device);
@@ -204,4 +320,215 @@ namespace serial {
 
 		return result;
 	}
+
+	pthread::future<string> node::submit(const string request, bool reply) {
+		return thisport->getscheduler()->submit(nr, request, reply);
+	}
+
+	string node::request(const string request) {
+		pthread::future<string> result = submit(request);
+		result.wait();
+		if(result.failed())
+			throw exception(thisport->device + format(":%d: ", nr) + result.error());
+		return result.get();
+	}
+
+	void node::settimeout(int timeout) {
+		thisport->getscheduler()->settimeout(nr, timeout);
+	}
+
+	scheduler::scheduler(port *p, size_t depth, int timeout): thisport(p), running(true), depth(depth), timeout(timeout) {
+		wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(wakefd < 0)
+			throw exception(thisport->device + ": Could not create eventfd: " + strerror(errno));
+
+		worker.create(sigc::mem_fun(*this, &scheduler::handler));
+	}
+
+	scheduler::~scheduler() {
+		__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+		wake();
+		worker.join();
+		close(wakefd);
+
+		while(!queue.empty()) {
+			queue.front()->result.fail("scheduler stopped");
+			delete queue.front();
+			queue.pop_front();
+		}
+		while(!inflight.empty()) {
+			inflight.front()->result.fail("scheduler stopped");
+			delete inflight.front();
+			inflight.pop_front();
+		}
+	}
+
+	void scheduler::wake() {
+		uint64_t one = 1;
+		if(::write(wakefd, &one, sizeof one) < 0)
+			return;
+	}
+
+	pthread::future<string> scheduler::submit(int node, const string request, bool reply) {
+		transaction *t = new transaction;
+		t->node = node;
+		t->request = request;
+		t->reply = reply;
+		pthread::future<string> result = t->result;
+
+		{
+			pthread::mutexholder h(&mutex);
+			queue.push_back(t);
+		}
+
+		wake();
+		return result;
+	}
+
+	void scheduler::settimeout(int node, int timeout) {
+		pthread::mutexholder h(&mutex);
+		timeouts[node] = timeout;
+	}
+
+	size_t scheduler::pending() {
+		pthread::mutexholder h(&mutex);
+		return queue.size() + inflight.size();
+	}
+
+	// Called without mutex held: writing can block, and submit() should not 
+	// have to wait for that. Only the worker adds to inflight, so the depth 
+	// limit still holds while a transaction is being written.
+	void scheduler::transmit() {
+		while(true) {
+			transaction *t;
+			int ms;
+			{
+				pthread::mutexholder h(&mutex);
+				if(queue.empty() || inflight.size() >= max(depth, (size_t)1))
+					return;
+				t = queue.front();
+				queue.pop_front();
+
+				map<int, int>::iterator it = timeouts.find(t->node);
+				ms = it == timeouts.end() ? timeout : it->second;
+			}
+
+			bool ok;
+			{
+				port::mutexholder h(thisport);
+				ok = thisport->write(t->request);
+			}
+
+			if(!ok) {
+				t->result.fail("write error");
+				delete t;
+				continue;
+			}
+
+			if(!t->reply) {
+				t->result.set("");
+				delete t;
+				continue;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &t->deadline);
+			t->deadline.tv_sec += ms / 1000;
+			t->deadline.tv_nsec += (ms % 1000) * 1000000L;
+			if(t->deadline.tv_nsec >= 1000000000L) {
+				t->deadline.tv_sec++;
+				t->deadline.tv_nsec -= 1000000000L;
+			}
+
+			pthread::mutexholder h(&mutex);
+			inflight.push_back(t);
+		}
+	}
+
+	// Called with mutex held
+	void scheduler::receive(const string &line) {
+		int node = slot_match.empty() ? -1 : slot_match(line);
+
+		for(deque<transaction *>::iterator it = inflight.begin(); it != inflight.end(); ++it) {
+			if(node >= 0 && (*it)->node != node)
+				continue;
+			(*it)->result.set(line);
+			delete *it;
+			inflight.erase(it);
+			return;
+		}
+		// Unsolicited or late reply, drop it
+	}
+
+	// Called with mutex held
+	void scheduler::expire() {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for(deque<transaction *>::iterator it = inflight.begin(); it != inflight.end();) {
+			const struct timespec &d = (*it)->deadline;
+			if(now.tv_sec > d.tv_sec || (now.tv_sec == d.tv_sec && now.tv_nsec >= d.tv_nsec)) {
+				(*it)->result.fail("timeout");
+				delete *it;
+				it = inflight.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	// Called with mutex held
+	int scheduler::nextdeadline() {
+		if(inflight.empty())
+			return -1;
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		long wait = -1;
+		for(deque<transaction *>::iterator it = inflight.begin(); it != inflight.end(); ++it) {
+			long ms = ((*it)->deadline.tv_sec - now.tv_sec) * 1000 + ((*it)->deadline.tv_nsec - now.tv_nsec) / 1000000L + 1;
+			if(wait < 0 || ms < wait)
+				wait = ms;
+		}
+
+		return max(wait, 0L);
+	}
+
+	void scheduler::handler() {
+		char buf[sizeof thisport->inbuf];
+
+		while(__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+			{
+				pthread::mutexholder h(&mutex);
+				expire();
+			}
+			transmit();
+			int wait;
+			{
+				pthread::mutexholder h(&mutex);
+				wait = nextdeadline();
+			}
+
+			struct pollfd pfd[2] = {{thisport->fd, POLLIN}, {wakefd, POLLIN}};
+			if(poll(pfd, 2, wait) < 0 && errno != EINTR)
+				break;
+
+			if(pfd[1].revents & POLLIN) {
+				uint64_t count;
+				if(read(wakefd, &count, sizeof count) < 0)
+					continue;
+			}
+
+			if(pfd[0].revents & POLLIN) {
+				// Read what is available and handle all complete lines
+				while(thisport->gets(buf, sizeof buf, 0)) {
+					pthread::mutexholder h(&mutex);
+					receive(buf);
+				}
+			} else if(pfd[0].revents & (POLLERR | POLLHUP)) {
+				// Nothing to read but poll() will not block either, don't spin
+				usleep(10000);
+			}
+		}
+	}
 }
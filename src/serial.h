@@ -27,8 +27,13 @@
 #include <stdexcept>
 #include <string>
 #include <set>
+#include <map>
+#include <deque>
+
+#include <sigc++/slot.h>
 
 #include "pthread++.h"
+#include "eventloop.h"
 
 namespace serial {
 	class exception: public std::runtime_error {
@@ -36,12 +41,25 @@ namespace serial {
 		exception(const std::string reason): runtime_error(reason) {}
 	};
 
+	class scheduler;
+
 	class port {
 		friend class node;
+		friend class scheduler;
 		int fd;
 		std::set<int> nodes;
 		char delimiter;
 
+		char inbuf[4096];									//!< Bytes read but not yet returned, kept between calls
+		size_t inlen;
+		bool getline(char *buf, size_t len); //!< Move the first complete line from inbuf to buf
+
+		EventLoop *loop;									//!< EventLoop in async mode, or NULL
+		sigc::slot<void, std::string> slot_line;
+		void handler(int fd, uint32_t events);
+
+		scheduler *sched;									//!< Transaction scheduler, created by getscheduler()
+
 		public:
 		pthread::mutex mutex;
 		const std::string device;
@@ -60,8 +78,17 @@ namespace serial {
 		bool write(const char *buf, int len);
 		bool vprintf(const char *format, va_list va);
 		bool printf(const char *format, ...);
-		bool gets(char *buf, int len, int timeout = -1);
+		bool gets(char *buf, int len, int timeout = -1); //!< Read one line, waiting at most timeout ms in total
 		std::string readline(int timeout = -1);
+
+		/*! @brief Let loop read from this port and call slot(line) for every complete line
+		 
+		 Do not call gets() or readline() while in async mode, they would compete 
+		 with the EventLoop for the data.
+		 */
+		bool setasync(EventLoop *loop, const sigc::slot<void, std::string> &slot);
+		void setsync();										//!< Leave async mode
+		scheduler *getscheduler();				//!< Scheduler for this port, started on first use
 		port &operator<<(const std::string line);
 		port &operator<<(const char *line);
 		port operator>>(std::string &line);
@@ -90,6 +117,67 @@ namespace serial {
 		node &operator<<(const std::string line) { *thisport << line; return *this; }
 		node &operator<<(const char *line) { *thisport << line; return *this; }
 		node operator>>(std::string &line) { *thisport >> line; return *this; }
+
+		pthread::future<std::string> submit(const std::string request, bool reply = true); //!< Queue request on the port's scheduler
+		std::string request(const std::string request); //!< submit() and wait for the reply, throws serial::exception on failure
+		void settimeout(int timeout);			//!< Set reply timeout (ms) for this node on the port's scheduler
+		scheduler *getscheduler() { return thisport->getscheduler(); }
+	};
+
+	/*! @brief Queue and pipeline request/reply transactions of many nodes on one port
+	 
+	 Nodes sharing a bus (e.g. RS-485) submit() requests instead of taking the 
+	 port mutex for a write/readline round trip. A single worker thread writes 
+	 requests in submission order, with at most 'depth' of them waiting for a 
+	 reply at any time, and completes the returned future with the reply line.
+	 
+	 Replies are matched to requests by slot_match(line), which should return 
+	 the node number the reply comes from (or -1 if unknown). Without 
+	 slot_match, or for -1, replies are assumed to arrive in request order. 
+	 For devices that do not echo their address, use depth 1 so a late reply 
+	 cannot be mistaken for the answer to the next request.
+	 
+	 Requests that get no reply within the node's timeout (counted from 
+	 transmission) fail with "timeout". Do not use gets() or async mode on a 
+	 port while its scheduler runs.
+	 */
+	class scheduler {
+		struct transaction {
+			int node;
+			std::string request;
+			bool reply;
+			struct timespec deadline;
+			pthread::future<std::string> result;
+		};
+
+		port *thisport;
+		std::deque<transaction *> queue;	//!< Waiting to be sent
+		std::deque<transaction *> inflight; //!< Sent, waiting for a reply
+		std::map<int, int> timeouts;			//!< Per node timeout in ms
+		pthread::mutex mutex;							//!< Protects the above
+		int wakefd;												//!< eventfd to interrupt the worker
+
+		bool running;											//!< Cleared by the destructor (atomic)
+		pthread::thread worker;
+		void handler();
+		void transmit();									//!< Send queued transactions while inflight < depth, without mutex held
+		void receive(const std::string &line);
+		void expire();
+		int nextdeadline();								//!< ms until the first inflight deadline, or -1
+		void wake();
+
+		public:
+		scheduler(port *p, size_t depth = 1, int timeout = 1000);
+		~scheduler();
+
+		size_t depth;											//!< Maximum number of requests waiting for a reply [1]
+		int timeout;											//!< Default reply timeout in ms [1000]
+
+		pthread::future<std::string> submit(int node, const std::string request, bool reply = true);
+		void settimeout(int node, int timeout);
+		size_t pending();									//!< Number of queued and inflight requests
+
+		sigc::slot<int, std::string> slot_match; //!< Returns the node number a reply line belongs to, or -1
 	};
 }
 
@@ -0,0 +1,300 @@
+/*
+ shmring.cc -- shared memory ring buffer between processes on one host
+ Copyright (C) 2012 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <string>
+
+#include "shmring.h"
+
+using namespace std;
+
+static const uint32_t SHMRING_MAGIC = 0x53485252; // "SHRR"
+static const uint32_t SHMRING_VERSION = 3;
+
+ShmRing::ShmRing(const string &name, size_t size): fd(-1), hdr(NULL), data(NULL), maplen(0), owner(true), name(name) {
+	// Round up to a power of two so offsets can be masked instead of divided
+	size_t cap = 4096;
+	while(cap < size)
+		cap <<= 1;
+
+	// Never take over a ring that is in use, only one left behind by a
+	// process that no longer exists.
+	fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(fd < 0 && errno == EEXIST && stale(name)) {
+		shm_unlink(name.c_str());
+		fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	}
+	if(fd < 0)
+		throw exception("ShmRing: could not create " + name + ": " + strerror(errno));
+
+	if(ftruncate(fd, sizeof(header) + cap)) {
+		int err = errno;
+		::close(fd);
+		shm_unlink(name.c_str());
+		throw exception("ShmRing: could not resize " + name + ": " + strerror(err));
+	}
+
+	map(sizeof(header) + cap);
+
+	hdr->version = SHMRING_VERSION;
+	hdr->size = cap;
+	hdr->creator = getpid();
+	hdr->peer = 0;
+	hdr->head = 0;
+	hdr->tail = 0;
+
+	pthread_mutexattr_t mattr;
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&hdr->mutex, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	pthread_condattr_t cattr;
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&hdr->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	// Only now the ring can be used by others
+	__atomic_store_n(&hdr->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+}
+
+ShmRing::ShmRing(const string &name): fd(-1), hdr(NULL), data(NULL), maplen(0), owner(false), name(name) {
+	fd = shm_open(name.c_str(), O_RDWR, 0600);
+	if(fd < 0)
+		throw exception("ShmRing: could not open " + name + ": " + strerror(errno));
+
+	struct stat st;
+	if(fstat(fd, &st) || (size_t) st.st_size < sizeof(header)) {
+		::close(fd);
+		throw exception("ShmRing: " + name + " is not a ring buffer");
+	}
+
+	map(st.st_size);
+
+	// Offsets are masked with size - 1, anything but a power of two corrupts
+	const uint64_t size = hdr->size;
+	if(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC || hdr->version != SHMRING_VERSION || !size || (size & (size - 1)) || size > maplen - sizeof(header)) {
+		munmap(hdr, maplen);
+		::close(fd);
+		throw exception("ShmRing: " + name + " is not (yet) a valid ring buffer");
+	}
+
+	__atomic_store_n(&hdr->peer, (int64_t) getpid(), __ATOMIC_RELEASE);
+}
+
+ShmRing::~ShmRing() {
+	// Tell the other side we are gone, so it does not wait for us
+	if(hdr) {
+		int64_t self = getpid();
+		if(owner)
+			__atomic_store_n(&hdr->creator, (int64_t) 0, __ATOMIC_RELEASE);
+		else
+			__atomic_compare_exchange_n(&hdr->peer, &self, (int64_t) 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+		notify();
+		munmap(hdr, maplen);
+	}
+	if(fd >= 0)
+		::close(fd);
+	if(owner)
+		shm_unlink(name.c_str());
+}
+
+bool ShmRing::stale(const string &name) {
+	int sfd = shm_open(name.c_str(), O_RDONLY, 0);
+	if(sfd < 0)
+		return false;
+
+	// A ring that is still being set up is too small or has no magic yet, 
+	// that is not stale either.
+	bool result = false;
+	struct stat st;
+	if(!fstat(sfd, &st) && (size_t) st.st_size >= sizeof(header)) {
+		void *p = mmap(NULL, sizeof(header), PROT_READ, MAP_SHARED, sfd, 0);
+		if(p != MAP_FAILED) {
+			const header *h = (const header *) p;
+			if(__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == SHMRING_MAGIC && h->version == SHMRING_VERSION)
+				result = !alive(__atomic_load_n(&h->creator, __ATOMIC_ACQUIRE));
+			munmap(p, sizeof(header));
+		}
+	}
+
+	::close(sfd);
+	errno = EEXIST;
+	return result;
+}
+
+void ShmRing::map(const size_t len) {
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(p == MAP_FAILED) {
+		int err = errno;
+		::close(fd);
+		if(owner)
+			shm_unlink(name.c_str());
+		throw exception("ShmRing: could not map " + name + ": " + strerror(err));
+	}
+
+	maplen = len;
+	hdr = (header *) p;
+	data = (char *) p + sizeof(header);
+}
+
+size_t ShmRing::readavailable() const {
+	return __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+}
+
+size_t ShmRing::writeavailable() const {
+	return hdr->size - readavailable();
+}
+
+void ShmRing::lock() {
+	// The other process died holding the mutex. It only guards waiting, head
+	// and tail are updated atomically, so there is nothing to repair.
+	if(pthread_mutex_lock(&hdr->mutex) == EOWNERDEAD)
+		pthread_mutex_consistent(&hdr->mutex);
+}
+
+void ShmRing::notify() {
+	// Taking the mutex makes sure a waiter either saw our update or is
+	// already in pthread_cond_timedwait() when we broadcast.
+	lock();
+	pthread_cond_broadcast(&hdr->cond);
+	pthread_mutex_unlock(&hdr->mutex);
+}
+
+bool ShmRing::peeralive() const {
+	return alive(__atomic_load_n(owner ? &hdr->peer : &hdr->creator, __ATOMIC_ACQUIRE));
+}
+
+static struct timespec *getdeadline(struct timespec *ts, int timeout);
+
+static bool earlier(const struct timespec &a, const struct timespec &b) {
+	return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+bool ShmRing::wait(const bool forwrite, const struct timespec *deadline) {
+	int err = 0;
+
+	lock();
+	while(!err && !(forwrite ? writeavailable() : readavailable())) {
+		// Never sleep longer than PEERCHECK_MS, the other side may be gone
+		struct timespec check;
+		getdeadline(&check, PEERCHECK_MS);
+		const bool last = deadline && !earlier(check, *deadline);
+		err = pthread_cond_timedwait(&hdr->cond, &hdr->mutex, last ? deadline : &check);
+		if(err == EOWNERDEAD) {
+			pthread_mutex_consistent(&hdr->mutex);
+			err = 0;
+		}
+		if(err == ETIMEDOUT && !last)
+			err = peeralive() ? 0 : EPIPE;
+	}
+	pthread_mutex_unlock(&hdr->mutex);
+
+	const bool ok = forwrite ? writeavailable() : readavailable();
+	if(!ok)
+		errno = err;
+	return ok;
+}
+
+static struct timespec *getdeadline(struct timespec *ts, int timeout) {
+	if(timeout < 0)
+		return NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += timeout / 1000;
+	ts->tv_nsec += (timeout % 1000) * 1000000L;
+	if(ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+	return ts;
+}
+
+bool ShmRing::write(const void *buf, size_t len, int timeout) {
+	const char *p = (const char *) buf;
+	const uint64_t mask = hdr->size - 1;
+	struct timespec ts, *deadline = getdeadline(&ts, timeout);
+
+	while(len) {
+		size_t avail = writeavailable();
+		if(!avail) {
+			if(!wait(true, deadline))
+				return false;
+			continue;
+		}
+
+		// Copy in at most two parts: up to the end of the ring, then from the start
+		uint64_t head = hdr->head;
+		size_t n = len < avail ? len : avail;
+		size_t off = head & mask;
+		size_t first = n < hdr->size - off ? n : hdr->size - off;
+		memcpy(data + off, p, first);
+		memcpy(data, p + first, n - first);
+
+		__atomic_store_n(&hdr->head, head + n, __ATOMIC_RELEASE);
+		notify();
+
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+bool ShmRing::read(void *buf, size_t len, int timeout) {
+	char *p = (char *) buf;
+	const uint64_t mask = hdr->size - 1;
+	struct timespec ts, *deadline = getdeadline(&ts, timeout);
+
+	while(len) {
+		size_t avail = readavailable();
+		if(!avail) {
+			if(!wait(false, deadline))
+				return false;
+			continue;
+		}
+
+		uint64_t tail = hdr->tail;
+		size_t n = len < avail ? len : avail;
+		size_t off = tail & mask;
+		size_t first = n < hdr->size - off ? n : hdr->size - off;
+		memcpy(p, data + off, first);
+		memcpy(p + first, data, n - first);
+
+		__atomic_store_n(&hdr->tail, tail + n, __ATOMIC_RELEASE);
+		notify();
+
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
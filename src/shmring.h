@@ -0,0 +1,108 @@
+/*
+ shmring.h -- shared memory ring buffer between processes on one host
+ Copyright (C) 2012 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef HAVE_SHMRING_H
+#define HAVE_SHMRING_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <signal.h>
+#include <errno.h>
+
+#include <stdexcept>
+#include <string>
+
+/*! @brief Single producer, single consumer byte ring in POSIX shared memory
+
+ One process creates the ring with ShmRing(name, size), another one opens it
+ with ShmRing(name). Afterwards one side write()s and the other read()s,
+ with the same semantics as a pipe or Socket: write() blocks until all data
+ is in the ring, read() blocks until the requested amount is available.
+ Frames larger than the ring are therefore fine, they are simply streamed.
+
+ Data is copied straight into the mapped memory, there are no system calls
+ unless one side has to wait for the other. Waiting uses a process-shared
+ mutex and condition variable stored in the ring header. The mutex is
+ robust, so a process that dies while waiting does not block the other one.
+
+ Without a timeout, write() and read() wait as long as the other side is
+ there: every PEERCHECK_MS they check that the process at the other end
+ still runs (and for the creator, that someone opened the ring at all), and
+ fail with EPIPE otherwise. If write() or read() fails, part of the data may
+ already have been transferred.
+
+ Opening a ring fails if its header is not sane, e.g. a size that is not a
+ power of two.
+
+ The creator removes the shared memory object when it is destroyed. Creating
+ a ring with a name that is in use fails with EEXIST, unless the process that
+ created the existing ring no longer runs: such a stale ring is replaced.
+ */
+class ShmRing {
+	struct header {
+		uint32_t magic;										//!< SHMRING_MAGIC once initialised
+		uint32_t version;
+		uint64_t size;										//!< Capacity of the data area (power of two)
+		int64_t creator;									//!< Pid of the process that created the ring, 0 once it is gone
+		int64_t peer;											//!< Pid of the process that opened the ring, 0 if none
+		char pad0[64 - 2*sizeof(uint32_t) - 3*sizeof(uint64_t)];
+		uint64_t head;										//!< Total bytes written (only modified by writer)
+		char pad1[64 - sizeof(uint64_t)];
+		uint64_t tail;										//!< Total bytes read (only modified by reader)
+		char pad2[64 - sizeof(uint64_t)];
+		pthread_mutex_t mutex;						//!< Protects waiting, not the data
+		pthread_cond_t cond;							//!< Signalled on every head or tail change
+	};
+
+	int fd;
+	header *hdr;
+	char *data;
+	size_t maplen;
+	bool owner;													//!< Did we create the ring (then unlink it on destruction)
+
+	void map(const size_t len);
+	void lock();
+	void notify();
+	bool wait(const bool forwrite, const struct timespec *deadline);
+	bool peeralive() const;							//!< Does the process at the other end still run
+	static bool alive(const int64_t pid) { return pid > 0 && !(kill((pid_t) pid, 0) && errno == ESRCH); }
+	static bool stale(const std::string &name); //!< Is name a ring whose creator is gone
+
+public:
+	static const int PEERCHECK_MS = 1000; //!< How often to check the other side while waiting
+	const std::string name;
+
+	ShmRing(const std::string &name, size_t size); //!< Create new ring of (at least) size bytes
+	ShmRing(const std::string &name);		//!< Open existing ring
+	~ShmRing();
+
+	bool write(const void *buf, size_t len, int timeout = -1); //!< Write len bytes, wait at most timeout ms (or while the peer runs) for space
+	bool read(void *buf, size_t len, int timeout = -1); //!< Read len bytes, wait at most timeout ms (or while the peer runs) for data
+	size_t readavailable() const;				//!< Bytes that can be read without waiting
+	size_t writeavailable() const;			//!< Bytes that can be written without waiting
+	size_t getsize() const { return hdr->size; }
+
+	class exception: public std::runtime_error {
+		public:
+		exception(const std::string reason): runtime_error(reason) {}
+	};
+};
+
+#endif // HAVE_SHMRING_H
@@ -27,29 +27,157 @@
 
 #include <stdlib.h>
 #include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <sys/signalfd.h>
 #include <sigc++/signal.h>
 
+namespace {
+	// Fault signals, delivered to the faulting thread and never blocked
+	const int crash_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+	const size_t ncrash_signals = sizeof(crash_signals) / sizeof(crash_signals[0]);
+	
+	int instances = 0;									//!< SigHandle objects, at most one
+	
+	const size_t ALTSTACK_SIZE = 64*1024;
+	const size_t MAX_CRASHDUMPS = 8;
+	
+	int crashfd = -1;										//!< Preopened crash dump fd
+	struct {
+		const char *label;
+		SigHandle::crashdump_t func;
+		void *arg;
+	} crashdumps[MAX_CRASHDUMPS];
+	size_t ncrashdumps = 0;
+	
+	const char *crash_signame(const int sig) {
+		switch (sig) {
+			case SIGSEGV: return "SIGSEGV";
+			case SIGBUS: return "SIGBUS";
+			case SIGFPE: return "SIGFPE";
+			case SIGILL: return "SIGILL";
+			case SIGABRT: return "SIGABRT";
+			default: return "signal";
+		}
+	}
+	
+	void crash_handler(int sig, siginfo_t *info, void * /* context */) {
+		const int fd = crashfd;
+		
+		SigHandle::crash_write(fd, "\n*** Caught ");
+		SigHandle::crash_write(fd, crash_signame(sig));
+		SigHandle::crash_write(fd, " (");
+		SigHandle::crash_write(fd, sig);
+		SigHandle::crash_write(fd, ") at address 0x");
+		SigHandle::crash_write(fd, (uintptr_t) info->si_addr, 16);
+		SigHandle::crash_write(fd, ", code ");
+		SigHandle::crash_write(fd, info->si_code);
+		SigHandle::crash_write(fd, ", pid ");
+		SigHandle::crash_write(fd, getpid());
+		SigHandle::crash_write(fd, " ***\n--- backtrace ---\n");
+		
+		void *frames[64];
+		int nframes = backtrace(frames, 64);
+		backtrace_symbols_fd(frames, nframes, fd);
+		
+		for (size_t i=0; i < __atomic_load_n(&ncrashdumps, __ATOMIC_ACQUIRE); i++) {
+			// Removed by removecrashdump()
+			if (!__atomic_load_n(&crashdumps[i].func, __ATOMIC_ACQUIRE))
+				continue;
+			SigHandle::crash_write(fd, "--- ");
+			SigHandle::crash_write(fd, crashdumps[i].label);
+			SigHandle::crash_write(fd, " ---\n");
+			(crashdumps[i].func)(fd, crashdumps[i].arg);
+		}
+		SigHandle::crash_write(fd, "*** end of crash dump ***\n");
+		fsync(fd);
+		
+		// SA_RESETHAND restored the default action: faults trigger again when 
+		// we return, anything else (abort(), kill()) we re-raise
+		if (info->si_code <= 0 || sig == SIGABRT)
+			raise(sig);
+	}
+}
+
 SigHandle::SigHandle(bool blockall):
-handled_signal(-1), ign_count(0), quit_count(0), max_quit_count(1) {
+handled_signal(-1), ign_count(0), quit_count(0), def_count(0), loop(NULL), sigfd(-1), max_quit_count(1) {
 	DEBUGPRINT("%s", "init\n");
+	claim();
+	block(blockall);
+	
+	// create the signal handling thread (from pthread++.h)
+	DEBUGPRINT("%s", "creating handler...\n");
+	handler_thr.create(sigc::mem_fun(*this, &SigHandle::handler));
+}
+
+SigHandle::SigHandle(EventLoop &l, bool blockall):
+handled_signal(-1), ign_count(0), quit_count(0), def_count(0), loop(&l), sigfd(-1), max_quit_count(1) {
+	DEBUGPRINT("%s", "init (signalfd)\n");
+	claim();
+	block(blockall);
+	
+	// Blocked signals are read from sigfd, SIGKILL and SIGSTOP are silently left out
 	sigset_t signal_set;
+	sigfillset(&signal_set);
+	for (size_t i=0; i < ncrash_signals; i++)
+		sigdelset(&signal_set, crash_signals[i]);
+	sigfd = signalfd(-1, &signal_set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigfd < 0) {
+		__atomic_sub_fetch(&instances, 1, __ATOMIC_ACQ_REL);
+		throw exception(format("SigHandle: could not create signalfd: %s", strerror(errno)));
+	}
 	
+	if (!loop->add(sigfd, EPOLLIN, sigc::mem_fun(*this, &SigHandle::fd_handler))) {
+		const int err = errno;
+		close(sigfd);
+		__atomic_sub_fetch(&instances, 1, __ATOMIC_ACQ_REL);
+		throw exception(format("SigHandle: could not add signalfd to loop: %s", strerror(err)));
+	}
+}
+
+void SigHandle::claim() {
+	// Two of them would race for every signal, the loser ignoring it
+	if (__atomic_fetch_add(&instances, 1, __ATOMIC_ACQ_REL)) {
+		__atomic_sub_fetch(&instances, 1, __ATOMIC_ACQ_REL);
+		throw exception("SigHandle: only one instance per process");
+	}
+}
+
+SigHandle::~SigHandle() {
+	DEBUGPRINT("%s", "end\n");
+	if (loop) {
+		// Waits for a signal being handled in the loop thread
+		loop->remove(sigfd);
+		close(sigfd);
+	} else {
+		handler_thr.cancel();
+		handler_thr.join();
+	}
+	__atomic_sub_fetch(&instances, 1, __ATOMIC_ACQ_REL);
+}
+
+void SigHandle::block(bool blockall) {
 	// Block all signals if requested
 	DEBUGPRINT("%s", "blocking signals...\n");
 	if (blockall) {
+		sigset_t signal_set;
 		sigfillset(&signal_set);
+		for (size_t i=0; i < ncrash_signals; i++)
+			sigdelset(&signal_set, crash_signals[i]);
 		pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
 	}
-	
-	// create the signal handling thread (from pthread++.h)
-	DEBUGPRINT("%s", "creating handler...\n");
-	handler_thr.create(sigc::mem_fun(*this, &SigHandle::handler));
 }
 
-SigHandle::~SigHandle() {
-	DEBUGPRINT("%s", "end\n");
-	handler_thr.cancel();
-	handler_thr.join();
+void SigHandle::sethandler(const int sig, const handler_t &handler) {
+	pthread::mutexholder h(&sig_mutex);
+	handlers[sig] = handler;
+}
+
+void SigHandle::clearhandler(const int sig) {
+	pthread::mutexholder h(&sig_mutex);
+	handlers.erase(sig);
 }
 
 void SigHandle::handler() {
@@ -61,12 +189,39 @@ void SigHandle::handler() {
 		DEBUGPRINT("%s", "waiting for any signal...\n");
 		sig=0;
 		sigfillset(&signal_set);
+		for (size_t i=0; i < ncrash_signals; i++)
+			sigdelset(&signal_set, crash_signals[i]);
 		sigwait(&signal_set, &sig);
 		
-		{
-			pthread::mutexholder h(&sig_mutex);
-			handled_signal = sig;
-			DEBUGPRINT("SigHandle::handler() got signal: %d = %s\n", sig, strsignal(handled_signal));
+		dispatch(sig);
+	}
+}
+
+void SigHandle::fd_handler(int fd, uint32_t /* events */) {
+	// Read everything that is pending, several signals can arrive per event
+	struct signalfd_siginfo info[16];
+	ssize_t n;
+	while ((n = read(fd, info, sizeof info)) > 0) {
+		for (size_t i=0; i < n / sizeof(info[0]); i++) {
+			DEBUGPRINT("SigHandle::fd_handler() got signal %u from pid %u\n", info[i].ssi_signo, info[i].ssi_pid);
+			dispatch(info[i].ssi_signo);
+		}
+	}
+}
+
+void SigHandle::dispatch(const int sig) {
+	handler_t user;
+	bool quit=false, ign=false;
+	
+	{
+		pthread::mutexholder h(&sig_mutex);
+		handled_signal = sig;
+		DEBUGPRINT("SigHandle::dispatch() got signal: %d = %s\n", sig, strsignal(handled_signal));
+		
+		std::map<int, handler_t>::iterator it = handlers.find(sig);
+		if (it != handlers.end()) {
+			user = it->second;
+		} else {
 			// Decide what to do with the signal
 			switch (handled_signal) {
 					// These signals are dangerous, stop the program
@@ -79,13 +234,9 @@ void SigHandle::handler() {
 				case SIGINT:					// ctrl-c
 				case SIGTERM:					// normal shutdown
 					quit_count++;
-					DEBUGPRINT("SigHandle::handler() quitting sig %d (#%zu)\n", 
+					DEBUGPRINT("SigHandle::dispatch() quitting sig %d (#%zu)\n", 
 									handled_signal, quit_count);
-					quit_func();
-					
-					// If quit signal is received twice or more, brutally exit
-					if (quit_count > max_quit_count)
-						exit(handled_signal);
+					quit = true;
 					break;
 					// These signals are probably not fatal, ignore them
 				default:
@@ -95,14 +246,91 @@ void SigHandle::handler() {
 				case SIGALRM:					// Alarm clock (POSIX)
 				case SIGPROF:					// Profiling alarm clock (4.2 BSD)
 					ign_count++;
-					DEBUGPRINT("SigHandle::handler() ignoring sig %d (#%zu)\n", 
+					DEBUGPRINT("SigHandle::dispatch() ignoring sig %d (#%zu)\n", 
 									handled_signal, ign_count);
-					ign_func();
+					ign = true;
 					break;
 				case SIGQUIT:
 					throw format("Received SIGQUIT, throwing!");
 			}
 		}
 	}
+	
+	// Call slots without sig_mutex, so they can use get_sig() and sethandler()
+	if (!user.empty())
+		user(sig);
+	if (ign)
+		ign_func();
+	if (quit) {
+		quit_func();
+		// If quit signal is received twice or more, brutally exit
+		if (quit_count > max_quit_count)
+			exit(sig);
+	}
 }
 
+int SigHandle::altstack() {
+	stack_t ss;
+	ss.ss_sp = malloc(ALTSTACK_SIZE);
+	if (!ss.ss_sp)
+		return -1;
+	ss.ss_size = ALTSTACK_SIZE;
+	ss.ss_flags = 0;
+	return sigaltstack(&ss, NULL);
+}
+
+int SigHandle::crashhandler(const std::string &path) {
+	if (path.empty())
+		crashfd = STDERR_FILENO;
+	else if ((crashfd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+		return -1;
+	
+	// backtrace() loads libgcc on first use, which is not safe in the handler
+	void *frame;
+	backtrace(&frame, 1);
+	
+	if (altstack())
+		return -1;
+	
+	struct sigaction sa;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_sigaction = crash_handler;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
+	sigfillset(&sa.sa_mask);
+	
+	for (size_t i=0; i < ncrash_signals; i++)
+		if (sigaction(crash_signals[i], &sa, NULL))
+			return -1;
+	
+	return 0;
+}
+
+namespace {
+	pthread::mutex crashdumps_mutex;		//!< Serialises addcrashdump() and removecrashdump()
+}
+
+bool SigHandle::addcrashdump(const char *label, crashdump_t func, void *arg) {
+	pthread::mutexholder h(&crashdumps_mutex);
+	
+	// Reuse a removed slot, the crash handler skips it until func is set
+	size_t i = 0;
+	while (i < ncrashdumps && crashdumps[i].func)
+		i++;
+	if (i >= MAX_CRASHDUMPS)
+		return false;
+	
+	crashdumps[i].label = label;
+	crashdumps[i].arg = arg;
+	__atomic_store_n(&crashdumps[i].func, func, __ATOMIC_RELEASE);
+	if (i == ncrashdumps)
+		__atomic_store_n(&ncrashdumps, ncrashdumps + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+void SigHandle::removecrashdump(crashdump_t func, void *arg) {
+	pthread::mutexholder h(&crashdumps_mutex);
+	
+	for (size_t i=0; i < ncrashdumps; i++)
+		if (crashdumps[i].func == func && crashdumps[i].arg == arg)
+			__atomic_store_n(&crashdumps[i].func, (crashdump_t) NULL, __ATOMIC_RELEASE);
+}
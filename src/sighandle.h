@@ -28,33 +28,68 @@
 #include <sigc++/signal.h>
 #include <string>
 #include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <map>
 
 #include "pthread++.h"
+#include "eventloop.h"
 #include "utils.h"
 
 /*! Signal handling class 
  
  At the start (constructor), block all signals in main thread, which is 
- inherited in child threads. Then start a new signal handling thread in the 
- background which listens with sigwait() for any signal. Depending on the 
- signal received, call slot function ign_func() or quit_func(). 
+ inherited in child threads. Then signals are received in one of two ways:
  
- @section sigg_bugs Known bugs
+ - SigHandle(): start a new signal handling thread in the background which 
+   listens with sigwait() for any signal.
+ - SigHandle(loop): read the signals from a signalfd(2) registered in an 
+   EventLoop, so no thread of its own is needed. All pending signals are 
+   read at once, and real-time signals are queued by the kernel, so none are 
+   lost when several arrive at the same time.
  
- - Behaviour of this class is undefined when there are multiple signals waiting.
+ Either way the object must be created before any other threads, so that 
+ all of them inherit the blocked signal mask. Only one SigHandle can exist 
+ at a time (it receives all signals of the process), creating a second one 
+ throws SigHandle::exception.
+ 
+ Signals with a handler set with sethandler() are passed to that handler 
+ (e.g. SIGUSR1 to dump a PerfLog report, SIGHUP to reload a config). Other 
+ signals call slot function ign_func() or quit_func() depending on the 
+ signal received. 
+ 
+ Synchronous fault signals (SIGSEGV, SIGBUS, SIGFPE, SIGILL) and SIGABRT are 
+ never blocked, as they would not reach the handling thread anyway. 
+ Install crashhandler() to catch them: it writes a backtrace and the output 
+ of all functions registered with addcrashdump() (like Io::crashdump() and 
+ PerfLog::crashdump()) to a file opened in advance, then lets the default 
+ action (core dump) happen. It runs on an alternate signal stack, so stack 
+ overflows are caught as well. The alternate stack is per thread, call 
+ altstack() at the start of threads that should have one as well.
  */
 class SigHandle {
+	typedef sigc::slot<void, int> handler_t;
+	
   int handled_signal;				//!< Holds the last handled signal
 	
 	size_t ign_count;					//!< Amount of ignore signals received
 	size_t quit_count;				//!< Amount of quit signals received (used to check if quit is in progress)
 	size_t def_count;					//!< Amount of unknown signals received ('default' case in switch)
 	
-	pthread::mutex sig_mutex; //!< Mutex for handled_signal
+	pthread::mutex sig_mutex; //!< Mutex for handled_signal and handlers
+	std::map<int, handler_t> handlers; //!< User handlers per signal
+	
+	static void claim();							//!< Make sure we are the only SigHandle
+	void block(bool blockall);
+	void dispatch(const int sig);	//!< Handle one signal
 	
 	void handler();						//!< Signal handler routine, uses sigwait() to parse system signals
 	pthread::thread handler_thr; //!< Thread for handler()
 	
+	EventLoop *loop;					//!< Event loop we receive signals from, or NULL for handler_thr
+	int sigfd;								//!< signalfd registered with loop
+	void fd_handler(int fd, uint32_t events); //!< Read all pending signals from sigfd
+	
 public:
 	size_t max_quit_count;		//!< After this many quit signals, force a quit with exit(handled_signal)
 	
@@ -69,8 +104,45 @@ public:
 	int get_sig() { pthread::mutexholder h(&sig_mutex); return handled_signal; }
 	std::string get_sig_info() { pthread::mutexholder h(&sig_mutex); return strsignal(handled_signal); }
 	
+	void sethandler(const int sig, const handler_t &handler); //!< Call handler(sig) for signal sig instead of ign_func() or quit_func()
+	void clearhandler(const int sig);	//!< Remove handler for sig, back to the default handling
+	
   SigHandle(bool blockall=true);
+	SigHandle(EventLoop &loop, bool blockall=true); //!< Receive signals as events in loop
 	~SigHandle();
+	
+	// Crash handling, static as signal dispositions are per process
+	typedef void (*crashdump_t)(int fd, void *arg); //!< Must only use async-signal-safe calls
+	static int crashhandler(const std::string &path=""); //!< Install crash handler, dump to path (stderr if empty), returns -1 on error
+	static bool addcrashdump(const char *label, crashdump_t func, void *arg); //!< Call func(fd, arg) from the crash handler
+	static void removecrashdump(crashdump_t func, void *arg); //!< Undo addcrashdump(), before arg is destroyed
+	static int altstack();								//!< Give the calling thread an alternate signal stack
+	
+	//! Write string to fd, async-signal-safe
+	static void crash_write(const int fd, const char *str) { 
+		if (write(fd, str, strlen(str)) < 0) return;
+	}
+	//! Write signed number to fd, async-signal-safe
+	static void crash_write(const int fd, const int num) {
+		if (num < 0)
+			crash_write(fd, "-");
+		crash_write(fd, (uint64_t) (num < 0 ? -(int64_t) num : num));
+	}
+	//! Write number to fd, async-signal-safe
+	static void crash_write(const int fd, uint64_t num, const int base=10) {
+		char buf[24];
+		char *p = buf + sizeof buf;
+		do {
+			*--p = "0123456789abcdef"[num % base];
+			num /= base;
+		} while (num && p > buf);
+		if (write(fd, p, buf + sizeof buf - p) < 0) return;
+	}
+	
+	class exception: public std::runtime_error {
+		public:
+		exception(const std::string reason): runtime_error(reason) {}
+	};
 };
 
 #endif // HAVE_SIGHANDLE_H
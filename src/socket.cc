@@ -25,14 +25,19 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netdb.h>
 #include <syslog.h>
 #include <fcntl.h>
 #include <sys/poll.h>
 #include <poll.h>
+#include <stddef.h>
+#include <time.h>
 
 #include "socket.h"
+#include "pthread++.h"
 #include <string>
+#include <map>
 
 using namespace std;
 
@@ -66,34 +71,191 @@ bool Socket::setblocking(bool blocking) {
 	return !fcntl(fd, F_SETFL, flags);
 }
 
-bool Socket::connect(const string &host, const string &port) {
-	struct addrinfo *ai = NULL, *aip, hint = {0};
-	int err, tmpfd = -1;
+bool Socket::unixaddr(const string &address, struct sockaddr_un *addr) {
+	string path = address.substr(5);
 
-	close();
+	if(path.empty() || path.size() >= sizeof addr->sun_path) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
 
-	/* Resolve address for listening socket */
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	strncpy(addr->sun_path, path.c_str(), sizeof addr->sun_path - 1);
+	return true;
+}
+
+int Socket::dnsttl = 60;
+
+// Cache of getaddrinfo() results, keyed on "host port"
+typedef map<string, pair<time_t, vector<Socket::resolved> > > dnscache_t;
+static dnscache_t dnscache;
+static pthread::mutex dnsmutex;
+
+static time_t monotonic() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+// Callers may be cancelled (e.g. Protocol::Client), which must not happen 
+// with dnsmutex held or inside getaddrinfo() or the allocator
+bool Socket::lookup(const string &host, const string &port, vector<resolved> &result) {
+	int cancelstate;
+	pthread::setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+	const bool found = resolve(host, port, result);
+	pthread::setcancelstate(cancelstate);
+	return found;
+}
+
+bool Socket::resolve(const string &host, const string &port, vector<resolved> &result) {
+	const string key = host + ' ' + port;
+
+	if(dnsttl > 0) {
+		pthread::mutexholder h(&dnsmutex);
+		dnscache_t::iterator i = dnscache.find(key);
+		if(i != dnscache.end() && i->second.first > monotonic()) {
+			result = i->second.second;
+			return true;
+		}
+	}
+
+	struct addrinfo *ai = NULL, *aip, hint = {0};
 
 	hint.ai_family = AF_UNSPEC;
 	hint.ai_socktype = SOCK_STREAM;
 
-	err = getaddrinfo(host.c_str(), port.c_str(), &hint, &ai);
+	if(getaddrinfo(host.c_str(), port.c_str(), &hint, &ai) || !ai)
+		return false;
 
-	if(err || !ai)
+	result.clear();
+	for(aip = ai; aip; aip = aip->ai_next) {
+		resolved a;
+		if(aip->ai_addrlen > sizeof a.addr)
+			continue;
+		a.family = aip->ai_family;
+		a.socktype = aip->ai_socktype;
+		a.protocol = aip->ai_protocol;
+		a.addrlen = aip->ai_addrlen;
+		memcpy(&a.addr, aip->ai_addr, aip->ai_addrlen);
+		result.push_back(a);
+	}
+
+	freeaddrinfo(ai);
+
+	if(dnsttl > 0 && !result.empty()) {
+		pthread::mutexholder h(&dnsmutex);
+		dnscache[key] = make_pair(monotonic() + dnsttl, result);
+	}
+
+	return !result.empty();
+}
+
+void Socket::forget(const string &host, const string &port) {
+	int cancelstate;
+	pthread::setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+	{
+		pthread::mutexholder h(&dnsmutex);
+		dnscache.erase(host + ' ' + port);
+	}
+	pthread::setcancelstate(cancelstate);
+}
+
+bool Socket::connectto(const int tmpfd, const resolved &a, const int timeout) {
+	if(timeout < 0)
+		return !::connect(tmpfd, (const struct sockaddr *)&a.addr, a.addrlen);
+
+	if(a.family == AF_UNIX) {
+		// A Unix socket connects at once or blocks while the listen backlog is 
+		// full. Non-blocking it would fail right away instead, but the wait 
+		// honours the send timeout.
+		struct timeval tv = {timeout / 1000, (timeout % 1000) * 1000}, old;
+		socklen_t len = sizeof old;
+		if(!tv.tv_sec && !tv.tv_usec)
+			tv.tv_usec = 1;
+		getsockopt(tmpfd, SOL_SOCKET, SO_SNDTIMEO, &old, &len);
+		setsockopt(tmpfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+		bool ok = !::connect(tmpfd, (const struct sockaddr *)&a.addr, a.addrlen);
+		int err = errno;
+		setsockopt(tmpfd, SOL_SOCKET, SO_SNDTIMEO, &old, sizeof old);
+		errno = err == EAGAIN ? ETIMEDOUT : err;
+		return ok;
+	}
+
+	// Connect non-blocking, so an unreachable host costs at most timeout ms
+	int flags = fcntl(tmpfd, F_GETFL);
+	fcntl(tmpfd, F_SETFL, flags | O_NONBLOCK);
+
+	if(::connect(tmpfd, (const struct sockaddr *)&a.addr, a.addrlen)) {
+		if(errno != EINPROGRESS)
+			return false;
+
+		struct pollfd pfd = {tmpfd, POLLOUT};
+		int result;
+		do {
+			result = poll(&pfd, 1, timeout);
+		} while(result < 0 && errno == EINTR);
+
+		if(result <= 0) {
+			errno = result ? errno : ETIMEDOUT;
+			return false;
+		}
+
+		int err = 0;
+		socklen_t len = sizeof err;
+		if(getsockopt(tmpfd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+			errno = err ? err : errno;
+			return false;
+		}
+	}
+
+	fcntl(tmpfd, F_SETFL, flags);
+	return true;
+}
+
+bool Socket::connect(const string &host, const string &port, const int timeout) {
+	int tmpfd = -1;
+
+	close();
+
+	if(isunix(host)) {
+		struct sockaddr_un addr;
+		if(!unixaddr(host, &addr))
+			return false;
+
+		resolved a;
+		a.family = AF_UNIX;
+		a.socktype = SOCK_STREAM;
+		a.protocol = 0;
+		a.addrlen = sizeof addr;
+		memcpy(&a.addr, &addr, sizeof addr);
+
+		tmpfd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if(tmpfd == -1)
+			return false;
+
+		if(!connectto(tmpfd, a, timeout)) {
+			::close(tmpfd);
+			return false;
+		}
+
+		return (fd = tmpfd) >= 0;
+	}
+
+	/* Resolve address (or get it from the cache) */
+
+	vector<resolved> addrs;
+	if(!lookup(host, port, addrs))
 		return false;
 
 	/* Try all addresses until we find one that works */
 
-	for(aip = ai; aip; aip = aip->ai_next) {
-		tmpfd = ::socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol);
+	for(size_t i = 0; i < addrs.size(); i++) {
+		tmpfd = ::socket(addrs[i].family, addrs[i].socktype, addrs[i].protocol);
 		if(tmpfd == -1)
 			continue;
-		
-		int opt = 1;
-		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
 
-		err = ::connect(tmpfd, aip->ai_addr, aip->ai_addrlen);
-		if(err) {
+		if(!connectto(tmpfd, addrs[i], timeout)) {
 			::close(tmpfd);
 			tmpfd = -1;
 			continue;
@@ -102,7 +264,9 @@ bool Socket::connect(const string &host, const string &port) {
 		break;
 	}
 
-	freeaddrinfo(ai);
+	// The host might have moved, resolve again next time
+	if(tmpfd < 0)
+		forget(host, port);
 
 	return (fd = tmpfd) >= 0;
 }
@@ -113,6 +277,29 @@ void Socket::listen(const string &port) {
 
 	close();
 
+	if(isunix(port)) {
+		struct sockaddr_un addr;
+		if(!unixaddr(port, &addr))
+			throw exception((string)"Invalid unix socket " + port + ": " + strerror(errno));
+
+		fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd == -1)
+			throw exception((string)"Could not create socket for " + port + ": " + strerror(errno));
+
+		// Remove stale socket left behind by a previous instance
+		unlink(addr.sun_path);
+
+		if(::bind(fd, (struct sockaddr *)&addr, sizeof addr) || ::listen(fd, 1)) {
+			err = errno;
+			::close(fd);
+			fd = -1;
+			throw exception((string)"Could not listen on " + port + ": " + strerror(err));
+		}
+
+		unixpath = addr.sun_path;
+		return;
+	}
+
 	/* Resolve address for listening socket */
 
 	hint.ai_family = AF_UNSPEC;
@@ -152,6 +339,13 @@ void Socket::listen(const string &port) {
 string Socket::resolve(struct sockaddr *addr, socklen_t addrlen, int flags) {
 	char host[NI_MAXHOST], serv[NI_MAXSERV];
 
+	if(addr->sa_family == AF_UNIX) {
+		struct sockaddr_un *un = (struct sockaddr_un *)addr;
+		if(addrlen <= offsetof(struct sockaddr_un, sun_path) || !un->sun_path[0])
+			return "unix:";
+		return (string)"unix:" + string(un->sun_path, strnlen(un->sun_path, addrlen - offsetof(struct sockaddr_un, sun_path)));
+	}
+
 	if(getnameinfo(addr, addrlen, host, sizeof host, serv, sizeof serv, flags) < 0)
 		return "";
 	
@@ -198,6 +392,11 @@ void Socket::close() {
 	::close(fd);
 	fd = -1;
 	inlen = 0;
+
+	if(!unixpath.empty()) {
+		unlink(unixpath.c_str());
+		unixpath.clear();
+	}
 }
 
 bool Socket::gets(char *buf, const size_t len) {
@@ -346,6 +545,10 @@ bool Socket::write(const std::string str) {
 	return write(str.c_str(), str.size());
 }
 
+bool Socket::hasline() const {
+	return fd >= 0 && memchr(inbuf, '\n', inlen);
+}
+
 bool Socket::readavailable() const {
 	struct pollfd pfd = {fd, POLLIN};
 	return poll(&pfd, 1, 0);
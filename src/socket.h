@@ -23,17 +23,46 @@
 #include <stdarg.h>
 #include <stdexcept>
 #include <string>
+#include <vector>
 #include <format.h>
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 
 #define MAXBUFLEN 4096
 
+/*! @brief Stream socket, either TCP or Unix domain
+ 
+ Addresses starting with "unix:" refer to a Unix domain socket at the path 
+ that follows, i.e. connect("unix:/tmp/foam.sock", "") or 
+ listen("unix:/tmp/foam.sock"). This avoids the TCP stack for clients on the
+ same machine. Everything else is resolved with getaddrinfo().
+ 
+ Resolved addresses are cached for dnsttl seconds, so reconnecting clients 
+ do not block on DNS every time. The cache entry is dropped when none of its
+ addresses accept a connection.
+ */
 class Socket {
+public:
+	struct resolved {										//!< One getaddrinfo() result
+		int family, socktype, protocol;
+		socklen_t addrlen;
+		struct sockaddr_storage addr;
+	};
+
+private:
 	int fd;
 	size_t inlen;
 	char inbuf[MAXBUFLEN];
+	std::string unixpath;								//!< Unix domain socket path we listen on (removed on close())
+
+	static bool isunix(const std::string &address) { return address.compare(0, 5, "unix:") == 0; }
+	static bool unixaddr(const std::string &address, struct sockaddr_un *addr);
+	static bool lookup(const std::string &host, const std::string &port, std::vector<resolved> &result); //!< Cached resolve(), not cancellable
+	static bool resolve(const std::string &host, const std::string &port, std::vector<resolved> &result);
+	static void forget(const std::string &host, const std::string &port);
+	bool connectto(const int tmpfd, const resolved &a, const int timeout);
 
 	Socket(const int fd);
 
@@ -44,7 +73,8 @@ public:
 	~Socket();
 	bool setblocking(bool blocking = true);
 	void listen(const std::string &port);
-	bool connect(const std::string &host, const std::string &port);
+	//! Connect to host, give up after timeout ms (or the OS default if timeout < 0)
+	bool connect(const std::string &host, const std::string &port, const int timeout = -1);
 	Socket *accept() const;
 	void close();
 	bool gets(char *buf, const size_t len);
@@ -55,6 +85,7 @@ public:
 	bool printf(const char *format, ...);
 	std::string readline();
 	bool readline(std::string &line);
+	bool hasline() const;
 	bool readavailable() const ;
 	bool writeavailable() const ;
 	Socket &operator<<(const std::string line);
@@ -65,6 +96,8 @@ public:
 	std::string getpeername() const;
 	std::string getsockname() const;
 
+	static int dnsttl;									//!< Seconds to cache getaddrinfo() results (0 disables the cache)
+
 	class exception: public std::runtime_error {
 		public:
 		exception(const std::string reason): runtime_error(reason) {}
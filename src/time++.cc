@@ -21,6 +21,8 @@
 
 #include <time.h>
 #include <sys/time.h>
+#include <sched.h>
+#include <stdio.h>
 #ifndef __STDC_FORMAT_MACROS
 #define __STDC_FORMAT_MACROS
 #endif
@@ -38,52 +40,26 @@ using namespace std;
  * Constructors / destructor
  */
 
-Time::Time() {
+Time::Time(): t_tmstate(CACHE_EMPTY), t_strstate(CACHE_EMPTY) {
 	update();
 }
 
-Time::Time(const Time &stamp) {
-	epoch_t tmp = stamp.as_epoch_t();
-  
-	t_epoch.i = tmp.i;
-	t_epoch.f = tmp.f;
-	
-	sync();
+Time::Time(const Time &stamp): t(stamp.t), t_tmstate(CACHE_EMPTY), t_strstate(CACHE_EMPTY) {
 }
 
-Time::Time(const intmax_t i, const long double f) {
-	t_epoch.i = i;
-	t_epoch.f = f;
-	
-	sync();	
+Time::Time(const intmax_t i, const long double f): t(i * NSEC_PER_SEC + (int64_t) (f * 1e9)), t_tmstate(CACHE_EMPTY), t_strstate(CACHE_EMPTY) {
 }
 
-Time::Time(const time_t stamp) {
-	t_timeval.tv_sec = stamp;
-	t_timeval.tv_usec = 0;
-	
-	t_epoch.i = t_timeval.tv_sec;
-	t_epoch.f = 0.0;
-	
-	t_str_tm = gmtime(&(t_timeval.tv_sec));
+Time::Time(const time_t stamp): t(stamp * NSEC_PER_SEC), t_tmstate(CACHE_EMPTY), t_strstate(CACHE_EMPTY) {
 }
 
-Time::Time(const epoch_t stamp) {
-	t_timeval.tv_sec = stamp.i;
-	t_timeval.tv_usec = (suseconds_t) stamp.f * USEC_PER_SEC;
+Time::Time(const epoch_t stamp): t(stamp.i * NSEC_PER_SEC + (int64_t) (stamp.f * 1e9)), t_tmstate(CACHE_EMPTY), t_strstate(CACHE_EMPTY) {
+}
 
-	t_epoch = stamp;
-	
-	t_str_tm = gmtime(&(t_timeval.tv_sec));
+Time::Time(const struct timeval stamp): t(stamp.tv_sec * NSEC_PER_SEC + stamp.tv_usec * 1000), t_tmstate(CACHE_EMPTY), t_strstate(CACHE_EMPTY) {
 }
 
-Time::Time(const struct timeval stamp) {
-	t_timeval = stamp;
-	
-	t_epoch.i = t_timeval.tv_sec;
-	t_epoch.f = (long double) t_timeval.tv_usec / USEC_PER_SEC;
-	
-	t_str_tm = gmtime(&(t_timeval.tv_sec));
+Time::Time(const RealTime stamp): t(stamp), t_tmstate(CACHE_EMPTY), t_strstate(CACHE_EMPTY) {
 }
 
 Time::~Time() {
@@ -94,48 +70,20 @@ Time::~Time() {
  */
 
 void Time::update() {
-	gettimeofday(&t_timeval, NULL);
-	
-	t_str_tm = gmtime(&(t_timeval.tv_sec));
-	
-	t_epoch.i = t_timeval.tv_sec;
-	t_epoch.f = t_timeval.tv_usec * 1.0 / USEC_PER_SEC;
+	t = RealTime::now();
+	sync();
 	
-	DEBUGPRINT("%ju, %Lg\n", t_epoch.i, t_epoch.f);
+	DEBUGPRINT("%jd\n", (intmax_t) t.as_nsec());
 }
 
 Time Time::add(const Time &extra, int fac) {
-	DEBUGPRINT("%ju, %Lg\n", t_epoch.i, t_epoch.f);
-	epoch_t tmp = extra.as_epoch_t();
-
-	// Calculate new time
-	t_epoch.i += tmp.i * fac;
-	t_epoch.f += tmp.f * fac;
-	
-	// Check overflow of fractional seconds & correct
-	if (t_epoch.f >= 1) {
-		t_epoch.i += 1;
-		t_epoch.f -= 1;
-	} else if (t_epoch.f < 0) {
-		t_epoch.i -= 1;
-		t_epoch.f += 1;
-	}
-	
+	t += extra.t.since_epoch() * fac;
 	sync();
 	
-	DEBUGPRINT("%ju, %Lg\n", t_epoch.i, t_epoch.f);
+	DEBUGPRINT("%jd\n", (intmax_t) t.as_nsec());
 	return *this;
 }
 
-void Time::sync() {
-	DEBUGPRINT("%ju, %Lg\n", t_epoch.i, t_epoch.f);
-	
-	t_timeval.tv_sec = t_epoch.i;
-	t_timeval.tv_usec = (suseconds_t) (t_epoch.f * USEC_PER_SEC);
-	
-	t_str_tm = gmtime(&(t_timeval.tv_sec));
-}
-
 /* 
  * Operator overloading
  */
@@ -163,21 +111,63 @@ Time Time::operator-=(const Time& rhs) {
  * Report functions
  */
 
-time_t Time::as_time_t() const { return t_timeval.tv_sec; }
-Time::epoch_t Time::as_epoch_t() const { return t_epoch; }
-struct tm* Time::as_str_tm() const { return t_str_tm; }
-struct timeval Time::as_str_tv() const { return t_timeval; }
+time_t Time::as_time_t() const { return t.as_time_t(); }
+
+Time::epoch_t Time::as_epoch_t() const { 
+	struct timespec ts = t.as_timespec();
+	return epoch_t(ts.tv_sec, ts.tv_nsec / 1e9L);
+}
+
+bool Time::claim(int *state) {
+	while (true) {
+		int s = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+		if (s == CACHE_VALID)
+			return false;
+		if (s == CACHE_EMPTY && __atomic_compare_exchange_n(state, &s, (int) CACHE_BUSY, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return true;
+		// Another thread is filling the cache, that takes microseconds
+		sched_yield();
+	}
+}
+
+struct tm* Time::as_str_tm() const { 
+	if (claim(&t_tmstate)) {
+		t_tm = t.as_tm();
+		__atomic_store_n(&t_tmstate, (int) CACHE_VALID, __ATOMIC_RELEASE);
+	}
+	return &t_tm;
+}
+
+struct tm* Time::as_str_tm(struct tm *out) const { 
+	*out = t.as_tm();
+	return out;
+}
+
+struct timeval Time::as_str_tv() const { 
+	struct timespec ts = t.as_timespec();
+	struct timeval tv;
+	tv.tv_sec = ts.tv_sec;
+	tv.tv_usec = ts.tv_nsec / 1000;
+	return tv;
+}
+
 string Time::str() const { 
-	DEBUGPRINT("%ju, %Lg\n", t_epoch.i, t_epoch.f);
-	return format("%d.%09d", t_epoch.i, (int) (t_epoch.f * 1E9)); 
+	struct timespec ts = t.as_timespec();
+	return format("%jd.%09ld", (intmax_t) ts.tv_sec, (long) ts.tv_nsec); 
 }
+
 const char *Time::c_str() const { 
-	DEBUGPRINT("%ju, %Lg\n", t_epoch.i, t_epoch.f);
-	return format("%d.%09d", t_epoch.i, (int) (t_epoch.f * 1E9)).c_str();
+	if (claim(&t_strstate)) {
+		struct timespec ts = t.as_timespec();
+		snprintf(t_str, sizeof t_str, "%jd.%09ld", (intmax_t) ts.tv_sec, (long) ts.tv_nsec);
+		__atomic_store_n(&t_strstate, (int) CACHE_VALID, __ATOMIC_RELEASE);
+	}
+	return t_str;
 }
 
 string Time::strftime(string fmt) const {
 	char buf[128];
-	::strftime(buf, sizeof(buf), fmt.c_str(), t_str_tm);
+	struct tm tm;
+	::strftime(buf, sizeof(buf), fmt.c_str(), as_str_tm(&tm));
 	return string(buf);
 }
@@ -21,6 +21,7 @@
 #define HAVE_TIMEPP_H
 
 #include <sys/time.h>
+#include <time.h>
 #ifndef __STDC_FORMAT_MACROS
 #define __STDC_FORMAT_MACROS
 #endif
@@ -30,9 +31,110 @@
 
 using namespace std;
 const double USEC_PER_SEC = 1000000.0; //!< Conversion factor
+const int64_t NSEC_PER_SEC = 1000000000; //!< Conversion factor
+
+#if __cplusplus >= 201103L
+#define TIMEPP_CONSTEXPR constexpr
+#else
+#define TIMEPP_CONSTEXPR inline
+#endif
+
+/*!
+ @brief Time interval in integer nanoseconds
+ 
+ Covers +-292 years with exact arithmetic and no normalisation, everything 
+ is inline (constexpr with C++11).
+ */
+class Duration {
+	int64_t ns;
+	
+public:
+	TIMEPP_CONSTEXPR explicit Duration(const int64_t ns=0): ns(ns) { }
+	Duration(const struct timespec &ts): ns(ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec) { }
+	
+	static TIMEPP_CONSTEXPR Duration nsec(const int64_t n) { return Duration(n); }
+	static TIMEPP_CONSTEXPR Duration usec(const int64_t n) { return Duration(n * 1000); }
+	static TIMEPP_CONSTEXPR Duration msec(const int64_t n) { return Duration(n * 1000000); }
+	static TIMEPP_CONSTEXPR Duration sec(const int64_t n) { return Duration(n * NSEC_PER_SEC); }
+	static TIMEPP_CONSTEXPR Duration fsec(const double s) { return Duration((int64_t) (s * 1e9)); } //!< From fractional seconds
+	
+	TIMEPP_CONSTEXPR int64_t as_nsec() const { return ns; }
+	TIMEPP_CONSTEXPR int64_t as_usec() const { return ns / 1000; }
+	TIMEPP_CONSTEXPR int64_t as_msec() const { return ns / 1000000; }
+	TIMEPP_CONSTEXPR double as_sec() const { return ns * 1e-9; }
+	struct timespec as_timespec() const { 
+		struct timespec ts;
+		ts.tv_sec = ns / NSEC_PER_SEC;
+		ts.tv_nsec = ns % NSEC_PER_SEC;
+		if (ts.tv_nsec < 0) { ts.tv_sec--; ts.tv_nsec += NSEC_PER_SEC; }
+		return ts;
+	}
+	
+	TIMEPP_CONSTEXPR Duration operator+(const Duration &rhs) const { return Duration(ns + rhs.ns); }
+	TIMEPP_CONSTEXPR Duration operator-(const Duration &rhs) const { return Duration(ns - rhs.ns); }
+	TIMEPP_CONSTEXPR Duration operator-() const { return Duration(-ns); }
+	TIMEPP_CONSTEXPR Duration operator*(const int64_t f) const { return Duration(ns * f); }
+	TIMEPP_CONSTEXPR Duration operator/(const int64_t d) const { return Duration(ns / d); }
+	TIMEPP_CONSTEXPR int64_t operator/(const Duration &d) const { return ns / d.ns; }
+	Duration &operator+=(const Duration &rhs) { ns += rhs.ns; return *this; }
+	Duration &operator-=(const Duration &rhs) { ns -= rhs.ns; return *this; }
+	
+	TIMEPP_CONSTEXPR bool operator==(const Duration &b) const { return ns == b.ns; }
+	TIMEPP_CONSTEXPR bool operator!=(const Duration &b) const { return ns != b.ns; }
+	TIMEPP_CONSTEXPR bool operator<(const Duration &b) const { return ns < b.ns; }
+	TIMEPP_CONSTEXPR bool operator<=(const Duration &b) const { return ns <= b.ns; }
+	TIMEPP_CONSTEXPR bool operator>(const Duration &b) const { return ns > b.ns; }
+	TIMEPP_CONSTEXPR bool operator>=(const Duration &b) const { return ns >= b.ns; }
+};
+
+/*!
+ @brief Point in time on clock CLOCK, as integer nanoseconds since its epoch
+ 
+ Use MonoTime (CLOCK_MONOTONIC) to measure intervals and schedule loops, 
+ it never jumps. Use RealTime (CLOCK_REALTIME) for wall-clock timestamps. 
+ Points of different clocks cannot be mixed. The broken-down time is only 
+ computed when asked for, with gmtime_r().
+ */
+template <clockid_t CLOCK> class TimePoint {
+	int64_t ns;
+	
+public:
+	TIMEPP_CONSTEXPR explicit TimePoint(const int64_t ns=0): ns(ns) { }
+	TimePoint(const struct timespec &ts): ns(ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec) { }
+	
+	static TimePoint now() { struct timespec ts; clock_gettime(CLOCK, &ts); return TimePoint(ts); }
+	
+	TIMEPP_CONSTEXPR Duration since_epoch() const { return Duration(ns); }
+	TIMEPP_CONSTEXPR int64_t as_nsec() const { return ns; }
+	struct timespec as_timespec() const { return Duration(ns).as_timespec(); }
+	time_t as_time_t() const { return as_timespec().tv_sec; }
+	struct tm as_tm() const { struct tm out; time_t t = as_time_t(); gmtime_r(&t, &out); return out; } //!< UTC broken-down time (CLOCK_REALTIME only)
+	
+	TIMEPP_CONSTEXPR TimePoint operator+(const Duration &d) const { return TimePoint(ns + d.as_nsec()); }
+	TIMEPP_CONSTEXPR TimePoint operator-(const Duration &d) const { return TimePoint(ns - d.as_nsec()); }
+	TIMEPP_CONSTEXPR Duration operator-(const TimePoint &b) const { return Duration(ns - b.ns); }
+	TimePoint &operator+=(const Duration &d) { ns += d.as_nsec(); return *this; }
+	TimePoint &operator-=(const Duration &d) { ns -= d.as_nsec(); return *this; }
+	
+	TIMEPP_CONSTEXPR bool operator==(const TimePoint &b) const { return ns == b.ns; }
+	TIMEPP_CONSTEXPR bool operator!=(const TimePoint &b) const { return ns != b.ns; }
+	TIMEPP_CONSTEXPR bool operator<(const TimePoint &b) const { return ns < b.ns; }
+	TIMEPP_CONSTEXPR bool operator<=(const TimePoint &b) const { return ns <= b.ns; }
+	TIMEPP_CONSTEXPR bool operator>(const TimePoint &b) const { return ns > b.ns; }
+	TIMEPP_CONSTEXPR bool operator>=(const TimePoint &b) const { return ns >= b.ns; }
+};
+
+typedef TimePoint<CLOCK_MONOTONIC> MonoTime;
+typedef TimePoint<CLOCK_REALTIME> RealTime;
 
 /*!
  @brief Implements easier time-handling. The goal is convenience, not absolute accuracy.
+ 
+ Time is stored as a RealTime (integer nanoseconds since the epoch), the 
+ broken-down time for as_str_tm() and the string for c_str() are computed 
+ when first needed. Const methods can be called from several threads at 
+ once: the first caller fills the cache and publishes it atomically. Use 
+ as_str_tm(&tm) to get a copy that stays valid when the Time changes.
  */
 class Time {
 public:
@@ -45,14 +147,18 @@ public:
 	
 private:
 	
-	// Raw time containers
-	struct timeval t_timeval;
-	struct tm *t_str_tm;
+	RealTime t;													//!< Current time (our main clock)
+	
+	mutable struct tm t_tm;							//!< Broken-down time, valid if t_tmstate is CACHE_VALID
+	mutable int t_tmstate;							//!< CACHE_* (atomic)
+	mutable char t_str[32];							//!< Storage for c_str(), valid if t_strstate is CACHE_VALID
+	mutable int t_strstate;							//!< CACHE_* (atomic)
 	
-	epoch_t t_epoch;										//!< Current time (our main clock)
+	enum { CACHE_EMPTY=0, CACHE_BUSY, CACHE_VALID };
+	static bool claim(int *state);			//!< Wait until *state is CACHE_VALID (returns false), or claim an empty cache (returns true)
 	
 	Time add(const Time &extra, int fac=1); //!< Add 'extra' to current time
-	void sync();												//!< Sync other timestamps from t_epoch (our main clock)
+	void sync() { t_tmstate = t_strstate = CACHE_EMPTY; } //!< Invalidate derived representations after changing t
 	
 public:
 	Time();															//!< New current Time()
@@ -61,31 +167,35 @@ public:
 	Time(const time_t stamp);						//!< New Time() based on time_t
 	Time(const epoch_t stamp);					//!< New Time() based on epoch_t
 	Time(const struct timeval stamp);		//!< New Time() based on struct timeval
+	Time(const RealTime stamp);					//!< New Time() based on RealTime
 	~Time();
 	
-	inline bool operator!=(const Time &b) const { return (b.as_epoch_t().i != this->as_epoch_t().i || b.as_epoch_t().f != this->as_epoch_t().f); }
-	inline bool operator==(const Time &b) const { return (b.as_epoch_t().i == this->as_epoch_t().i && b.as_epoch_t().f == this->as_epoch_t().f); }
+	Time &operator=(const Time &b) { t = b.t; sync(); return *this; }
+	inline bool operator!=(const Time &b) const { return t != b.t; }
+	inline bool operator==(const Time &b) const { return t == b.t; }
 	Time operator+(const Time& rhs) const;
 	Time operator+=(const Time& rhs);
 	Time operator-(const Time& rhs) const;
 	Time operator-=(const Time& rhs);
 
-	Time operator-() { t_epoch.i *= -1; t_epoch.f *= -1; sync(); return *this; }
+	Time operator-() { t = RealTime(-t.as_nsec()); sync(); return *this; }
 	Time operator+() { return *this; }
 
-  double operator/(const double& rhs) { return (t_epoch.i/rhs) + (t_epoch.f/rhs); }
+  double operator/(const double& rhs) { return (t.as_nsec() * 1e-9) / rhs; }
 
-	Time operator--() { t_epoch.i -= 1; sync(); return *this; }
-	Time operator++() { t_epoch.i += 1; sync(); return *this; }
+	Time operator--() { t -= Duration::sec(1); sync(); return *this; }
+	Time operator++() { t += Duration::sec(1); sync(); return *this; }
 
 	void update();											//!< Update current stored time
 	
 	time_t as_time_t() const;						//!< Return time as time_t
 	epoch_t as_epoch_t() const;					//!< Return time as epoch_t
-	struct tm* as_str_tm() const;				//!< Return time as struct tm
+	RealTime as_realtime() const { return t; } //!< Return time as RealTime
+	struct tm* as_str_tm() const;				//!< Return time as struct tm (valid as long as this object is unchanged)
+	struct tm* as_str_tm(struct tm *out) const; //!< Store time as struct tm in out, returns out
 	struct timeval as_str_tv() const;		//!< Return time as struct timeval
 	string str() const;									//!< Return seconds since epoch as string (with 9 decimals)
-	const char* c_str() const;					//!< Return seconds since epoch as string (with 9 decimals)
+	const char* c_str() const;					//!< Return seconds since epoch as string (with 9 decimals, valid as long as this object is unchanged)
 	
 	string strftime(string fmt) const;	//!< Time++ wrapper for strftime()
 	
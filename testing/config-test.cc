@@ -22,19 +22,43 @@
 #define __STDC_LIMIT_MACROS
 #endif
 #include <stdint.h>
+#include <unistd.h>
 #include <string>
+#include <sigc++/signal.h>
 
 #include "libsiu-testing.h"
 
 #include "config.h"
+#include "pthread++.h"
 
 #define TMPFILE "/tmp/config-test"
 
+static int nchanged = 0;
+
+void changed(std::string /* var */) {
+	nchanged++;
+}
+
 void error(string what) {
 	fprintf(stderr, "config-test.cc: ERROR for %s\n", what.c_str());
 	exit(-1);
 }
 
+// Read a handle while the main thread sets it, values only grow
+static config::handle *counter;
+static bool counting = true;
+static int counter_errors = 0;
+
+void count_reader() {
+	int prev = 0;
+	while (__atomic_load_n(&counting, __ATOMIC_ACQUIRE)) {
+		int v = counter->getint();
+		if (v < prev || counter->getstring() == "")
+			counter_errors++;
+		prev = v;
+	}
+}
+
 int main(int /* argc */, char *argv[]) {
 	DEBUGPRINT("testing %s\n", argv[0]);
 	
@@ -117,6 +141,70 @@ int main(int /* argc */, char *argv[]) {
 	for(map<string, string>::const_iterator i = all.begin(); i != all.end(); ++i)
 		DEBUGPRINT("%s = %s\n", i->first.c_str(), i->second.c_str());
 
+	// Prefixed lookups and handles
+	config *cfgp = new config(TMPFILE, "cfg1");
+	if (cfgp->getstring("name") != "cfg1") error("prefix getstring");
+	if (cfgp->getint("size") != 2) error("prefix getint");
+	if (cfgp->exists("cfg1.name")) error("prefix exists");
+	cfgp->set("enabled", true);
+	if (!cfgp->getbool("enabled")) error("prefix getbool");
+	
+	config::handle size = cfgp->gethandle("size");
+	cfgp->prefix = "cfg2";
+	if (cfgp->getint("size") != 3) error("prefix change");
+	cfgp->prefix = "cfg1";
+	cfgp->set("size", 5);
+	if (size.getint() != 5 || size.getdouble() != 5.0) error("handle");
+	
+	// Live reload: rewrite the file behind cfgp's back
+	cfgp->prefix = "";
+	cfgp->slot_changed = sigc::ptr_fun(changed);
+	if (!cfgp->watch()) error("watch");
+	{
+		config other;
+		other.set("cfg1.size", 7);
+		other.set("cfg1.name", (std::string)"cfg1");
+		other.write(TMPFILE ".new");
+		rename(TMPFILE ".new", TMPFILE);
+	}
+	for (int i=0; i < 200 && nchanged < 1; i++)
+		usleep(10000);
+	cfgp->unwatch();
+	// cfg1.size changed, the 14 other variables except cfg1.name were removed
+	if (size.getint() != 7) error("reload");
+	if (!size.valid() || cfgp->exists("cfg2.name")) error("reload remove");
+	if (nchanged != 15) error(format("reload changed (%d)", nchanged));
+	
+	// Copies do not share variables
+	config copy(*cfgp);
+	cfgp->set("cfg1.size", 8);
+	if (copy.getint("cfg1.size") != 7 || cfgp->getint("cfg1.size") != 8) error("copy");
+	if (copy.gethandle("cfg1.size").getint() != 7 || copy.get_numentries() != 2) error("copy handle");
+	config assigned;
+	assigned.set("other", 1);
+	assigned = copy;
+	copy.set("cfg1.name", (std::string) "copy");
+	if (assigned.getstring("cfg1.name") != "cfg1" || assigned.exists("other")) error("assign");
+	if (assigned.filename != TMPFILE || copy.getstring("cfg1.name") != "copy") error("assign settings");
+	
+	// Values are replaced in place while other threads read them
+	copy.set("count", 1);
+	config::handle count = copy.gethandle("count");
+	counter = &count;
+	pthread::thread reader;
+	reader.create(sigc::ptr_fun(count_reader));
+	for (int i=2; i<=2000; i++)
+		copy.set("count", i);
+	__atomic_store_n(&counting, false, __ATOMIC_RELEASE);
+	reader.join();
+	if (counter_errors || count.getint() != 2000) error(format("concurrent set (%d errors)", counter_errors));
+	
+	delete cfgp;
+	delete cfgre;
+	delete cfga;
+	delete cfg1;
+	delete cfg2;
+
 	DEBUGPRINT("everything %s\n", "ok");
 	return 0;
 }
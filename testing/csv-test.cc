@@ -51,10 +51,71 @@ int main(int /* argc */, char *argv[]) {
 	DEBUGPRINT("reading %s\n", "csv-test-empty.csv");
 	Csv reempty("csv-test-empty.csv");
 	
+	if (reempty.nrows != 3 || reempty.ncols != 10 || reempty.csvdata.size() != 3) {
+		fprintf(stderr, "csv-test.cc: ERROR: read %zu x %zu\n", reempty.nrows, reempty.ncols);
+		return -1;
+	}
+	
+	// Values should survive a write/read cycle exactly
+	for (size_t i=0; i<line.size(); i++)
+		if (reempty.data[i] != line[i]) {
+			fprintf(stderr, "csv-test.cc: ERROR: %.17g read back as %.17g\n", line[i], reempty.data[i]);
+			return -1;
+		}
+	
+	// Parsing in multiple threads should give identical results
+	Csv multi;
+	if (!multi.load("csv-test-empty.csv", 4) || multi.data != reempty.data) {
+		fprintf(stderr, "csv-test.cc: ERROR: threaded load() differs\n");
+		return -1;
+	}
+	
 	DEBUGPRINT("writing %s\n", "csv-test-reempty.csv");
 	if (!reempty.write("csv-test-reempty.csv", "testing Csv 2."))
 		DEBUGPRINT("error writing %s\n", "csv-test-reempty.csv");
 
+	// Streaming writer, writing from a background thread
+	{
+		CsvWriter log("csv-test-log.csv", false, true, 4096);
+		log.comment("i,x");
+		for (int i = 0; i < 10000; i++) {
+			log.addcell((int64_t) i);
+			log.addcell(line[i % line.size()] * i);
+			log.endrow();
+		}
+	}
+	Csv relog;
+	if (!relog.load("csv-test-log.csv") || relog.nrows != 10000 || relog.get(9999, 1) != line[9999 % line.size()] * 9999) {
+		fprintf(stderr, "csv-test.cc: ERROR: CsvWriter\n");
+		return -1;
+	}
+	
+	// Columnar storage: integer and double columns with names
+	Csv cols;
+	vector<int64_t> idx;
+	vector<double> val, whole;
+	for (int i = 0; i < 100; i++) {
+		idx.push_back(((int64_t) 1 << 40) + i);
+		val.push_back(i * 0.25);
+		whole.push_back(i);
+	}
+	cols.addcolumn("idx", idx);
+	cols.addcolumn("val", val);
+	cols.addcolumn("whole", whole);
+	if (!cols.write("csv-test-cols.csv", "testing columns."))
+		DEBUGPRINT("error writing %s\n", "csv-test-cols.csv");
+	
+	Csv recols;
+	recols.columnar = true;
+	recols.read("csv-test-cols.csv");
+	// A double column with only whole numbers stays a double column
+	size_t ci = recols.findcolumn("idx"), cv = recols.findcolumn("val"), cw = recols.findcolumn("whole");
+	if (recols.nrows != 100 || ci != 0 || cv != 1 || cw != 2 || !recols.getint(ci) || !recols.getdouble(cv) || !recols.getdouble(cw) ||
+			recols.getint(ci)[99] != idx[99] || recols.getdouble(cv)[99] != val[99] || recols.getdouble(cw)[99] != 99) {
+		fprintf(stderr, "csv-test.cc: ERROR: columnar read\n");
+		return -1;
+	}
+
 #if HAVE_GSL
 	DEBUGPRINT("testing GSL constructor%s\n", "");
 	gsl_vector_float *data;
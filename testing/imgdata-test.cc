@@ -24,8 +24,10 @@
 #endif
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #include "imgdata.h"
+#include "csv.h"
 
 int main(int argc, char *argv[]) {
 	printf("imgdata-test.cc\n");
@@ -68,16 +70,30 @@ int main(int argc, char *argv[]) {
 		
 		int w = 256;
 		int h = 128;
-		uint16_t *data = (uint16_t *) malloc(w*h);
+		uint16_t *data = (uint16_t *) malloc(w*h*sizeof(uint16_t));
 		for (int j=0; j<h; j++)
 			for (int i=0; i<w; i++)
 				data[j*w + i] = drand48()*j*10;
 		
 		for (int x=0; x<15; x++)
 			data[x] = 0;
-		
-		
-		
+		free(data);
+	}
+	
+	// No-copy view of columnar Csv data: nrows x ncolumns, 64 bits per value
+	Csv cols;
+	std::vector<double> c0, c1;
+	for (int i=0; i<100; i++) {
+		c0.push_back(i);
+		c1.push_back(i * 0.5);
+	}
+	cols.addcolumn("a", c0);
+	cols.addcolumn("b", c1);
+	ImgData view(io);
+	if (view.setdata(cols, FLOAT64) || view.getbpp() != 64 || view.getsize() != 100 * 2 * sizeof(double) ||
+			view.getdata() != cols.getdouble(0) || view.getpixel(99, 1) != 49.5) {
+		fprintf(stderr, "imgdata-test.cc: ERROR: Csv view\n");
+		return -1;
 	}
 	
 	return 0;
@@ -0,0 +1,175 @@
+/*
+ imgpipe-test.cc -- Test ImgPipeline, ImgCombine and ImgStack
+ Copyright (C) 2012 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+
+#include <sigc++/sigc++.h>
+
+#include "io.h"
+#include "imgdata.h"
+#include "imgpipe.h"
+#include "path++.h"
+#include "format.h"
+
+#include "libsiu-testing.h"
+
+static const size_t W = 64, H = 48, NFRAMES = 12;
+
+// Invert all pixels in place
+static ImgData *invert(ImgData *img, size_t /* idx */) {
+	uint8_t *d = (uint8_t *) img->getdata();
+	for (size_t p=0; p<img->getnel(); p++)
+		d[p] = 255 - d[p];
+	return img;
+}
+
+// Drop every frame
+static ImgData *drop(ImgData * /* img */, size_t /* idx */) {
+	return NULL;
+}
+
+int main(int /* argc */, char *argv[]) {
+	DEBUGPRINT("testing %s\n", argv[0]);
+	Io io(2);
+
+	char tmpl[] = "/tmp/imgpipe-test.XXXXXX";
+	if (!mkdtemp(tmpl))
+		return -1;
+	Path dir(tmpl), outdir = dir + "out";
+	mkdir(outdir.c_str(), 0755);
+
+	// Frame i has pixel value x + i
+	for (size_t i=0; i<NFRAMES; i++) {
+		uint8_t *d = (uint8_t *) malloc(W * H);
+		for (size_t y=0; y<H; y++)
+			for (size_t x=0; x<W; x++)
+				d[y*W + x] = x + i;
+		size_t dims[2] = {W, H};
+		ImgData img(io);
+		img.setdata(d, 2, dims, UINT8, 8);
+		if (img.writedata(dir + format("frame%02zu.pgm", i), ImgData::PGM, true))
+			return -1;
+	}
+	std::vector<Path> files = dir.glob("*.pgm");
+	files.push_back(dir + "missing.pgm");
+
+	ImgCombine mean(io, ImgCombine::MEAN), median(io, ImgCombine::MEDIAN), stack(io, ImgCombine::STACK);
+
+	ImgPipeline pipe(io, 2, 2, 4);
+	pipe.slot_compute = sigc::ptr_fun(invert);
+	pipe.slot_write = sigc::mem_fun(mean, &ImgCombine::add);
+	pipe.setoutput(outdir, ImgData::PGM, true);
+	pipe.setperflog(0.1, false);
+	int nfailed = pipe.run(files);
+
+	ImgPipeline::stats_t st = pipe.getstats();
+	printf("%zu files: %zu read, %zu computed, %zu written, %zu failed in %.3f s\n",
+				 files.size(), st.nread, st.ncomputed, st.nwritten, st.nfailed, st.seconds);
+	if (nfailed != 1 || st.nread != NFRAMES || st.ncomputed != NFRAMES || st.nwritten != NFRAMES)
+		return -1;
+	if (outdir.glob("*.pgm").size() != NFRAMES)
+		return -1;
+
+	// Mean of 255 - (x + i) over i = 0..11 is 255 - x - 5.5
+	ImgData *m = mean.result();
+	printf("mean: %zu frames, (0,0) = %g, (10,5) = %g\n", mean.getnframes(), m->getpixel(0, 0), m->getpixel(10, 5));
+	if (mean.getnframes() != NFRAMES || m->getpixel(0, 0) != 249.5 || m->getpixel(10, 5) != 239.5)
+		return -1;
+	delete m;
+
+	// Reprocess the inverted output without computing, into the median and stack
+	ImgPipeline pipe2(io);
+	pipe2.slot_write = sigc::mem_fun(median, &ImgCombine::add);
+	if (pipe2.run(outdir.glob("*.pgm")))
+		return -1;
+	m = median.result();
+	printf("median: %zu frames, (0,0) = %g, (3,7) = %g\n", median.getnframes(), m->getpixel(0, 0), m->getpixel(3, 7));
+	if (m->getpixel(0, 0) != 249.5 || m->getpixel(3, 7) != 246.5)
+		return -1;
+	delete m;
+
+	pipe2.slot_write = sigc::mem_fun(stack, &ImgCombine::add);
+	pipe2.run(files);
+	m = stack.result();
+	printf("stack: %d dims, %zu pixels, (5,0,7) = %g\n", m->getndims(), m->getnel(), m->getpixel(5, 0, 7));
+	if (m->getndims() != 3 || m->getnel() != W * H * NFRAMES || m->getpixel(5, 0, 7) != 12)
+		return -1;
+	delete m;
+
+	// Dropped frames do not reach the write stage
+	ImgPipeline pipe3(io, 1, 1);
+	pipe3.slot_compute = sigc::ptr_fun(drop);
+	pipe3.run(files);
+	if (pipe3.getstats().ncomputed != 0 || pipe3.getstats().nwritten != 0)
+		return -1;
+
+	// Banded stacking, with room for 5 rows of all frames per band and thread
+	ImgStack stk(io, 2, 3 * 5 * W * NFRAMES * sizeof(float));
+	m = stk.stack(dir.glob("*.pgm"), ImgStack::MEDIAN);
+	printf("ImgStack median: (0,0) = %g, (10,47) = %g\n", m->getpixel(0, 0), m->getpixel(10, 47));
+	if (m->getwidth() != W || m->getheight() != H || m->getpixel(0, 0) != 5.5 || m->getpixel(10, 47) != 15.5)
+		return -1;
+	delete m;
+	m = stk.stack(dir.glob("*.pgm"), ImgStack::SIGMACLIP);
+	printf("ImgStack sigma-clip: (63,20) = %g\n", m->getpixel(63, 20));
+	if (m->getpixel(63, 20) != 68.5)
+		return -1;
+	delete m;
+	if (stk.stack(files, ImgStack::MEDIAN))
+		return -1;
+
+	// One outlier is rejected, the median takes the middle of up to 17 values
+	float v[] = {10, 11, 9, 10, 100, 10, 9, 11};
+	if (ImgStack::sigmaclip(v, 8, 3.0, 5) != 10)
+		return -1;
+	float w[17];
+	for (int i=0; i<17; i++)
+		w[i] = (i * 7) % 17;
+	if (ImgStack::median(w, 17) != 8)
+		return -1;
+	for (int i=0; i<17; i++)
+		w[i] = (i * 7) % 17;
+	if (ImgStack::median(w, 16) != 7.5)
+		return -1;
+	// All sizes of the sorting network
+	for (size_t n=1; n<=16; n++) {
+		float u[16], s[16];
+		for (size_t i=0; i<n; i++)
+			u[i] = s[i] = (i * 7) % 17;
+		std::sort(s, s + n);
+		if (ImgStack::median(u, n) != (n % 2 ? s[n/2] : (s[n/2-1] + s[n/2]) / 2) || !std::equal(u, u + n, s))
+			return -1;
+	}
+
+	std::vector<Path> out = outdir.glob("*");
+	for (size_t i=0; i<out.size(); i++)
+		unlink(out[i].c_str());
+	rmdir(outdir.c_str());
+	for (size_t i=0; i<files.size(); i++)
+		unlink(files[i].c_str());
+	rmdir(dir.c_str());
+
+	return 0;
+}
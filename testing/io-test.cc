@@ -18,6 +18,9 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "io.h"
 
@@ -83,6 +86,36 @@ int main() {
 	}
 	
 	delete io;
+	
+	// Logfile lines are timestamped with the clock set by setclock()
+	char logname[] = "/tmp/io-test-XXXXXX";
+	close(mkstemp(logname));
+	io = new Io(3);
+	io->setclock(Clock::MONOTONIC);
+	io->setLogfile(Path(logname));
+	const double before = Clock::nsec(Clock::MONOTONIC) / 1e9;
+	io->msg(IO_INFO, "Stamped");
+	delete io;
+	const double after = Clock::nsec(Clock::MONOTONIC) / 1e9;
+	
+	// Io's own "Stopping Io" line may come first
+	FILE *logfd = fopen(logname, "r");
+	double stamp = -1;
+	char line[256] = "";
+	if (!logfd) {
+		printf("io-test.cc: Error: could not read logfile %s\n", logname);
+		return -1;
+	}
+	while (strcmp(line, "[info] Stamped") && fscanf(logfd, " %lf %255[^\n]", &stamp, line) == 2)
+		;
+	fclose(logfd);
+	unlink(logname);
+	printf("io-test.cc: logfile line: %.6f %s\n", stamp, line);
+	if (stamp < before - 1e-6 || stamp > after || strcmp(line, "[info] Stamped")) {
+		printf("io-test.cc: Error: logfile line not stamped with Clock::MONOTONIC (%.6f--%.6f)\n", before, after);
+		return -1;
+	}
+	
 	printf("io-test.cc: test succesful!\n");
 
 	return 0;
@@ -0,0 +1,147 @@
+/*
+ messages-test.cc -- Test messagequeue lanes, capacity and message pool
+ Copyright (C) 2012 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+
+#include <sigc++/sigc++.h>
+
+#include "messages.h"
+#include "pthread++.h"
+
+#include "libsiu-testing.h"
+
+using namespace std;
+
+static messagequeue *blockq;
+static bool pushed = false;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Blocks until the main thread makes room
+static void producer() {
+	blockq->push(blockq->alloc("third"));
+	__atomic_store_n(&pushed, true, __ATOMIC_RELEASE);
+}
+
+int main(int /* argc */, char *argv[]) {
+	DEBUGPRINT("testing %s\n", argv[0]);
+
+	// Urgent before normal before bulk, first in first out within a lane
+	messagequeue q;
+	q.push(q.alloc("b1"), messagequeue::BULK);
+	q.push(q.alloc("n1"));
+	q.push(q.alloc("u1"), messagequeue::URGENT);
+	q.push(q.alloc("n2"));
+	q.push(q.alloc("b2"), messagequeue::BULK);
+	q.push(q.alloc("u2"), messagequeue::URGENT);
+	const char *order[] = {"u1", "u2", "n1", "n2", "b1", "b2"};
+	for (int i=0; i<6; i++) {
+		message *m = q.pop(0);
+		if (!m || *m != order[i]) {
+			DEBUGPRINT("lanes: expected %s, got %s\n", order[i], m ? m->c_str() : "nothing");
+			return -1;
+		}
+		q.release(m);
+	}
+	if (q.pop(10) || q.size())
+		return -1;
+
+	// Batches keep the same order
+	for (int i=0; i<20; i++)
+		q.push(q.alloc(i % 2 ? "normal" : "bulk"), i % 2 ? messagequeue::NORMAL : messagequeue::BULK);
+	vector<message *> batch;
+	if (q.pop(batch, 15) != 15 || *batch[9] != "normal" || *batch[10] != "bulk" || q.size() != 5)
+		return -1;
+	if (q.pop(batch, 15, 0) != 5 || batch.size() != 20)
+		return -1;
+	DEBUGPRINT("%s", "lanes: ok\n");
+
+	// The pool hands out released messages again, up to poolmax of them
+	messagequeue p(0, 2);
+	message *m1 = p.alloc("one"), *m2 = p.alloc("two"), *m3 = p.alloc("three");
+	m1->replyheader = "header ";
+	p.release(m1);
+	p.release(m2);
+	p.release(m3);
+	message *r1 = p.alloc("four"), *r2 = p.alloc("five");
+	if ((r1 != m1 && r1 != m2) || (r2 != m1 && r2 != m2) || r1 == r2)
+		return -1;
+	if (*r1 != "four" || *r2 != "five" || !m1->replyheader.empty())
+		return -1;
+	p.release(r1);
+	p.release(r2);
+	for (size_t i=0; i<batch.size(); i++)
+		q.release(batch[i]);
+	DEBUGPRINT("%s", "pool: ok\n");
+
+	// A full lane does not accept more, other lanes still do
+	messagequeue c(2);
+	blockq = &c;
+	if (!c.push(c.alloc("first")) || !c.push(c.alloc("second")))
+		return -1;
+	message *extra = c.alloc("extra");
+	if (c.trypush(extra))
+		return -1;
+	double t0 = now();
+	if (c.push(extra, messagequeue::NORMAL, 100))
+		return -1;
+	double waited = now() - t0;
+	DEBUGPRINT("capacity: timed push gave up after %.3f s\n", waited);
+	if (waited < 0.09 || waited > 1.0)
+		return -1;
+	if (!c.trypush(extra, messagequeue::URGENT))
+		return -1;
+
+	// A blocking push waits until there is room
+	pthread::thread thr;
+	thr.create(sigc::ptr_fun(producer));
+	usleep(100 * 1000);
+	if (__atomic_load_n(&pushed, __ATOMIC_ACQUIRE))
+		return -1;
+	message *m = c.pop(0);
+	if (!m || *m != "extra")
+		return -1;
+	c.release(m);
+	m = c.pop(0);
+	if (!m || *m != "first")
+		return -1;
+	c.release(m);
+	thr.join();
+	if (!__atomic_load_n(&pushed, __ATOMIC_ACQUIRE) || c.size() != 2)
+		return -1;
+
+	// Raising the capacity wakes up waiting producers as well
+	thr.create(sigc::ptr_fun(producer));
+	usleep(50 * 1000);
+	c.setcapacity(3);
+	thr.join();
+	if (c.size() != 3)
+		return -1;
+	DEBUGPRINT("%s", "capacity: ok\n");
+
+	return 0;
+}
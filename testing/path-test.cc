@@ -18,6 +18,9 @@
  */
 
 #include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdlib.h>
 #include "path++.h"
 
 int main(int /* argc */, char *argv[]) {
@@ -97,6 +100,47 @@ int main(int /* argc */, char *argv[]) {
 		return -1;
 	}	
 	
+	printf("path-test.cc:: list()\n");
+	char tmpl[] = "/tmp/path-test-XXXXXX";
+	Path dir(mkdtemp(tmpl));
+	const char *names[] = {"c.fits", "a.fits", "b.fits", "notes.txt", ".hidden.fits"};
+	for (int i=0; i<5; i++) {
+		FILE *f = (dir + names[i]).fopen("w");
+		fprintf(f, "%*s", (i+1) * 10, "");
+		fclose(f);
+		// Modification times in reverse alphabetical order
+		struct timespec times[2] = { {0, UTIME_OMIT}, {1000000 - i, 0} };
+		utimensat(AT_FDCWD, (dir + names[i]).c_str(), times, 0);
+	}
+	
+	// Directories and dangling links are listed, but not globbed
+	mkdir((dir + "d.fits").c_str(), 0755);
+	symlink("a.fits", (dir + "link.fits").c_str());
+	symlink("nonexistent", (dir + "dangling.fits").c_str());
+	
+	vector<Path::entry> entries;
+	int n1 = dir.list(entries, "*.fits");
+	bool byname = (n1 == 6 && entries[0].name == "a.fits" && entries[2].path == dir + "c.fits" && entries[0].isfile() && !entries[0].hasstat && entries[3].isdir());
+	int n2 = dir.list(entries, "?.fits", Path::SORT_MTIME);
+	bool bymtime = (n2 == 4 && entries[0].name == "b.fits" && entries[2].name == "c.fits" && entries[0].hasstat && entries[0].size == 30);
+	int n3 = dir.glob("*").size();
+	int n6 = dir.glob("*.fits").size();
+	int n4 = dir.glob(".*").size();
+	int n5 = Path("/nonexistent/path").list(entries);
+	
+	for (int i=0; i<5; i++)
+		unlink((dir + names[i]).c_str());
+	unlink((dir + "link.fits").c_str());
+	unlink((dir + "dangling.fits").c_str());
+	rmdir((dir + "d.fits").c_str());
+	rmdir(dir.c_str());
+	
+	if (!byname || !bymtime || n3 != 5 || n4 != 1 || n5 != -1 || n6 != 4) {
+		printf("path-test.cc:: error\n");
+		printf("path-test.cc:: byname: %d (%d), bymtime: %d (%d), glob: %d, %d, %d, nonexistent: %d\n", byname, n1, bymtime, n2, n3, n4, n6, n5);
+		return -1;
+	}
+	
 	printf("path-test.cc:: test ok!\n");
 	return 0;
 }
@@ -95,9 +95,17 @@ int main(int, char **) {
 	printf("==============================================================================\n");
 	// Start new logger updating every 1.5 seconds, run live mode, print stats during live mode
 	PerfLog logger2(1.5, true, true);
+	// These stages are short, time them with the TSC (if available)
+	logger2.setclock(Clock::TSC);
+	printf("TSC usable: %d (%.3f GHz)\n", Clock::tsc_usable(), Clock::tsc_ghz());
+	
+	// Reports can be printed from any thread, e.g. from a signal handler
+	FILE *devnull = fopen("/dev/null", "w");
 	
 	// Start 'work'
 	for (int i=0; i<2000; i++) {
+		if (i % 100 == 0)
+			logger2.print_report(devnull);
 		logger2.addlog("work0 0.011");
 		usleep(0.003 * 1E6 * (drand48()*0.1 + 1));
 		
@@ -115,6 +123,7 @@ int main(int, char **) {
 		
 		logger2.addlog("work5 0.005");
 	}
+	fclose(devnull);
   
 	return 0;
 }
@@ -0,0 +1,81 @@
+/*
+ periodic-test.cc -- Test Periodic fixed-rate loops
+ Copyright (C) 2012 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sigc++/sigc++.h>
+
+#include "periodic.h"
+#include "perflogger.h"
+
+#include "libsiu-testing.h"
+
+static size_t ncalls = 0;
+
+static void work() {
+	ncalls++;
+	usleep(200);
+}
+
+int main(int /* argc */, char *argv[]) {
+	DEBUGPRINT("testing %s\n", argv[0]);
+
+	// 1 kHz loop with some work: the period must not drift
+	Periodic tick(Duration::msec(1));
+	MonoTime start = MonoTime::now();
+	for (int i=0; i<500; i++) {
+		tick.wait();
+		work();
+	}
+	Duration took = MonoTime::now() - start;
+	Periodic::stats_t st = tick.getstats(true);
+	printf("1 kHz: 500 iterations in %.4f s, %zu overruns (%zu missed), latency avg %.1f us (±%.1f), max %.1f us\n",
+				 took.as_sec(), st.overruns, st.missed, st.mean() * 1e6, st.stddev() * 1e6, st.maxlat.as_usec() * 1.0);
+	// Without overruns this takes exactly 500 periods, plus the last work
+	if (took < Duration::msec(500) || (st.overruns == 0 && took > Duration::msec(510)))
+		return -1;
+	if (st.iter != 500 || st.minlat < Duration())
+		return -1;
+
+	// Overrun by 3.5 periods: 4 deadlines passed, the phase is kept
+	tick.wait();
+	usleep(3500);
+	start = MonoTime::now();
+	if (tick.wait())
+		return -1;
+	st = tick.getstats();
+	printf("Overrun: %zu overruns, %zu missed\n", st.overruns, st.missed);
+	if (st.overruns != 1 || st.missed < 3)
+		return -1;
+
+	// Threaded, with each wakeup logged in PerfLog
+	PerfLog log(0.2, false, false);
+	Periodic thr(Duration::msec(10));
+	thr.setperflog(&log, "periodic");
+	ncalls = 0;
+	thr.start(sigc::ptr_fun(work));
+	usleep(205000);
+	thr.stop();
+	printf("100 Hz thread: %zu calls in 0.205 s\n", ncalls);
+	if (ncalls < 15 || ncalls > 21 || log.get_nstages() != 1)
+		return -1;
+
+	return 0;
+}
@@ -22,12 +22,20 @@
 #define _BSD_SOURCE
 #endif
 #include <unistd.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <string>
+#include <vector>
 #include <sigc++/signal.h>
 
 #include "protocol.h"
 #include "socket.h"
+#include "shmring.h"
 #include "pthread++.h"
+#include "format.h"
 
 using namespace std;
 typedef Protocol::Server::Connection Connection;
@@ -37,6 +45,21 @@ void on_connect(Connection *connection, bool status);
 
 static void on_client_msg(std::string line);
 
+static void on_batch(Connection *connection, std::string line);
+static void on_batch_reply(std::string line);
+static bool waitfor(Protocol::Client &client);
+static int test_batch();
+
+static void on_unix(Connection *connection, std::string line);
+static int test_unix();
+static int test_shmring();
+static int test_requests();
+
+static void on_restart(Connection *connection, std::string line);
+static bool waitpool(Protocol::ClientPool &pool, size_t n);
+static int pingpool(Protocol::ClientPool &pool, int n);
+static int test_failover();
+
 int retval=0;
 string n1 = "SYS";
 string n2 = "WFS";
@@ -78,6 +101,17 @@ int main() {
 	
 	usleep(100 * 1000);
 	
+	if (test_batch())
+		retval = -1;
+	if (test_unix())
+		retval = -1;
+	if (test_shmring())
+		retval = -1;
+	if (test_requests())
+		retval = -1;
+	if (test_failover())
+		retval = -1;
+	
 	if (retval == 0)
 		fprintf(stderr, "protocol-test.cc SUCCESS!\n");
 	else
@@ -120,3 +154,352 @@ void on_client_msg(std::string line) {
 		fprintf(stderr, "cli:on_client_msg: OK: '%s'\n", line.c_str());
 	}
 }
+
+// Wait until client is connected, at most 2 seconds
+static bool waitfor(Protocol::Client &client) {
+	for (int i=0; i<200 && !client.is_connected(); i++)
+		usleep(10 * 1000);
+	return client.is_connected();
+}
+
+static pthread::mutex batch_mutex;
+static vector<string> batch_replies;
+
+void on_batch(Connection *connection, std::string line) {
+	connection->write("echo " + line);
+}
+
+void on_batch_reply(std::string line) {
+	pthread::mutexholder h(&batch_mutex);
+	batch_replies.push_back(line);
+}
+
+// Many lines in one write are dispatched as one batch, with the replies 
+// coalesced. Meanwhile Servers on the same port come and go.
+static int test_batch() {
+	Protocol::Server batch("1235", "BAT");
+	batch.slot_message = sigc::ptr_fun(on_batch);
+	batch.listen();
+	usleep(100 * 1000);
+	
+	Protocol::Client client("127.0.0.1", "1235", "BAT");
+	client.slot_message = sigc::ptr_fun(on_batch_reply);
+	client.connect();
+	if (!waitfor(client))
+		return -1;
+	
+	// Every 10th line is ",", which repeats the previous line
+	string buf;
+	vector<string> expect;
+	for (int i=0; i<200; i++) {
+		if (i % 10 == 9) {
+			buf += ",\r\n";
+			expect.push_back(expect.back());
+		} else {
+			buf += format("BAT n%d\r\n", i);
+			expect.push_back(format("echo n%d", i));
+		}
+	}
+	client.write(buf.data(), buf.size());
+	
+	for (int i=0; i<50; i++) {
+		Protocol::Server tmp("1235", format("TMP%d", i));
+		tmp.listen();
+	}
+	
+	for (int i=0; i<200; i++) {
+		{
+			pthread::mutexholder h(&batch_mutex);
+			if (batch_replies.size() >= expect.size())
+				break;
+		}
+		usleep(10 * 1000);
+	}
+	
+	pthread::mutexholder h(&batch_mutex);
+	fprintf(stderr, "batch: %zu of %zu replies\n", batch_replies.size(), expect.size());
+	if (batch_replies != expect) {
+		fprintf(stderr, "batch: ERROR: replies missing or out of order\n");
+		return -1;
+	}
+	return 0;
+}
+
+static const size_t SHMBULK = 100000;
+
+void on_unix(Connection *connection, std::string line) {
+	string cmd = popword(line);
+	if (cmd == "ping") {
+		connection->write("pong");
+	} else if (cmd == "shm") {
+		// Ring much smaller than the data, so it has to be streamed
+		if (!connection->attachshm(line, 4096)) {
+			connection->write("error");
+			return;
+		}
+		connection->write("attached");
+		vector<uint8_t> buf(SHMBULK);
+		for (size_t i=0; i<buf.size(); i++)
+			buf[i] = i * 7;
+		connection->write(&buf[0], buf.size());
+	}
+}
+
+// Requests over a Unix domain socket, and bulk data through a ShmRing
+static int test_unix() {
+	const string path = format("unix:/tmp/protocol-test-%d.sock", getpid());
+	Protocol::Server server(path, "UNX");
+	server.slot_message = sigc::ptr_fun(on_unix);
+	server.listen();
+	usleep(100 * 1000);
+	
+	Protocol::Client client(path, "", "UNX");
+	client.connect();
+	if (!waitfor(client)) {
+		fprintf(stderr, "unix: ERROR: could not connect to %s\n", path.c_str());
+		return -1;
+	}
+	
+	string reply = client.request("ping").get();
+	fprintf(stderr, "unix: ping -> '%s'\n", reply.c_str());
+	if (reply != "pong")
+		return -1;
+	
+	const string shmname = format("/protocol-test-%d", getpid());
+	reply = client.request("shm " + shmname).get();
+	if (reply != "attached" || !client.attachshm(shmname)) {
+		fprintf(stderr, "unix: ERROR: could not attach to %s: '%s'\n", shmname.c_str(), reply.c_str());
+		return -1;
+	}
+	
+	vector<uint8_t> buf(SHMBULK);
+	if (!client.read(&buf[0], buf.size())) {
+		fprintf(stderr, "unix: ERROR: shm read failed\n");
+		return -1;
+	}
+	for (size_t i=0; i<buf.size(); i++) {
+		if (buf[i] != (uint8_t) (i * 7)) {
+			fprintf(stderr, "unix: ERROR: shm byte %zu is %d\n", i, buf[i]);
+			return -1;
+		}
+	}
+	fprintf(stderr, "unix: read %zu bytes through shm\n", buf.size());
+	return 0;
+}
+
+// Names in use are refused, rings of processes that are gone are replaced
+static int test_shmring() {
+	const string name = format("/protocol-test-ring-%d", getpid());
+	
+	{
+		ShmRing ring(name, 4096);
+		try {
+			ShmRing again(name, 4096);
+			fprintf(stderr, "shmring: ERROR: created %s twice\n", name.c_str());
+			return -1;
+		} catch (ShmRing::exception &e) {
+			fprintf(stderr, "shmring: in use: %s\n", e.what());
+		}
+		
+		ShmRing reader(name);
+		const char msg[] = "hello ring";
+		char buf[sizeof msg];
+		if (!ring.write(msg, sizeof msg) || reader.readavailable() != sizeof msg || !reader.read(buf, sizeof buf) || strcmp(buf, msg))
+			return -1;
+		if (reader.read(buf, 1, 10)) {
+			fprintf(stderr, "shmring: ERROR: read from empty ring\n");
+			return -1;
+		}
+	}
+	
+	// A child creates the ring and exits without cleaning up
+	pid_t pid = fork();
+	if (pid == 0) {
+		new ShmRing(name, 4096);
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	try {
+		ShmRing ring(name, 4096);
+		
+		// Nobody opens the ring, waiting without a timeout still gives up
+		char buf[16];
+		if (ring.read(buf, 1) || errno != EPIPE) {
+			fprintf(stderr, "shmring: ERROR: waited for a reader that never came\n");
+			return -1;
+		}
+		
+		// A child writes half a message and exits, the rest never comes
+		pid = fork();
+		if (pid == 0) {
+			ShmRing writer(name);
+			writer.write("half", 4);
+			_exit(0);
+		}
+		waitpid(pid, &status, 0);
+		if (!ring.read(buf, 4) || memcmp(buf, "half", 4) || ring.read(buf, 4) || errno != EPIPE) {
+			fprintf(stderr, "shmring: ERROR: waited for a writer that is gone\n");
+			return -1;
+		}
+		
+		// Size is the third field of the header, it must be a power of two
+		int fd = shm_open(name.c_str(), O_RDWR, 0600);
+		uint64_t bad = 3000;
+		if (fd < 0 || pwrite(fd, &bad, sizeof bad, 2 * sizeof(uint32_t)) != sizeof bad)
+			return -1;
+		close(fd);
+		try {
+			ShmRing corrupt(name);
+			fprintf(stderr, "shmring: ERROR: opened a ring of size %zu\n", corrupt.getsize());
+			return -1;
+		} catch (ShmRing::exception &e) {
+			fprintf(stderr, "shmring: corrupt: %s\n", e.what());
+		}
+	} catch (ShmRing::exception &e) {
+		fprintf(stderr, "shmring: ERROR: stale ring not replaced: %s\n", e.what());
+		return -1;
+	}
+	return 0;
+}
+
+// Many requests in flight, answered in reverse order by a plain Socket, one
+// of them too late
+static int test_requests() {
+	const int n = 50, late = 13;
+	Socket listener;
+	listener.listen("1236");
+	
+	Protocol::Client client("127.0.0.1", "1236", "REQ");
+	client.connect();
+	Socket *peer = listener.accept();
+	if (!peer || !waitfor(client)) {
+		fprintf(stderr, "requests: ERROR: could not connect\n");
+		return -1;
+	}
+	
+	vector< pthread::future<string> > replies;
+	for (int i=0; i<n; i++)
+		replies.push_back(client.request(format("n%d", i), i == late ? 200 : 5000));
+	
+	// Lines are "@<id> REQ n<i>"
+	vector<string> ids;
+	for (int i=0; i<n; i++) {
+		string line;
+		if (!peer->readline(line)) {
+			fprintf(stderr, "requests: ERROR: request %d not received\n", i);
+			delete peer;
+			return -1;
+		}
+		string id = popword(line);
+		if (popword(line) != "REQ" || line != format("n%d", i)) {
+			fprintf(stderr, "requests: ERROR: unexpected request '%s'\n", line.c_str());
+			delete peer;
+			return -1;
+		}
+		ids.push_back(id);
+	}
+	
+	for (int i=n-1; i>=0; i--)
+		if (i != late)
+			peer->write(ids[i] + format(" REQ reply n%d\r\n", i));
+	
+	int errors = 0;
+	for (int i=0; i<n; i++) {
+		if (i == late)
+			continue;
+		string reply = replies[i].get();
+		if (replies[i].failed() || reply != format("reply n%d", i)) {
+			fprintf(stderr, "requests: ERROR: request %d got '%s'\n", i, reply.c_str());
+			errors++;
+		}
+	}
+	
+	// The late request times out, its reply afterwards is ignored
+	replies[late].wait();
+	peer->write(ids[late] + format(" REQ reply n%d\r\n", late));
+	usleep(50 * 1000);
+	if (!replies[late].failed()) {
+		fprintf(stderr, "requests: ERROR: request %d did not time out\n", late);
+		errors++;
+	}
+	
+	fprintf(stderr, "requests: %d in flight, %d errors, timeout: %s\n", n, errors, replies[late].error().c_str());
+	delete peer;
+	return errors ? -1 : 0;
+}
+
+void on_restart(Connection *connection, std::string line) {
+	if (line == "ping")
+		connection->write("pong");
+	else if (line == "drop")
+		connection->close();
+}
+
+// Wait until n clients of pool are connected, at most 5 seconds
+static bool waitpool(Protocol::ClientPool &pool, size_t n) {
+	for (int i=0; i<500 && pool.nconnected() != n; i++)
+		usleep(10 * 1000);
+	return pool.nconnected() == n;
+}
+
+// Send n pings through pool, return the number of wrong replies
+static int pingpool(Protocol::ClientPool &pool, int n) {
+	int errors = 0;
+	for (int i=0; i<n; i++) {
+		string reply = pool.request("ping", 2000).get();
+		if (reply != "pong") {
+			fprintf(stderr, "failover: ERROR: ping %d got '%s'\n", i, reply.c_str());
+			errors++;
+		}
+	}
+	return errors;
+}
+
+// A pool skips a dropped connection, and all clients reconnect to a Server 
+// that restarts
+static int test_failover() {
+	Protocol::Server *server = new Protocol::Server("1237", "RST");
+	server->slot_message = sigc::ptr_fun(on_restart);
+	server->listen();
+	usleep(100 * 1000);
+	
+	Protocol::ClientPool pool("127.0.0.1", "1237", "RST", 3);
+	pool.connect();
+	if (!waitpool(pool, 3)) {
+		fprintf(stderr, "failover: ERROR: %zu of 3 clients connected\n", pool.nconnected());
+		delete server;
+		return -1;
+	}
+	int errors = pingpool(pool, 6);
+	
+	// The server drops one connection, the others take over until it is back
+	pool.write("drop");
+	if (!waitpool(pool, 2))
+		errors++;
+	errors += pingpool(pool, 6);
+	if (!waitpool(pool, 3))
+		errors++;
+	
+	delete server;
+	if (!waitpool(pool, 0))
+		errors++;
+	if (!pool.request("ping").failed()) {
+		fprintf(stderr, "failover: ERROR: request without connections did not fail\n");
+		errors++;
+	}
+	
+	server = new Protocol::Server("1237", "RST");
+	server->slot_message = sigc::ptr_fun(on_restart);
+	server->listen();
+	if (!waitpool(pool, 3)) {
+		fprintf(stderr, "failover: ERROR: %zu of 3 clients reconnected\n", pool.nconnected());
+		errors++;
+	}
+	errors += pingpool(pool, 6);
+	
+	fprintf(stderr, "failover: %d errors\n", errors);
+	pool.close();
+	delete server;
+	return errors ? -1 : 0;
+}
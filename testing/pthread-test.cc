@@ -21,6 +21,8 @@
 #include <stdio.h>
 #include <unistd.h>
 
+#include <sigc++/sigc++.h>
+
 #include "pthread++.h"
 
 int nworker = 4;
@@ -72,6 +74,109 @@ void *worker_prog(void */*args*/) {
 	return NULL;
 }
 
+// Sum of i for i in [b, e)
+size_t sum_range(size_t b, size_t e) {
+	size_t s = 0;
+	for (size_t i=b; i<e; i++)
+		s += i;
+	return s;
+}
+
+size_t add(size_t a, size_t b) { return a + b; }
+
+// Readers must never see a node that was already deleted
+struct node {
+	int alive;
+	node(): alive(1) {}
+	~node() { __atomic_store_n(&alive, 0, __ATOMIC_SEQ_CST); }
+};
+pthread::rcu rcu;
+node *current = new node;
+bool reading = true;
+int rcu_errors = 0;
+
+void rcu_reader() {
+	while (__atomic_load_n(&reading, __ATOMIC_ACQUIRE)) {
+		pthread::rcu::reader r(&rcu);
+		node *n = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+		for (int i=0; i<10; i++)
+			if (!__atomic_load_n(&n->alive, __ATOMIC_SEQ_CST))
+				__atomic_add_fetch(&rcu_errors, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// FIFO order, full and empty, many times around the ring
+template<typename Q> bool queue_basics() {
+	Q q(4);
+	size_t v;
+	if (q.capacity() != 4 || q.try_pop(v))
+		return false;
+	for (size_t i=0; i<4; i++)
+		if (!q.try_push(i))
+			return false;
+	if (q.try_push(4) || q.size() != 4)
+		return false;
+	for (size_t i=0; i<100; i++) {
+		if (!q.try_pop(v) || v != i || !q.try_push(i + 4))
+			return false;
+	}
+	for (size_t i=100; i<104; i++)
+		if (!q.try_pop(v) || v != i)
+			return false;
+	return !q.try_pop(v) && q.size() == 0;
+}
+
+const size_t NITEMS = 100000;
+pthread::spsc_queue<size_t> spsc(8);
+pthread::mpmc_queue<size_t> mpmc(8);
+int queue_errors = 0;
+size_t ntaken = 0;
+int *nseen;
+
+void spsc_producer() {
+	for (size_t i=0; i<NITEMS; i++)
+		spsc.push(i);
+}
+
+void spsc_consumer() {
+	for (size_t i=0; i<NITEMS; i++) {
+		size_t v;
+		spsc.pop(v);
+		if (v != i)
+			__atomic_add_fetch(&queue_errors, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// Producer p pushes p * NITEMS ... (p+1) * NITEMS - 1
+void mpmc_producer(size_t p) {
+	for (size_t i=0; i<NITEMS; i++)
+		mpmc.push(p * NITEMS + i);
+}
+
+void mpmc_consumer(size_t total) {
+	while (__atomic_fetch_add(&ntaken, 1, __ATOMIC_RELAXED) < total) {
+		size_t v;
+		mpmc.pop(v);
+		if (v < total)
+			__atomic_add_fetch(&nseen[v], 1, __ATOMIC_RELAXED);
+		else
+			__atomic_add_fetch(&queue_errors, 1, __ATOMIC_RELAXED);
+	}
+}
+
+pthread::future<int> setme;
+
+void future_setter() {
+	usleep(50 * 1000);
+	setme.set(42);
+}
+
+long msec_since(const struct timespec &start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
 void *server_prog(void */*args*/) {
 	fprintf(stderr, "pthread-test.cc::server() 1 init\n");
 	
@@ -116,6 +221,91 @@ int main() {
 		return -1;
 	}
 	
+	fprintf(stderr, "pthread-test.cc::main() parallel_reduce with pool of %d\n", nworker);
+	pthread::pool pool(nworker);
+	size_t n = 1000000;
+	size_t total = pool.parallel_reduce<size_t>(0, n, sigc::ptr_fun(sum_range), sigc::ptr_fun(add), 0);
+	if (total != n * (n-1) / 2) {
+		fprintf(stderr, "pthread-test.cc::main() parallel_reduce error: %zu\n", total);
+		return -1;
+	}
+	
+	fprintf(stderr, "pthread-test.cc::main() rcu with %d readers\n", nworker);
+	pthread::thread readers[nworker];
+	for (int i=0; i<nworker; i++)
+		readers[i].create(sigc::ptr_fun(rcu_reader));
+	for (int i=0; i<20000; i++)
+		rcu.replace(current, new node);
+	__atomic_store_n(&reading, false, __ATOMIC_RELEASE);
+	for (int i=0; i<nworker; i++)
+		readers[i].join();
+	delete current;
+	if (rcu_errors) {
+		fprintf(stderr, "pthread-test.cc::main() rcu error: %d reads of deleted nodes\n", rcu_errors);
+		return -1;
+	}
+	
+	fprintf(stderr, "pthread-test.cc::main() spsc_queue and mpmc_queue\n");
+	if (!queue_basics< pthread::spsc_queue<size_t> >() || !queue_basics< pthread::mpmc_queue<size_t> >()) {
+		fprintf(stderr, "pthread-test.cc::main() queue error: order, full or empty\n");
+		return -1;
+	}
+	
+	pthread::thread producer, consumer;
+	producer.create(sigc::ptr_fun(spsc_producer));
+	consumer.create(sigc::ptr_fun(spsc_consumer));
+	producer.join();
+	consumer.join();
+	
+	// Every item arrives exactly once with 3 producers and 2 consumers
+	const size_t nprod = 3, ncons = 2, nitems = nprod * NITEMS;
+	nseen = new int[nitems]();
+	pthread::thread producers[nprod], consumers[ncons];
+	for (size_t i=0; i<nprod; i++)
+		producers[i].create(sigc::bind(sigc::ptr_fun(mpmc_producer), i));
+	for (size_t i=0; i<ncons; i++)
+		consumers[i].create(sigc::bind(sigc::ptr_fun(mpmc_consumer), nitems));
+	for (size_t i=0; i<nprod; i++)
+		producers[i].join();
+	for (size_t i=0; i<ncons; i++)
+		consumers[i].join();
+	for (size_t i=0; i<nitems; i++)
+		if (nseen[i] != 1)
+			queue_errors++;
+	delete[] nseen;
+	if (queue_errors || spsc.size() || mpmc.size()) {
+		fprintf(stderr, "pthread-test.cc::main() queue error: %d items lost, duplicated or out of order\n", queue_errors);
+		return -1;
+	}
+	
+	fprintf(stderr, "pthread-test.cc::main() future deadlines\n");
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread::future<int> expire(100 * 1000);
+	bool expired = expire.wait();
+	long took = msec_since(start);
+	if (!expired || !expire.failed() || expire.error() != "timeout" || took < 100 || took > 300) {
+		fprintf(stderr, "pthread-test.cc::main() future error: deadline of 100 ms gave '%s' after %ld ms\n", expire.error().c_str(), took);
+		return -1;
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread::future<int> idle;
+	bool ready = idle.wait(50 * 1000);
+	took = msec_since(start);
+	if (ready || took < 50 || took > 250) {
+		fprintf(stderr, "pthread-test.cc::main() future error: wait(50 ms) returned %d after %ld ms\n", ready, took);
+		return -1;
+	}
+	
+	pthread::thread setter(sigc::ptr_fun(future_setter));
+	ready = setme.wait(1000 * 1000);
+	setter.join();
+	if (!ready || setme.failed() || setme.get() != 42) {
+		fprintf(stderr, "pthread-test.cc::main() future error: value not set\n");
+		return -1;
+	}
+	
 	fprintf(stderr, "pthread-test.cc::main() success!\n");
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,170 @@
+/*
+ queue-bench.cc -- Compare pthread++ queues with messagequeue
+ Copyright (C) 2012 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <string>
+
+#include "pthread++.h"
+#include "messages.h"
+
+#include "libsiu-testing.h"
+
+// Items per throughput run and round trips per latency run
+static const size_t nitems = 1000000;
+static const size_t nrounds = 20000;
+static const size_t qsize = 1024;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int retval = 0;
+
+static void check(const char *what, size_t got, size_t expect) {
+	if(got != expect) {
+		fprintf(stderr, "queue-bench: %s: got %zu, expected %zu\n", what, got, expect);
+		retval = -1;
+	}
+}
+
+// Throughput: producers push nitems in total, consumers pop them and sum them
+
+static pthread::spsc_queue<size_t> *spsc;
+static pthread::mpmc_queue<size_t> *mpmc;
+static messagequeue *mq;
+static size_t sum;
+static pthread::mutex summutex;
+
+static void spsc_producer() { for(size_t i = 1; i <= nitems; i++) spsc->push(i); }
+static void spsc_consumer() { size_t v, s = 0; for(size_t i = 0; i < nitems; i++) { spsc->pop(v); s += v; } sum = s; }
+
+static const size_t nthreads = 2;
+static size_t perthread;
+static void mpmc_producer() { for(size_t i = 1; i <= perthread; i++) mpmc->push(i); }
+static void mpmc_consumer() {
+	size_t v, s = 0;
+	for(size_t i = 0; i < perthread; i++) { mpmc->pop(v); s += v; }
+	pthread::mutexholder h(&summutex);
+	sum += s;
+}
+
+static void mq_producer() { for(size_t i = 1; i <= nitems; i++) mq->push(mq->alloc("x")); }
+static void mq_consumer() {
+	for(size_t i = 0; i < nitems; i++) {
+		message *m;
+		*mq >> m;
+		sum += m->size();
+		mq->release(m);
+	}
+}
+
+static double run(void (*producer)(), void (*consumer)(), size_t n) {
+	pthread::thread p[nthreads], c[nthreads];
+	double t0 = now();
+	for(size_t i = 0; i < n; i++) {
+		c[i].create(sigc::ptr_fun(consumer));
+		p[i].create(sigc::ptr_fun(producer));
+	}
+	for(size_t i = 0; i < n; i++) {
+		p[i].join();
+		c[i].join();
+	}
+	return now() - t0;
+}
+
+// Latency: ping-pong one item between two threads
+
+static pthread::spsc_queue<size_t> *ping, *pong;
+static messagequeue *mqping, *mqpong;
+
+static void spsc_echo() { size_t v; for(size_t i = 0; i < nrounds; i++) { ping->pop(v); pong->push(v); } }
+static void mq_echo() { message *m; for(size_t i = 0; i < nrounds; i++) { *mqping >> m; mqpong->push(m); } }
+
+int main(int /* argc */, char *argv[]) {
+	DEBUGPRINT("testing %s\n", argv[0]);
+
+	const size_t expect = nitems * (nitems + 1) / 2;
+	const size_t expectmt = nthreads * (nitems / nthreads) * (nitems / nthreads + 1) / 2;
+
+	spsc = new pthread::spsc_queue<size_t>(qsize);
+	sum = 0;
+	double t = run(spsc_producer, spsc_consumer, 1);
+	check("spsc_queue sum", sum, expect);
+	printf("spsc_queue   1P1C: %8.2f Mitems/s\n", nitems / t * 1e-6);
+
+	mpmc = new pthread::mpmc_queue<size_t>(qsize);
+	perthread = nitems;
+	sum = 0;
+	t = run(mpmc_producer, mpmc_consumer, 1);
+	check("mpmc_queue sum", sum, expect);
+	printf("mpmc_queue   1P1C: %8.2f Mitems/s\n", nitems / t * 1e-6);
+
+	perthread = nitems / nthreads;
+	sum = 0;
+	t = run(mpmc_producer, mpmc_consumer, nthreads);
+	check("mpmc_queue 2P2C sum", sum, expectmt);
+	printf("mpmc_queue   %zuP%zuC: %8.2f Mitems/s\n", nthreads, nthreads, nitems / t * 1e-6);
+
+	mq = new messagequeue(qsize);
+	sum = 0;
+	t = run(mq_producer, mq_consumer, 1);
+	check("messagequeue count", sum, nitems);
+	printf("messagequeue 1P1C: %8.2f Mitems/s\n", nitems / t * 1e-6);
+
+	ping = new pthread::spsc_queue<size_t>(16);
+	pong = new pthread::spsc_queue<size_t>(16);
+	pthread::thread echo(sigc::ptr_fun(spsc_echo));
+	t = now();
+	for(size_t i = 0, v; i < nrounds; i++) {
+		ping->push(i);
+		pong->pop(v);
+		check("spsc_queue echo", v, i);
+	}
+	t = now() - t;
+	echo.join();
+	printf("spsc_queue   round trip: %8.2f us\n", t / nrounds * 1e6);
+
+	mqping = new messagequeue(16);
+	mqpong = new messagequeue(16);
+	echo.create(sigc::ptr_fun(mq_echo));
+	message *m = mqping->alloc("x");
+	t = now();
+	for(size_t i = 0; i < nrounds; i++) {
+		mqping->push(m);
+		*mqpong >> m;
+	}
+	t = now() - t;
+	echo.join();
+	mqping->release(m);
+	printf("messagequeue round trip: %8.2f us\n", t / nrounds * 1e6);
+
+	delete spsc;
+	delete mpmc;
+	delete mq;
+	delete ping;
+	delete pong;
+	delete mqping;
+	delete mqpong;
+
+	return retval;
+}
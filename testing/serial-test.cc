@@ -0,0 +1,293 @@
+/*
+ serial-test.cc -- test serial::port and serial::scheduler over a pty
+ Copyright (C) 2010 Tim van Werkhoven <werkhoven@strw.leidenuniv.nl>
+
+ This file is part of FOAM.
+
+ FOAM is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 2 of the License, or
+ (at your option) any later version.
+
+ FOAM is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FOAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <string>
+#include <deque>
+#include <algorithm>
+#include <sigc++/sigc++.h>
+
+#include "serial.h"
+#include "pthread++.h"
+
+using namespace std;
+
+/* The test plays the serial device on the master side of a pty. Requests
+ are "<node> <command> [<arg>]\r", replies "<node> <arg>\r":
+
+ echo <arg>: reply at once
+ slow <arg>: reply after 150 ms
+ late <arg>: reply after 300 ms
+ mute, sink: never reply
+ */
+static int master;
+static bool running = true;
+static bool paused = false;								//!< Stop reading, so the pty fills up
+static pthread::mutex devmutex;						//!< Protects the counters below
+static int outstanding = 0;								//!< Requests received but not replied to
+static int maxoutstanding = 0;
+
+static int64_t now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void put(const string &str) {
+	if(write(master, str.data(), str.size()) != (ssize_t) str.size())
+		fprintf(stderr, "serial-test.cc: ERROR: could not write to pty: %s\n", strerror(errno));
+}
+
+static void device() {
+	string buf;
+	deque<pair<int64_t, string> > replies;
+
+	while(__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		if(!__atomic_load_n(&paused, __ATOMIC_ACQUIRE)) {
+			struct pollfd pfd = {master, POLLIN};
+			if(poll(&pfd, 1, 10) > 0 && (pfd.revents & POLLIN)) {
+				char tmp[4096];
+				ssize_t len = read(master, tmp, sizeof tmp);
+				if(len > 0)
+					buf.append(tmp, len);
+			}
+		} else {
+			usleep(10000);
+		}
+
+		size_t end;
+		while((end = buf.find('\r')) != string::npos) {
+			string line = buf.substr(0, end);
+			buf.erase(0, end + 1);
+
+			char node[16] = "", command[16] = "", arg[64] = "";
+			sscanf(line.c_str(), "%15s %15s %63s", node, command, arg);
+			int delay = !strcmp(command, "echo") ? 0 : !strcmp(command, "slow") ? 150 : !strcmp(command, "late") ? 300 : -1;
+			if(delay < 0)
+				continue;
+
+			replies.push_back(make_pair(now_ms() + delay, string(node) + " " + arg + "\r"));
+			pthread::mutexholder h(&devmutex);
+			maxoutstanding = max(maxoutstanding, ++outstanding);
+		}
+
+		for(deque<pair<int64_t, string> >::iterator it = replies.begin(); it != replies.end();) {
+			if(it->first > now_ms()) {
+				++it;
+				continue;
+			}
+			{
+				pthread::mutexholder h(&devmutex);
+				outstanding--;
+			}
+			put(it->second);
+			it = replies.erase(it);
+		}
+	}
+}
+
+static void trickle() {
+	// Ten bytes of one line over 500 ms
+	for(int i = 0; i < 10; i++) {
+		usleep(50 * 1000);
+		put("x");
+	}
+	put("\r");
+}
+
+static int matchnode(string line) {
+	return line.empty() || line[0] < '0' || line[0] > '9' ? -1 : atoi(line.c_str());
+}
+
+static int check(const char *what, const string &got, const string &expected) {
+	if(got == expected)
+		return 0;
+	fprintf(stderr, "serial-test.cc: ERROR: %s: got '%s', expected '%s'\n", what, got.c_str(), expected.c_str());
+	return 1;
+}
+
+static int test_gets(serial::port &port) {
+	int errors = 0;
+	char buf[64];
+
+	// Two lines in one read(), the second must come from the buffer
+	put("one\rtwo\r");
+	errors += check("first line", port.gets(buf, sizeof buf, 1000) ? buf : "(none)", "one");
+	errors += check("buffered line", port.gets(buf, sizeof buf, 0) ? buf : "(none)", "two");
+
+	// "\r\n" terminated lines leave a '\n' in front of the next one
+	put("three\r\nfour\r\n");
+	errors += check("\\r\\n line", port.gets(buf, sizeof buf, 1000) ? buf : "(none)", "three");
+	errors += check("next \\r\\n line", port.gets(buf, sizeof buf, 1000) ? buf : "(none)", "four");
+
+	// Nothing to read
+	int64_t start = now_ms();
+	if(port.gets(buf, sizeof buf, 100) || now_ms() - start < 100) {
+		fprintf(stderr, "serial-test.cc: ERROR: gets() without data returned after %d ms\n", (int) (now_ms() - start));
+		errors++;
+	}
+
+	// The timeout is for the whole line: a byte every 50 ms must not keep
+	// gets() going past its deadline, and nothing read may get lost
+	pthread::thread writer(sigc::ptr_fun(trickle));
+	start = now_ms();
+	bool got = port.gets(buf, sizeof buf, 200);
+	int64_t took = now_ms() - start;
+	fprintf(stderr, "serial-test.cc: trickled line timed out after %d ms\n", (int) took);
+	if(got || took < 200 || took > 400) {
+		fprintf(stderr, "serial-test.cc: ERROR: gets() deadline not kept\n");
+		errors++;
+	}
+	writer.join();
+	errors += check("trickled line", port.gets(buf, sizeof buf, 1000) ? buf : "(none)", "xxxxxxxxxx");
+
+	return errors;
+}
+
+static int test_scheduler(serial::port &port) {
+	int errors = 0;
+	serial::scheduler sched(&port, 2, 500);
+	sched.slot_match = sigc::ptr_fun(matchnode);
+
+	// Six slow requests queue up, only two may be in flight at any time
+	pthread::future<string> slow[6];
+	int64_t start = now_ms();
+	for(int i = 0; i < 6; i++)
+		slow[i] = sched.submit(1, "1 slow " + string(1, 'a' + i) + "\r");
+	if(sched.pending() != 6) {
+		fprintf(stderr, "serial-test.cc: ERROR: %zu pending, expected 6\n", sched.pending());
+		errors++;
+	}
+	for(int i = 0; i < 6; i++)
+		errors += check("queued request", slow[i].get(), "1 " + string(1, 'a' + i));
+	int64_t took = now_ms() - start;
+	{
+		pthread::mutexholder h(&devmutex);
+		fprintf(stderr, "serial-test.cc: 6 slow requests at depth 2: %d ms, at most %d in flight\n", (int) took, maxoutstanding);
+		if(maxoutstanding != 2 || took < 3 * 150) {
+			fprintf(stderr, "serial-test.cc: ERROR: depth 2 not kept\n");
+			errors++;
+		}
+	}
+
+	// slot_match pairs an early reply for node 2 with its own request
+	pthread::future<string> r1 = sched.submit(1, "1 slow first\r");
+	pthread::future<string> r2 = sched.submit(2, "2 echo second\r");
+	errors += check("matched reply", r2.get(), "2 second");
+	if(r1.ready()) {
+		fprintf(stderr, "serial-test.cc: ERROR: slow reply for node 1 already there\n");
+		errors++;
+	}
+	errors += check("matched slow reply", r1.get(), "1 first");
+
+	// Per node timeout, counted from transmission
+	sched.settimeout(3, 100);
+	start = now_ms();
+	pthread::future<string> mute = sched.submit(3, "3 mute\r");
+	mute.wait();
+	took = now_ms() - start;
+	fprintf(stderr, "serial-test.cc: mute request: %s after %d ms\n", mute.error().c_str(), (int) took);
+	if(!mute.failed() || mute.error() != "timeout" || took < 100 || took > 400) {
+		fprintf(stderr, "serial-test.cc: ERROR: mute request should time out after 100 ms\n");
+		errors++;
+	}
+
+	// A reply after the timeout is dropped, not given to the next request
+	sched.settimeout(4, 100);
+	pthread::future<string> late = sched.submit(4, "4 late old\r");
+	late.wait();
+	if(!late.failed() || late.error() != "timeout") {
+		fprintf(stderr, "serial-test.cc: ERROR: late request did not time out\n");
+		errors++;
+	}
+	usleep(300 * 1000);
+	errors += check("request after late reply", sched.submit(4, "4 echo new\r").get(), "4 new");
+
+	// Without reply the request completes once written
+	errors += check("request without reply", sched.submit(5, "5 sink\r", false).get(), "");
+
+	// While the worker is stuck writing to a full pty, submit() and pending()
+	// must not wait for it. The request being written is neither queued nor
+	// in flight, so only the new one is pending.
+	__atomic_store_n(&paused, true, __ATOMIC_RELEASE);
+	pthread::future<string> big = sched.submit(6, "6 sink " + string(1 << 20, 'x') + "\r", false);
+	usleep(100 * 1000);
+	start = now_ms();
+	pthread::future<string> after = sched.submit(7, "7 echo after\r");
+	size_t pending = sched.pending();
+	took = now_ms() - start;
+	fprintf(stderr, "serial-test.cc: submit() during blocked write: %d ms, %zu pending\n", (int) took, pending);
+	if(big.ready() || pending != 1 || took > 50) {
+		fprintf(stderr, "serial-test.cc: ERROR: submit() waited for transmission\n");
+		errors++;
+	}
+	__atomic_store_n(&paused, false, __ATOMIC_RELEASE);
+	errors += check("big request", big.get(), "");
+	errors += check("request after big one", after.get(), "7 after");
+
+	if(sched.pending() != 0) {
+		fprintf(stderr, "serial-test.cc: ERROR: %zu requests left\n", sched.pending());
+		errors++;
+	}
+
+	return errors;
+}
+
+int main() {
+	fprintf(stderr, "serial-test.cc: start\n");
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(master < 0 || grantpt(master) || unlockpt(master)) {
+		fprintf(stderr, "serial-test.cc: could not create pty: %s\n", strerror(errno));
+		return -1;
+	}
+
+	int errors = 0;
+	try {
+		serial::port port(ptsname(master));
+		fprintf(stderr, "serial-test.cc: using %s\n", port.device.c_str());
+
+		errors += test_gets(port);
+
+		pthread::thread dev(sigc::ptr_fun(device));
+		errors += test_scheduler(port);
+		__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+		dev.join();
+	} catch(serial::exception &e) {
+		fprintf(stderr, "serial-test.cc: ERROR: %s\n", e.what());
+		errors++;
+	}
+
+	close(master);
+
+	if(errors) {
+		fprintf(stderr, "serial-test.cc: FAILED with %d errors\n", errors);
+		return -1;
+	}
+	fprintf(stderr, "serial-test.cc: SUCCESS!\n");
+	return 0;
+}
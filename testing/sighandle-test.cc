@@ -19,7 +19,12 @@
 
 #include <sigc++/signal.h>
 #include <unistd.h>
+#include <sys/wait.h>
+#include <fstream>
+#include <sstream>
 #include "sighandle.h"
+#include "io.h"
+#include "perflogger.h"
 
 void quit_func() {
 	fprintf(stdout, "%s:%s\n", __FILE__, __FUNCTION__);
@@ -29,38 +34,170 @@ void ign_func() {
 	fprintf(stdout, "%s:%s\n", __FILE__, __FUNCTION__);
 }
 
+int nusr1=0, nrt=0;
+
+void user_func(int sig) {
+	fprintf(stdout, "%s:%s(%d)\n", __FILE__, __FUNCTION__, sig);
+	if (sig == SIGUSR1)
+		nusr1++;
+	else
+		nrt++;
+}
+
+int slowstate=0;
+
+// Still running when the SigHandle is destroyed
+void slow_func(int /* sig */) {
+	__atomic_store_n(&slowstate, 1, __ATOMIC_RELEASE);
+	usleep(0.2 * 1E6);
+	__atomic_store_n(&slowstate, 2, __ATOMIC_RELEASE);
+}
+
+void crash_func(int fd, void *arg) {
+	SigHandle::crash_write(fd, (const char *) arg);
+	SigHandle::crash_write(fd, "\n");
+}
+
+// Crash in a child, and check the dump it leaves behind
+bool crash_test() {
+	const char *path = "sighandle-test-crash.log";
+	unlink(path);
+	
+	pid_t pid = fork();
+	if (pid == 0) {
+		SigHandle::crashhandler(path);
+		SigHandle::addcrashdump("crash_func", crash_func, (void *) "stage 3 of 5");
+		
+		// The recent Io messages and the PerfLog stage in progress
+		Io io(IO_INFO);
+		io.msg(IO_INFO, "last words before the crash");
+		SigHandle::addcrashdump("Io", Io::crashdump, &io);
+		PerfLog perf;
+		perf.addlog("loading");
+		SigHandle::addcrashdump("PerfLog", PerfLog::crashdump, &perf);
+		
+		// Destroyed objects are not dumped anymore
+		{
+			PerfLog gone;
+			SigHandle::addcrashdump("gone", PerfLog::crashdump, &gone);
+		}
+		
+		volatile int *p = NULL;
+		*p = 1;
+		_exit(0);
+	}
+	
+	int status;
+	waitpid(pid, &status, 0);
+	std::ifstream f(path);
+	std::stringstream dump;
+	dump << f.rdbuf();
+	unlink(path);
+	fprintf(stdout, "%s: crash dump:\n%s", __FILE__, dump.str().c_str());
+	
+	return WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV && 
+		dump.str().find("*** Caught SIGSEGV (11) at address 0x0") != std::string::npos &&
+		dump.str().find("--- crash_func ---\nstage 3 of 5\n") != std::string::npos &&
+		dump.str().find("--- Io ---\n") != std::string::npos &&
+		dump.str().find("last words before the crash\n") != std::string::npos &&
+		dump.str().find("--- PerfLog ---\niteration 1, in progress after stage 'loading'\n") != std::string::npos &&
+		dump.str().find("--- gone ---") == std::string::npos &&
+		dump.str().find("*** end of crash dump ***") != std::string::npos;
+}
+
+// Negative numbers, e.g. si_code SI_TKILL
+bool crash_write_test() {
+	int fds[2];
+	char buf[16] = {0};
+	if (pipe(fds))
+		return false;
+	SigHandle::crash_write(fds[1], SI_TKILL);
+	SigHandle::crash_write(fds[1], " ");
+	SigHandle::crash_write(fds[1], 255, 16);
+	close(fds[1]);
+	ssize_t n = read(fds[0], buf, sizeof buf - 1);
+	close(fds[0]);
+	fprintf(stdout, "%s: crash_write: '%s'\n", __FILE__, buf);
+	return n > 0 && std::string(buf) == "-6 ff";
+}
+
 int main() {
 	fprintf(stdout, "%s: start\n", __FILE__);
-	SigHandle sig;
-	sig.quit_func = sigc::ptr_fun(&quit_func);
-	sig.ign_func = sigc::ptr_fun(&ign_func);
-	sig.max_quit_count = 10;
+	int ok = crash_test() && crash_write_test();
+	{
+		SigHandle sig;
+		sig.quit_func = sigc::ptr_fun(&quit_func);
+		sig.ign_func = sigc::ptr_fun(&ign_func);
+		sig.max_quit_count = 10;
+	
+		pid_t thispid = getpid();
+	
+		usleep(0.5 * 1E6);
+		// These signals should be caught by ign_func():
+		fprintf(stdout, "%s: sending SIGPIPE=%d, SIGHUP=%d\n", __FILE__, SIGPIPE, SIGHUP);
+		kill(thispid, SIGPIPE);
+		usleep(0.1 * 1E6);
+		kill(thispid, SIGHUP);
+	
+		usleep(0.5 * 1E6);
+		// These signals should be caught by quit_func():
+		fprintf(stdout, "%s: sending SIGINT=%d, SIGTERM=%d\n", __FILE__, SIGINT, SIGTERM);
+		kill(thispid, SIGINT);
+		usleep(0.1 * 1E6);
+		kill(thispid, SIGTERM);
+	
+		usleep(0.5 * 1E6);
+		int nquit = sig.get_quit_count();
+		int nign = sig.get_ign_count();
+		int ndef = sig.get_def_count();
+		fprintf(stdout, "%s: got nquit: %d, nign: %d, ndef: %d\n", __FILE__, nquit, nign, ndef);
+	
+	
+		ok = ok && (nquit == 2 && nign == 2);
+	}
 	
+	// Now with a signalfd in an event loop, signals are still blocked
+	EventLoop loop;
+	SigHandle *sigfd = new SigHandle(loop);
+	sigfd->ign_func = sigc::ptr_fun(&ign_func);
+	sigfd->sethandler(SIGUSR1, sigc::ptr_fun(&user_func));
+	sigfd->sethandler(SIGRTMIN, sigc::ptr_fun(&user_func));
+	loop.start();
+	
+	// Only one SigHandle at a time, two would race for each signal
+	try {
+		SigHandle second(loop);
+		fprintf(stdout, "%s: created a second SigHandle\n", __FILE__);
+		ok = false;
+	} catch (SigHandle::exception &e) {
+		fprintf(stdout, "%s: second SigHandle: %s\n", __FILE__, e.what());
+	}
+	
+	// Send several signals at once, real-time signals are queued
 	pid_t thispid = getpid();
-
-	usleep(0.5 * 1E6);
-	// These signals should be caught by ign_func():
-	fprintf(stdout, "%s: sending SIGPIPE=%d, SIGHUP=%d\n", __FILE__, SIGPIPE, SIGHUP);
-	kill(thispid, SIGPIPE);
-	usleep(0.1 * 1E6);
+	fprintf(stdout, "%s: sending SIGUSR1, SIGHUP and 3x SIGRTMIN\n", __FILE__);
+	kill(thispid, SIGUSR1);
 	kill(thispid, SIGHUP);
+	for (int i=0; i<3; i++)
+		kill(thispid, SIGRTMIN);
 	
-	usleep(0.5 * 1E6);
-	// These signals should be caught by quit_func():
-	fprintf(stdout, "%s: sending SIGINT=%d, SIGTERM=%d\n", __FILE__, SIGINT, SIGTERM);
-	kill(thispid, SIGINT);
-	usleep(0.1 * 1E6);
-	kill(thispid, SIGTERM);
-	
-	usleep(0.5 * 1E6);
-	int nquit = sig.get_quit_count();
-	int nign = sig.get_ign_count();
-	int ndef = sig.get_def_count();
-	fprintf(stdout, "%s: got nquit: %d, nign: %d, ndef: %d\n", __FILE__, nquit, nign, ndef);
-
+	usleep(0.2 * 1E6);
+	fprintf(stdout, "%s: got nusr1: %d, nrt: %d, nign: %zu\n", __FILE__, nusr1, nrt, sigfd->get_ign_count());
+	ok = ok && nusr1 == 1 && nrt == 3 && sigfd->get_ign_count() == 1;
+	
+	// Destroying a SigHandle waits for its handler running in the loop thread
+	sigfd->sethandler(SIGUSR2, sigc::ptr_fun(&slow_func));
+	kill(thispid, SIGUSR2);
+	while (!__atomic_load_n(&slowstate, __ATOMIC_ACQUIRE))
+		usleep(1000);
+	delete sigfd;
+	fprintf(stdout, "%s: slow handler state after destruction: %d\n", __FILE__, slowstate);
+	ok = ok && slowstate == 2;
+	
+	loop.stop();
 	
 	// Check if we caught exceptions
-	if (nquit == 2 && nign == 2) {
+	if (ok) {
 		fprintf(stdout, "%s: SUCCESS!\n", __FILE__);
 		exit(0);
 	} else {
@@ -21,10 +21,42 @@
 #include <string>
 #include <stdio.h>
 
+#include <sigc++/sigc++.h>
+
 #include "time++.h"
+#include "clock++.h"
+#include "pthread++.h"
 
 #include "libsiu-testing.h"
 
+// All threads format the same Time at once, they must all see the same result
+static const Time shared(123456789, 0.5);
+static int shared_errors = 0;
+
+static void format_shared() {
+	for (int i=0; i<1000; i++) {
+		if (string(shared.c_str()) != "123456789.500000000" || shared.as_str_tm()->tm_year != 73 || shared.strftime("%H:%M:%S") != "21:33:09")
+			__atomic_add_fetch(&shared_errors, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// Clock::TSC never goes backwards and stays close to CLOCK_MONOTONIC, also 
+// across recalibrations (every second)
+static int clock_errors = 0;
+
+static void read_clock() {
+	const int64_t end = Clock::nsec(Clock::MONOTONIC) + 2500000000LL;
+	int64_t prev = Clock::nsec(Clock::TSC), mono;
+	do {
+		const int64_t before = Clock::nsec(Clock::MONOTONIC);
+		const int64_t now = Clock::nsec(Clock::TSC);
+		mono = Clock::nsec(Clock::MONOTONIC);
+		if (now < prev || now < before - 1000000 || now > mono + 1000000)
+			__atomic_add_fetch(&clock_errors, 1, __ATOMIC_RELAXED);
+		prev = now;
+	} while (mono < end);
+}
+
 int main(int /* argc */, char *argv[]) {
 	DEBUGPRINT("testing %s\n", argv[0]);
 
@@ -46,4 +78,49 @@ int main(int /* argc */, char *argv[]) {
 	// Difference
 	DEBUGPRINT("t1 - t0 = %s\n", (t1 - t0).c_str());
 	DEBUGPRINT("t4 - t3 = %s\n", (t3 - t2).c_str());
+	if ((t3 - t2).as_time_t() != 3600 || string((t3 - t2).c_str()) != "3600.000000000")
+		return -1;
+	
+	// Broken-down time is computed lazily, and again after changes
+	if (t3.as_str_tm()->tm_hour != 22 || (++t3).as_str_tm()->tm_sec != 10)
+		return -1;
+	struct tm tm;
+	if (t3.as_str_tm(&tm)->tm_sec != 10 || tm.tm_min != 33 || string(t3.c_str()) != "123460390.123456780")
+		return -1;
+	
+	pthread::thread threads[4];
+	for (int i=0; i<4; i++)
+		threads[i].create(sigc::ptr_fun(format_shared));
+	for (int i=0; i<4; i++)
+		threads[i].join();
+	if (shared_errors) {
+		DEBUGPRINT("shared Time: %d errors\n", shared_errors);
+		return -1;
+	}
+	
+	// Integer nanosecond durations and time points
+	Duration d = Duration::sec(2) + Duration::msec(1500) - Duration::nsec(1);
+	if (d.as_nsec() != 3499999999LL || d.as_msec() != 3499 || (-d).as_timespec().tv_nsec != 500000001)
+		return -1;
+	
+	MonoTime m0 = MonoTime::now();
+	MonoTime m1 = MonoTime::now();
+	if (m1 < m0 || (m1 - m0) < Duration() || (m0 + d) - m0 != d)
+		return -1;
+	
+	pthread::thread readers[3];
+	for (int i=0; i<3; i++)
+		readers[i].create(sigc::ptr_fun(read_clock));
+	for (int i=0; i<3; i++)
+		readers[i].join();
+	DEBUGPRINT("Clock::TSC: %s, %.3f GHz, %d errors\n", Clock::tsc_usable() ? "TSC" : "CLOCK_MONOTONIC", Clock::tsc_ghz(), clock_errors);
+	if (clock_errors)
+		return -1;
+	
+	RealTime r0 = RealTime::now();
+	Time t4(r0);
+	if (t4.as_realtime() != r0 || t4.as_time_t() != r0.as_time_t())
+		return -1;
+	
+	return 0;
 }